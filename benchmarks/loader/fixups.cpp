@@ -0,0 +1,104 @@
+// Measures how long libmach-o takes to parse an image and to walk its rebases and binds,
+// and the peak RSS this needs. Runs natively on Linux, like load_ahead.cpp.
+// The fixups are applied to a buffer standing in for the image's __DATA.
+// Build it like load_ahead.cpp; add -DFIXUP_VECTORS to build it against a libmach-o older than
+// forEachRebase()/forEachBind(), which still collected the rebases and binds in vectors.
+// Generate the image with gen_dylib.py, e.g.: ./gen_dylib.py big.dylib 200000 50000
+// Usage: fixups <image> <iterations>
+#include "MachO.h"
+#include "fnv.h"
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+static std::vector<uint64_t> g_data;
+static uint64_t g_dataStart;
+static unsigned long g_count;
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static uint64_t* slot(uint64_t vmaddr)
+{
+	uint64_t index = (vmaddr - g_dataStart) / 8;
+
+	if (index >= g_data.size())
+		g_data.resize(index + 1);
+	return &g_data[index];
+}
+
+// Stands in for the symbol lookup
+static uint64_t hashName(const char* name)
+{
+	return Darling::fnv1a64(name, strlen(name));
+}
+
+#ifndef FIXUP_VECTORS
+static void onRebase(const MachO::Rebase& rebase, void*)
+{
+	*slot(rebase.vmaddr) += 0x10000;
+	g_count++;
+}
+
+static void onBind(const MachO::Bind& bind, void*)
+{
+	*slot(bind.vmaddr) = hashName(bind.name);
+	g_count++;
+}
+#endif
+
+int main(int argc, char** argv)
+{
+	if (argc < 3)
+	{
+		fprintf(stderr, "Usage: %s <image> <iterations>\n", argv[0]);
+		return 1;
+	}
+
+	int iterations = atoi(argv[2]);
+	struct rusage usage;
+	double start = now(), total;
+
+	for (int i = 0; i < iterations; i++)
+	{
+#ifdef FIXUP_VECTORS
+		MachO* mach = MachO::readFile(argv[1], "x86-64", false);
+#else
+		MachO* mach = MachO::readFile(argv[1], "x86-64", false, false);
+#endif
+
+		for (segment_command_64* seg : mach->segments64())
+		{
+			if (seg->initprot & VM_PROT_WRITE)
+				g_dataStart = seg->vmaddr;
+		}
+
+#ifdef FIXUP_VECTORS
+		for (MachO::Rebase* rebase : mach->rebases())
+			*slot(rebase->vmaddr) += 0x10000;
+		for (MachO::Bind* bind : mach->binds())
+			*slot(bind->vmaddr) = hashName(bind->name.c_str());
+		g_count += mach->rebases().size() + mach->binds().size();
+#else
+		mach->forEachRebase(onRebase, nullptr);
+		mach->forEachBind(onBind, nullptr);
+#endif
+
+		mach->close();
+		delete mach;
+	}
+
+	total = now() - start;
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("%.2f ms per image, %lu fixups, peak RSS %ld KiB\n",
+		total * 1000 / iterations, g_count / iterations, usage.ru_maxrss);
+	return 0;
+}
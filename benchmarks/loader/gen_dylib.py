@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+# Writes a synthetic x86_64 dylib for the loader benchmarks, with plain LC_DYLD_INFO_ONLY opcodes:
+# <rebases> pointer rebases and <binds> binds of distinct symbol names, all of them in __DATA,
+# after <text size> bytes of random __TEXT (rounded up to a page).
+# Usage: gen_dylib.py <output> <rebases> <binds> [text size]
+import os, struct, sys
+
+PAGE = 0x1000
+
+def uleb(v):
+	b = bytearray()
+	while True:
+		c = v & 0x7f
+		v >>= 7
+		if v:
+			b.append(c | 0x80)
+		else:
+			b.append(c)
+			return bytes(b)
+
+def segment(name, vmaddr, vmsize, fileoff, filesize, prot):
+	return struct.pack('<II16sQQQQiiII', 0x19, 72, name.encode(), vmaddr, vmsize, fileoff, filesize, prot, prot, 0, 0)
+
+out = sys.argv[1]
+rebases = int(sys.argv[2])
+binds = int(sys.argv[3])
+text = int(sys.argv[4]) if len(sys.argv) > 4 else PAGE
+text = (text + PAGE - 1) & ~(PAGE - 1)
+
+data = ((rebases + binds) * 8 + PAGE - 1) & ~(PAGE - 1)
+
+# REBASE_OPCODE_SET_TYPE_IMM pointer, SET_SEGMENT_AND_OFFSET_ULEB 1 0, then DO_REBASE_ADD_ADDR_ULEB 0 for each slot
+rebase = bytearray([0x11, 0x21]) + uleb(0)
+for i in range(rebases):
+	rebase += bytes([0x70]) + uleb(0)
+rebase += b'\0'
+
+# BIND_OPCODE_SET_DYLIB_ORDINAL_IMM 1, SET_TYPE_IMM pointer, SET_SEGMENT_AND_OFFSET_ULEB 1 after the rebased slots
+bind = bytearray([0x11, 0x51, 0x71]) + uleb(rebases * 8)
+for i in range(binds):
+	bind += bytes([0x40]) + ("_symbol_with_a_typical_length_%07d" % i).encode() + b'\0'
+	bind += bytes([0x90]) # DO_BIND
+bind += b'\0'
+
+linkedit = rebase + bind
+while len(linkedit) % 8:
+	linkedit += b'\0'
+linkedit_off = text + data
+
+cmds = segment('__TEXT', 0, text, 0, text, 5)
+cmds += segment('__DATA', text, data, text, data, 3)
+cmds += segment('__LINKEDIT', linkedit_off, (len(linkedit) + PAGE - 1) & ~(PAGE - 1), linkedit_off, len(linkedit), 1)
+cmds += struct.pack('<12I', 0x80000022, 48, linkedit_off, len(rebase), linkedit_off + len(rebase), len(bind), 0, 0, 0, 0, 0, 0)
+dylib = b'libfoo.dylib\0'
+dylib += b'\0' * ((8 - (24 + len(dylib)) % 8) % 8)
+cmds += struct.pack('<6I', 0xc, 24 + len(dylib), 24, 0, 0, 0) + dylib
+
+# MH_MAGIC_64, CPU_TYPE_X86_64, CPU_SUBTYPE_X86_64_ALL, MH_DYLIB
+image = bytearray(struct.pack('<IiiIIIII', 0xfeedfacf, 0x01000007, 3, 6, 5, len(cmds), 0, 0) + cmds)
+image += os.urandom(text - len(image))
+image += b'\0' * data
+image += linkedit
+
+with open(out, 'wb') as f:
+	f.write(image)
@@ -0,0 +1,157 @@
+// Loads a list of Mach-O images the way dyld does (parse, map the segments, rebase, bind), in list order,
+// and prints the wall-clock time. Unlike the programs in ../src, it runs natively on Linux.
+// With <threads> > 0, a pool of workers parses and maps the images ahead of the main thread,
+// which only applies the fixups, still in list order.
+// With <willneed> = 1, the writable segments are madvise(MADV_WILLNEED)'d right after being mapped, as dyld does.
+// Build it from the top of the source tree against the libmach-o and libutil of a Darling build in build/, e.g.:
+//   g++ -std=c++11 -O2 -Iinclude -Isrc/libmach-o -Isrc/util benchmarks/loader/load_ahead.cpp -o load_ahead -Lbuild/src/libmach-o -lmach-o build/src/util/libutil.a -ldl -lpthread
+// and generate the images with gen_dylib.py, e.g.:
+//   for i in $(seq -w 1 80); do ./gen_dylib.py lib$i.dylib $((4000 + RANDOM % 12000)) $((1000 + RANDOM % 4000)) $(((256 + RANDOM % 1792) * 1024)); done
+// Drop the page cache before each run (echo 3 > /proc/sys/vm/drop_caches) to measure a cold launch.
+// Usage: load_ahead <threads> <willneed> <image>...
+#include "MachO.h"
+#include "fnv.h"
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <atomic>
+#include <stdexcept>
+
+struct Loaded
+{
+	MachO* mach;
+	intptr_t slide;
+	bool ready;
+};
+
+static bool g_willneed;
+static std::vector<Loaded> g_loaded;
+static std::mutex g_mutex;
+static std::condition_variable g_cond;
+static std::atomic<size_t> g_next(0);
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void parseAndMap(const char* path, Loaded* out)
+{
+	MachO* mach = MachO::readFile(path, "x86-64", false, false);
+	uintptr_t low = ~uintptr_t(0), high = 0;
+	void* reserved;
+
+	for (segment_command_64* seg : mach->segments64())
+	{
+		low = std::min<uintptr_t>(low, seg->vmaddr);
+		high = std::max<uintptr_t>(high, (seg->vmaddr + seg->vmsize + 0xfff) & ~0xfffull);
+	}
+
+	reserved = ::mmap(nullptr, high - low, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (reserved == MAP_FAILED)
+		throw std::runtime_error("Cannot reserve the address space");
+
+	out->slide = intptr_t(reserved) - low;
+
+	for (segment_command_64* seg : mach->segments64())
+	{
+		size_t size = (seg->filesize + 0xfff) & ~0xfffull;
+		void* addr = (void*)(seg->vmaddr + out->slide);
+
+		if (!size)
+			continue;
+		if (::mmap(addr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, mach->fd(), seg->fileoff) == MAP_FAILED)
+			throw std::runtime_error(std::string("Cannot map ") + path);
+
+		if (g_willneed && (seg->initprot & VM_PROT_WRITE))
+			::madvise(addr, size, MADV_WILLNEED);
+	}
+
+	out->mach = mach;
+}
+
+static void onRebase(const MachO::Rebase& rebase, void* p)
+{
+	intptr_t slide = *static_cast<intptr_t*>(p);
+	*reinterpret_cast<uint64_t*>(rebase.vmaddr + slide) += slide;
+}
+
+static void onBind(const MachO::Bind& bind, void* p)
+{
+	intptr_t slide = *static_cast<intptr_t*>(p);
+
+	// Stands in for the symbol lookup
+	*reinterpret_cast<uint64_t*>(bind.vmaddr + slide) = Darling::fnv1a64(bind.name, strlen(bind.name));
+}
+
+static void worker(char** paths, size_t count)
+{
+	size_t i;
+
+	while ((i = g_next++) < count)
+	{
+		Loaded loaded;
+		parseAndMap(paths[i], &loaded);
+
+		std::lock_guard<std::mutex> l(g_mutex);
+		g_loaded[i] = loaded;
+		g_loaded[i].ready = true;
+		g_cond.notify_all();
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 4)
+	{
+		fprintf(stderr, "Usage: %s <threads> <willneed> <image>...\n", argv[0]);
+		return 1;
+	}
+
+	int threads = atoi(argv[1]);
+	char** paths = argv + 3;
+	size_t count = argc - 3;
+	std::vector<std::thread> pool;
+	double start = now(), waited = 0;
+
+	g_willneed = atoi(argv[2]) != 0;
+	g_loaded.resize(count);
+
+	for (int i = 0; i < threads; i++)
+		pool.push_back(std::thread(worker, paths, count));
+
+	for (size_t i = 0; i < count; i++)
+	{
+		Loaded* loaded = &g_loaded[i];
+
+		if (threads)
+		{
+			double w = now();
+			std::unique_lock<std::mutex> l(g_mutex);
+			g_cond.wait(l, [loaded] { return loaded->ready; });
+			waited += now() - w;
+		}
+		else
+			parseAndMap(paths[i], loaded);
+
+		loaded->mach->forEachRebase(onRebase, &loaded->slide);
+		loaded->mach->forEachBind(onBind, &loaded->slide);
+	}
+
+	double total = now() - start;
+
+	for (std::thread& t : pool)
+		t.join();
+
+	printf("%zu images, %d threads, willneed %d: %.1f ms (main thread waited %.1f ms)\n",
+		count, threads, int(g_willneed), total * 1000, waited * 1000);
+	return 0;
+}
@@ -0,0 +1,73 @@
+// Measures dlsym() throughput of N reader threads while another thread keeps calling dlopen()/dlclose().
+// Usage: dlsym_threads [readers] [library]
+#include <stdio.h>
+#include <stdlib.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+
+static volatile int stop = 0;
+static const char* library = "/usr/lib/libz.1.dylib";
+
+static void* reader(void* arg)
+{
+	long count = 0;
+	volatile void* sink;
+
+	while (!stop)
+	{
+		sink = dlsym(RTLD_DEFAULT, "malloc");
+		sink = dlsym(RTLD_DEFAULT, "strlen");
+		count += 2;
+	}
+
+	*(long*) arg = count;
+	return NULL;
+}
+
+static void* loader(void* arg)
+{
+	long count = 0;
+
+	while (!stop)
+	{
+		void* h = dlopen(library, RTLD_NOW);
+		if (h)
+			dlclose(h);
+		count++;
+	}
+
+	*(long*) arg = count;
+	return NULL;
+}
+
+int main(int argc, char** argv)
+{
+	int readers = 4, i;
+	pthread_t threads[64], loaderThread;
+	long counts[64], loads, total = 0;
+
+	if (argc > 1)
+		readers = atoi(argv[1]);
+	if (argc > 2)
+		library = argv[2];
+	if (readers > 64)
+		readers = 64;
+
+	for (i = 0; i < readers; i++)
+		pthread_create(&threads[i], NULL, reader, &counts[i]);
+	pthread_create(&loaderThread, NULL, loader, &loads);
+
+	sleep(3);
+	stop = 1;
+
+	for (i = 0; i < readers; i++)
+	{
+		pthread_join(threads[i], NULL);
+		total += counts[i];
+	}
+	pthread_join(loaderThread, NULL);
+
+	printf("%d readers: %ld lookups/s, %ld dlopen/dlclose pairs/s\n", readers, total / 3, loads / 3);
+	return 0;
+}
@@ -0,0 +1,20 @@
+// Measures the cost of loading a large framework: run it through runtest for the launch time.
+// Prints the peak RSS, which is reached while the dependencies are being loaded and bound.
+// Run it again with DYLD_PREBIND_CACHE=<dir> (twice, the first run fills the cache) to see the prebound launch.
+// benchmarks/loader/fixups.cpp measures the rebases and binds alone, natively on Linux.
+#include <stdio.h>
+#include <sys/resource.h>
+#import <Foundation/Foundation.h>
+
+int main()
+{
+	struct rusage usage;
+	NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+	NSString* str = [NSString stringWithFormat: @"%d", 42];
+
+	getrusage(RUSAGE_SELF, &usage);
+	printf("%s: peak RSS %ld KiB\n", [str UTF8String], usage.ru_maxrss);
+
+	[pool drain];
+	return 0;
+}
@@ -0,0 +1,81 @@
+// Measures how long throwing a C++ exception through Mach-O frames takes, the first time and afterwards.
+// The image has a few thousand functions with FDEs, so an unsorted __eh_frame makes the first throw slow.
+// Build it on Darwin first, e.g.:
+//   g++ -O1 -ftemplate-depth=5000 -Wl,-no_compact_unwind throw_latency.cpp -o throw_latency
+// Without -no_compact_unwind, the linker describes the functions in __unwind_info instead.
+// Usage: throw_latency [depth] [iterations]
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#define FUNCTIONS 4000
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static volatile int g_sink;
+
+// Every instantiation gets its own FDE, the exception goes through a recursion of depth frames
+template <int N> struct Frame
+{
+	__attribute__((noinline)) static int run(int depth)
+	{
+		if (depth <= 0)
+			throw N;
+		g_sink = N;
+		return Frame<(N + 1) % FUNCTIONS>::run(depth - 1) + 1;
+	}
+};
+
+// Forces all the instantiations to be emitted
+template <int N> struct Instantiate
+{
+	static void touch(volatile void** p)
+	{
+		*p = (void*) &Frame<N>::run;
+		Instantiate<N-1>::touch(p);
+	}
+};
+
+template <> struct Instantiate<-1>
+{
+	static void touch(volatile void**) {}
+};
+
+static double throwOnce(int depth)
+{
+	double start = now();
+
+	try
+	{
+		Frame<0>::run(depth);
+	}
+	catch (int)
+	{
+	}
+
+	return now() - start;
+}
+
+int main(int argc, char** argv)
+{
+	int depth = argc > 1 ? atoi(argv[1]) : 32;
+	int iterations = argc > 2 ? atoi(argv[2]) : 10000;
+	volatile void* p;
+	double first, total = 0;
+
+	Instantiate<FUNCTIONS-1>::touch(&p);
+
+	first = throwOnce(depth);
+
+	for (int i = 0; i < iterations; i++)
+		total += throwOnce(depth);
+
+	printf("first throw: %.3f ms, then %.3f us per throw (%d frames, %.3f us per frame)\n",
+		first * 1000, total * 1e6 / iterations, depth, total * 1e6 / iterations / depth);
+	return 0;
+}
@@ -0,0 +1,79 @@
+// Stresses weak definition coalescing: every library instantiates the same set of inline templates,
+// so each one brings hundreds of weak binds that have to be coalesced with all the libraries loaded before it.
+// Build the libraries on Darwin first, e.g.:
+//   for i in $(seq 0 63); do g++ -O2 -dynamiclib -DLIBRARY=$i weak_coalescing.cpp -o libweak$i.dylib; done
+// Usage: weak_coalescing [directory] [count]
+// Run it with DYLD_PRINT_STATISTICS=1 to see how many weak binds were coalesced.
+#include <stdio.h>
+#include <stdlib.h>
+#include <dlfcn.h>
+#include <sys/time.h>
+
+#define INSTANTIATIONS 500
+
+// Weak function, weak static variable and guard variable per instantiation
+template <int N> struct Node
+{
+	static int value()
+	{
+		static int counter = N;
+		return ++counter + Node<N-1>::value();
+	}
+};
+
+template <> struct Node<0>
+{
+	static int value() { return 0; }
+};
+
+#ifdef LIBRARY
+
+extern "C" int weak_entry()
+{
+	return Node<INSTANTIATIONS>::value();
+}
+
+#else
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main(int argc, char** argv)
+{
+	const char* dir = argc > 1 ? argv[1] : ".";
+	int count = argc > 2 ? atoi(argv[2]) : 64;
+	int loaded = 0, sum = Node<INSTANTIATIONS>::value();
+	double start = now(), elapsed;
+
+	for (int i = 0; i < count; i++)
+	{
+		char path[1024];
+		void* h;
+		int (*entry)();
+
+		snprintf(path, sizeof(path), "%s/libweak%d.dylib", dir, i);
+
+		if (!(h = dlopen(path, RTLD_NOW)))
+		{
+			fprintf(stderr, "%s\n", dlerror());
+			continue;
+		}
+
+		// All the copies of the static variables must have been coalesced into the main executable's ones
+		entry = (int (*)()) dlsym(h, "weak_entry");
+		if (entry)
+			sum = entry();
+		loaded++;
+	}
+
+	elapsed = now() - start;
+	printf("%d libraries loaded in %.3f ms (%.3f ms per library), result %d\n",
+		loaded, elapsed * 1000, loaded ? elapsed * 1000 / loaded : 0.0, sum);
+	return 0;
+}
+
+#endif
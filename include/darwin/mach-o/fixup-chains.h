@@ -0,0 +1,151 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _MACHO_FIXUP_CHAINS_H_
+#define _MACHO_FIXUP_CHAINS_H_
+#include <stdint.h>
+
+/*
+ * Layout of the LC_DYLD_CHAINED_FIXUPS payload, compatible with Apple's <mach-o/fixup-chains.h>.
+ * Only the pointer formats used on i386 and x86_64 are described here.
+ */
+
+/* header of the LC_DYLD_CHAINED_FIXUPS payload */
+struct dyld_chained_fixups_header
+{
+	uint32_t fixups_version; /* 0 */
+	uint32_t starts_offset; /* offset of dyld_chained_starts_in_image in chain_data */
+	uint32_t imports_offset; /* offset of imports table in chain_data */
+	uint32_t symbols_offset; /* offset of symbol strings in chain_data */
+	uint32_t imports_count; /* number of imported symbol names */
+	uint32_t imports_format; /* DYLD_CHAINED_IMPORT* */
+	uint32_t symbols_format; /* 0 => uncompressed, 1 => zlib compressed */
+};
+
+/* This struct is word aligned and immediately follows the header */
+struct dyld_chained_starts_in_image
+{
+	uint32_t seg_count;
+	uint32_t seg_info_offset[1]; /* each entry is offset into this struct for that segment, 0 if no fixups */
+};
+
+/* This struct is word aligned, one per segment with fixups */
+struct dyld_chained_starts_in_segment
+{
+	uint32_t size; /* size of this (amount kernel needs to copy) */
+	uint16_t page_size; /* 0x1000 or 0x4000 */
+	uint16_t pointer_format; /* DYLD_CHAINED_PTR_* */
+	uint64_t segment_offset; /* offset in memory to start of segment */
+	uint32_t max_valid_pointer; /* for 32-bit OS, any value beyond this is not a pointer */
+	uint16_t page_count; /* how many pages are in array */
+	uint16_t page_start[1]; /* each entry is offset in each page of first element in chain */
+	                        /* or DYLD_CHAINED_PTR_START_NONE if no fixups on page */
+};
+
+enum
+{
+	DYLD_CHAINED_PTR_START_NONE = 0xFFFF, /* used in page_start[] to denote a page with no fixups */
+	DYLD_CHAINED_PTR_START_MULTI = 0x8000, /* used in page_start[] to denote a page which has multiple starts */
+	DYLD_CHAINED_PTR_START_LAST = 0x8000, /* used in chain_starts[] to denote last start in list for page */
+};
+
+/* values for dyld_chained_starts_in_segment.pointer_format */
+enum
+{
+	DYLD_CHAINED_PTR_ARM64E = 1,
+	DYLD_CHAINED_PTR_64 = 2, /* target is vmaddr */
+	DYLD_CHAINED_PTR_32 = 3,
+	DYLD_CHAINED_PTR_32_CACHE = 4,
+	DYLD_CHAINED_PTR_32_FIRMWARE = 5,
+	DYLD_CHAINED_PTR_64_OFFSET = 6, /* target is vm offset */
+};
+
+/* DYLD_CHAINED_PTR_64/DYLD_CHAINED_PTR_64_OFFSET */
+struct dyld_chained_ptr_64_rebase
+{
+	uint64_t target : 36, /* 64GB max image size (DYLD_CHAINED_PTR_64 => vmAddr, DYLD_CHAINED_PTR_64_OFFSET => runtime offset) */
+		high8 : 8, /* top 8 bits set to this (DYLD_CHAINED_PTR_64 => after slide added, DYLD_CHAINED_PTR_64_OFFSET => before slide added) */
+		reserved : 7, /* all zeros */
+		next : 12, /* 4-byte stride */
+		bind : 1; /* == 0 */
+};
+
+/* DYLD_CHAINED_PTR_64 */
+struct dyld_chained_ptr_64_bind
+{
+	uint64_t ordinal : 24,
+		addend : 8, /* 0 thru 255 */
+		reserved : 19, /* all zeros */
+		next : 12, /* 4-byte stride */
+		bind : 1; /* == 1 */
+};
+
+/* DYLD_CHAINED_PTR_32 */
+struct dyld_chained_ptr_32_rebase
+{
+	uint32_t target : 26, /* vmaddr, 64MB max image size */
+		next : 5, /* 4-byte stride */
+		bind : 1; /* == 0 */
+};
+
+/* DYLD_CHAINED_PTR_32 */
+struct dyld_chained_ptr_32_bind
+{
+	uint32_t ordinal : 20,
+		addend : 6, /* 0 thru 63 */
+		next : 5, /* 4-byte stride */
+		bind : 1; /* == 1 */
+};
+
+/* values for dyld_chained_fixups_header.imports_format */
+enum
+{
+	DYLD_CHAINED_IMPORT = 1,
+	DYLD_CHAINED_IMPORT_ADDEND = 2,
+	DYLD_CHAINED_IMPORT_ADDEND64 = 3,
+};
+
+/* DYLD_CHAINED_IMPORT */
+struct dyld_chained_import
+{
+	uint32_t lib_ordinal : 8,
+		weak_import : 1,
+		name_offset : 23;
+};
+
+/* DYLD_CHAINED_IMPORT_ADDEND */
+struct dyld_chained_import_addend
+{
+	uint32_t lib_ordinal : 8,
+		weak_import : 1,
+		name_offset : 23;
+	int32_t addend;
+};
+
+/* DYLD_CHAINED_IMPORT_ADDEND64 */
+struct dyld_chained_import_addend64
+{
+	uint64_t lib_ordinal : 16,
+		weak_import : 1,
+		reserved : 15,
+		name_offset : 32;
+	uint64_t addend;
+};
+
+#endif /* _MACHO_FIXUP_CHAINS_H_ */
@@ -0,0 +1,417 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "CompactUnwind.h"
+#include "eh/BufWriter.h"
+#include <cstring>
+#include <stdexcept>
+
+// From <mach-o/compact_unwind_encoding.h>
+#define UNWIND_HAS_LSDA 0x40000000
+#define UNWIND_PERSONALITY_MASK 0x30000000
+#define UNWIND_MODE_MASK 0x0F000000
+#define UNWIND_MODE_FRAME 0x01000000 // UNWIND_X86_64_MODE_RBP_FRAME, UNWIND_X86_MODE_EBP_FRAME
+#define UNWIND_MODE_STACK_IMMD 0x02000000
+#define UNWIND_MODE_STACK_IND 0x03000000
+#define UNWIND_FRAME_REGISTERS 0x00007FFF
+#define UNWIND_FRAME_OFFSET 0x00FF0000
+#define UNWIND_FRAMELESS_STACK_SIZE 0x00FF0000
+#define UNWIND_FRAMELESS_STACK_ADJUST 0x0000E000
+#define UNWIND_FRAMELESS_STACK_REG_COUNT 0x00001C00
+#define UNWIND_FRAMELESS_STACK_REG_PERMUTATION 0x000003FF
+
+#define UNWIND_SECOND_LEVEL_REGULAR 2
+#define UNWIND_SECOND_LEVEL_COMPRESSED 3
+
+#define DW_CFA_nop 0x00
+#define DW_CFA_def_cfa 0x0c
+#define DW_CFA_def_cfa_offset 0x0e
+#define DW_CFA_offset 0x80
+#define DW_EH_PE_absptr 0x00
+#define DW_EH_PE_indirect 0x80
+
+// DWARF register numbers as libgcc knows them, indexed by the compact unwind register numbers
+#ifdef __x86_64__
+static const int g_registers[] = { -1, 3 /* rbx */, 12, 13, 14, 15 /* r12-r15 */, 6 /* rbp */ };
+static const int g_regSP = 7, g_regFP = 6, g_regRA = 16;
+#else
+static const int g_registers[] = { -1, 3 /* ebx */, 1 /* ecx */, 2 /* edx */, 7 /* edi */, 6 /* esi */, 5 /* ebp */ };
+static const int g_regSP = 4, g_regFP = 5, g_regRA = 8;
+#endif
+
+static inline unsigned extract(uint32_t encoding, uint32_t mask)
+{
+	return (encoding >> __builtin_ctz(mask)) & (mask >> __builtin_ctz(mask));
+}
+
+static inline uint32_t read32(const uint8_t* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint16_t read16(const uint8_t* p)
+{
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+bool CompactUnwind::lookup(const uint8_t* info, size_t size, uint32_t pc, Function* func)
+{
+	// unwind_info_section_header
+	if (size < 7*sizeof(uint32_t) || read32(info) != 1)
+		return false;
+
+	const uint32_t commonOffset = read32(info + 4), commonCount = read32(info + 8);
+	const uint32_t personalityOffset = read32(info + 12), personalityCount = read32(info + 16);
+	const uint32_t indexOffset = read32(info + 20), indexCount = read32(info + 24);
+	const size_t IndexEntrySize = 3*sizeof(uint32_t);
+
+	if (indexCount < 2 || indexOffset + uint64_t(indexCount) * IndexEntrySize > size
+		|| commonOffset + uint64_t(commonCount) * sizeof(uint32_t) > size
+		|| personalityOffset + uint64_t(personalityCount) * sizeof(uint32_t) > size)
+		return false;
+
+	// First level: the last entry is a sentinel marking the end of the last function
+	const uint8_t* index = info + indexOffset;
+	size_t lo = 0, n = indexCount - 1;
+
+	if (pc < read32(index) || pc >= read32(index + (indexCount-1)*IndexEntrySize))
+		return false;
+
+	while (n > 1)
+	{
+		size_t half = n / 2;
+		if (read32(index + (lo + half)*IndexEntrySize) <= pc)
+			lo += half;
+		n -= half;
+	}
+
+	const uint8_t* entry = index + lo*IndexEntrySize;
+	const uint32_t pageBase = read32(entry);
+	const uint32_t pageOffset = read32(entry + 4);
+	const uint32_t pageEnd = read32(entry + IndexEntrySize); // start of the next page's functions
+	const uint8_t* page = info + pageOffset;
+	uint32_t start, end, encoding;
+
+	if (!pageOffset || pageOffset + 2*sizeof(uint32_t) > size)
+		return false;
+
+	const uint32_t kind = read32(page);
+	const uint16_t entriesOffset = read16(page + 4), entryCount = read16(page + 6);
+
+	if (!entryCount)
+		return false;
+
+	if (kind == UNWIND_SECOND_LEVEL_REGULAR)
+	{
+		// unwind_info_regular_second_level_entry: function offset, encoding
+		const uint8_t* entries = page + entriesOffset;
+
+		if (pageOffset + entriesOffset + uint64_t(entryCount) * 8 > size)
+			return false;
+
+		for (lo = 0, n = entryCount; n > 1; )
+		{
+			size_t half = n / 2;
+			if (read32(entries + (lo + half)*8) <= pc)
+				lo += half;
+			n -= half;
+		}
+
+		start = read32(entries + lo*8);
+		encoding = read32(entries + lo*8 + 4);
+		end = (lo + 1 < entryCount) ? read32(entries + (lo+1)*8) : pageEnd;
+	}
+	else if (kind == UNWIND_SECOND_LEVEL_COMPRESSED)
+	{
+		// 24-bit function offset from the page base, 8-bit index into the common or page encodings
+		const uint16_t encodingsOffset = read16(page + 8), encodingsCount = read16(page + 10);
+		const uint8_t* entries = page + entriesOffset;
+		const uint32_t rel = pc - pageBase;
+		uint32_t encodingIndex;
+
+		if (pageOffset + entriesOffset + uint64_t(entryCount) * 4 > size
+			|| pageOffset + encodingsOffset + uint64_t(encodingsCount) * 4 > size)
+			return false;
+
+		for (lo = 0, n = entryCount; n > 1; )
+		{
+			size_t half = n / 2;
+			if ((read32(entries + (lo + half)*4) & 0xFFFFFF) <= rel)
+				lo += half;
+			n -= half;
+		}
+
+		start = pageBase + (read32(entries + lo*4) & 0xFFFFFF);
+		encodingIndex = read32(entries + lo*4) >> 24;
+		end = (lo + 1 < entryCount) ? pageBase + (read32(entries + (lo+1)*4) & 0xFFFFFF) : pageEnd;
+
+		if (encodingIndex < commonCount)
+			encoding = read32(info + commonOffset + encodingIndex*4);
+		else if (encodingIndex - commonCount < encodingsCount)
+			encoding = read32(page + encodingsOffset + (encodingIndex - commonCount)*4);
+		else
+			return false;
+	}
+	else
+		return false;
+
+	if (pc < start || pc >= end)
+		return false;
+
+	func->start = start;
+	func->end = end;
+	func->encoding = encoding;
+	func->lsda = 0;
+	func->personality = 0;
+
+	if (encoding & UNWIND_HAS_LSDA)
+	{
+		uint32_t lsda;
+		if (!lookupLSDA(info, size, read32(entry + 8), read32(entry + IndexEntrySize + 8), start, &lsda))
+			return false;
+		func->lsda = lsda;
+	}
+
+	if (unsigned personality = extract(encoding, UNWIND_PERSONALITY_MASK))
+	{
+		if (personality > personalityCount)
+			return false;
+		func->personality = read32(info + personalityOffset + (personality-1)*4);
+	}
+
+	return true;
+}
+
+bool CompactUnwind::lookupLSDA(const uint8_t* info, size_t size, uint32_t from, uint32_t to, uint32_t func, uint32_t* lsda)
+{
+	// unwind_info_section_header_lsda_index_entry: function offset, LSDA offset, sorted by function
+	size_t lo = 0, n = (to - from) / 8;
+
+	if (to < from || to > size || !n)
+		return false;
+
+	while (n > 1)
+	{
+		size_t half = n / 2;
+		if (read32(info + from + (lo + half)*8) <= func)
+			lo += half;
+		n -= half;
+	}
+
+	if (read32(info + from + lo*8) != func)
+		return false;
+
+	*lsda = read32(info + from + lo*8 + 4);
+	return true;
+}
+
+void CompactUnwind::savedRegisters(uint32_t count, uint32_t permutation, int regs[6])
+{
+	// The permutation is a Lehmer code of the registers in the order they were pushed
+	static const uint32_t factors[7][6] = {
+		{ 0 }, { 1 }, { 5, 1 }, { 20, 4, 1 }, { 60, 12, 3, 1 }, { 120, 24, 6, 2, 1 }, { 120, 24, 6, 2, 1, 1 }
+	};
+	bool used[7] = { false };
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t rank = permutation / factors[count][i];
+		permutation -= rank * factors[count][i];
+
+		for (int reg = 1, free = 0; reg < 7; reg++)
+		{
+			if (used[reg])
+				continue;
+			if (free++ == int(rank))
+			{
+				regs[i] = reg;
+				used[reg] = true;
+				break;
+			}
+		}
+	}
+}
+
+bool CompactUnwind::encodingToCFI(BufWriter& writer, const Function& func)
+{
+	const uint32_t encoding = func.encoding;
+
+	switch (encoding & UNWIND_MODE_MASK)
+	{
+		case UNWIND_MODE_FRAME:
+		{
+			// CFA = fp + 2 words, the registers are saved below the saved fp
+			unsigned offset = extract(encoding, UNWIND_FRAME_OFFSET);
+			unsigned registers = extract(encoding, UNWIND_FRAME_REGISTERS);
+
+			writer.write(DW_CFA_def_cfa);
+			writer.writeULEB128(g_regFP);
+			writer.writeULEB128(2*sizeof(void*));
+			writer.write(DW_CFA_offset | g_regFP);
+			writer.writeULEB128(2);
+
+			for (unsigned i = 0; i < 5; i++, registers >>= 3)
+			{
+				unsigned reg = registers & 7;
+				if (!reg)
+					continue;
+				if (reg > 6)
+					return false;
+				writer.write(DW_CFA_offset | g_registers[reg]);
+				writer.writeULEB128(2 + offset - i);
+			}
+			return true;
+		}
+		case UNWIND_MODE_STACK_IMMD:
+		case UNWIND_MODE_STACK_IND:
+		{
+			// CFA = sp + stack size, the registers were pushed right below the return address
+			uint32_t stackSize = extract(encoding, UNWIND_FRAMELESS_STACK_SIZE);
+			uint32_t count = extract(encoding, UNWIND_FRAMELESS_STACK_REG_COUNT);
+			int regs[6];
+
+			if ((encoding & UNWIND_MODE_MASK) == UNWIND_MODE_STACK_IND)
+			{
+				// The size is the immediate of the sub instruction at the given offset into the function
+				uint32_t immediate;
+				memcpy(&immediate, reinterpret_cast<const void*>(func.start + stackSize), sizeof(immediate));
+				stackSize = immediate + extract(encoding, UNWIND_FRAMELESS_STACK_ADJUST) * sizeof(void*);
+			}
+			else
+				stackSize *= sizeof(void*);
+
+			if (count > 6)
+				return false;
+
+			writer.write(DW_CFA_def_cfa_offset);
+			writer.writeULEB128(stackSize);
+
+			savedRegisters(count, extract(encoding, UNWIND_FRAMELESS_STACK_REG_PERMUTATION), regs);
+
+			for (uint32_t i = 0; i < count; i++)
+			{
+				writer.write(DW_CFA_offset | g_registers[regs[i]]);
+				writer.writeULEB128(1 + count - i);
+			}
+			return true;
+		}
+		default:
+			return false; // no unwind info, or DWARF
+	}
+}
+
+// Fills the entry length preceding start and pads the entry to the pointer size
+static void finishEntry(BufWriter& writer, uint32_t* length, uintptr_t start)
+{
+	while ((writer.pos() - start) % sizeof(void*))
+		writer.write(DW_CFA_nop);
+	*length = uint32_t(writer.pos() - start);
+}
+
+const void* CompactUnwind::findFDE(const FileMap::ImageMap* map, uintptr_t pc, uintptr_t* funcStart)
+{
+	static __thread uintptr_t t_buffer[64];
+	const uint8_t* info = reinterpret_cast<const uint8_t*>(map->unwind_info.first + map->slide);
+	Function func;
+
+	if (!map->unwind_info.second || pc < map->text || pc - map->text > UINT32_MAX)
+		return nullptr;
+
+	if (!lookup(info, map->unwind_info.second, uint32_t(pc - map->text), &func))
+		return nullptr;
+
+	func.start += map->text;
+	func.end += map->text;
+	if (func.lsda)
+		func.lsda += map->text;
+	if (func.personality)
+		func.personality += map->text;
+
+	try
+	{
+		BufWriter writer(t_buffer, sizeof(t_buffer));
+		uint32_t* length;
+		uintptr_t cieStart, fdeStart, start;
+
+		// CIE, all pointers are absolute
+		cieStart = writer.pos();
+		length = reinterpret_cast<uint32_t*>(writer.posPtr());
+		writer.write32(0);
+		start = writer.pos();
+		writer.write32(0); // CIE id
+		writer.write(1); // version
+		writer.writeString(func.personality ? "zPLR" : "zR");
+		writer.writeULEB128(1); // code alignment
+		writer.writeLEB128(-int(sizeof(void*))); // data alignment
+		writer.write(g_regRA);
+
+		if (func.personality)
+		{
+			writer.writeULEB128(1 + sizeof(void*) + 1 + 1);
+			writer.write(DW_EH_PE_indirect | DW_EH_PE_absptr);
+			writer.writePtr(func.personality);
+			writer.write(DW_EH_PE_absptr); // LSDA
+		}
+		else
+			writer.writeULEB128(1);
+		writer.write(DW_EH_PE_absptr); // FDE pointers
+
+		// On entry, CFA = sp + 1 word and the return address is right below it
+		writer.write(DW_CFA_def_cfa);
+		writer.writeULEB128(g_regSP);
+		writer.writeULEB128(sizeof(void*));
+		writer.write(DW_CFA_offset | g_regRA);
+		writer.writeULEB128(1);
+		finishEntry(writer, length, start);
+
+		// FDE
+		fdeStart = writer.pos();
+		length = reinterpret_cast<uint32_t*>(writer.posPtr());
+		writer.write32(0);
+		start = writer.pos();
+		writer.write32(uint32_t(writer.pos() - cieStart)); // CIE pointer
+		writer.writePtr(func.start);
+		writer.writePtr(func.end - func.start);
+
+		if (func.personality)
+		{
+			writer.writeULEB128(sizeof(void*));
+			writer.writePtr(func.lsda);
+		}
+		else
+			writer.writeULEB128(0);
+
+		if (!encodingToCFI(writer, func))
+			return nullptr;
+		finishEntry(writer, length, start);
+
+		writer.write32(0); // terminating entry
+
+		*funcStart = func.start;
+		return reinterpret_cast<const void*>(fdeStart);
+	}
+	catch (const std::exception&)
+	{
+		return nullptr;
+	}
+}
@@ -0,0 +1,59 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef COMPACTUNWIND_H
+#define COMPACTUNWIND_H
+#include <stdint.h>
+#include <stddef.h>
+#include "FileMap.h"
+
+class BufWriter;
+
+// Interpreter of __unwind_info, the compact unwind encodings Apple's linker generates.
+//
+// Most functions in modern binaries have no FDE in __eh_frame, only a 32-bit encoding
+// found through a two level page table. libgcc only understands DWARF CFI, so the encoding
+// is translated into a minimal CIE + FDE describing the frame after the prologue, which is
+// the state of every frame an exception or a backtrace passes through.
+class CompactUnwind
+{
+public:
+	// Returns nullptr if the function has no compact encoding or uses DWARF (and thus has an FDE in __eh_frame).
+	// The FDE is built in a per-thread buffer and stays valid until the next call on the same thread.
+	static const void* findFDE(const FileMap::ImageMap* map, uintptr_t pc, uintptr_t* funcStart);
+
+private:
+	struct Function
+	{
+		uintptr_t start, end;
+		uint32_t encoding;
+		uintptr_t lsda;
+		uintptr_t personality; // address of the pointer to the personality routine
+	};
+
+	// pc is relative to the mach header
+	static bool lookup(const uint8_t* info, size_t size, uint32_t pc, Function* func);
+	static bool lookupLSDA(const uint8_t* info, size_t size, uint32_t from, uint32_t to, uint32_t func, uint32_t* lsda);
+
+	// Writes the CFA rule and register locations for the encoding, false if it cannot be expressed
+	static bool encodingToCFI(BufWriter& writer, const Function& func);
+	static void savedRegisters(uint32_t count, uint32_t permutation, int regs[6]);
+};
+
+#endif
@@ -0,0 +1,81 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Exports.h"
+#include "StringPool.h"
+#include "log.h"
+
+Exports::Exports()
+	: m_trie(nullptr), m_size(0), m_base(0)
+{
+}
+
+Exports::~Exports()
+{
+	for (MachO::Export* exp : m_exports)
+		delete exp;
+}
+
+void Exports::setTrie(const uint8_t* trie, size_t size, uintptr_t base)
+{
+	m_trie = trie;
+	m_size = size;
+	m_base = base;
+}
+
+const MachO::Export* Exports::findInCache(const char* interned) const
+{
+	return m_cache.find(StringPool::hashInterned(interned), [interned](const MachO::Export* exp) { return exp->name == interned; });
+}
+
+const MachO::Export* Exports::find(const char* name) const
+{
+	MachO::Export exp;
+
+	if (!m_trie)
+		return nullptr;
+
+	// A name that has never been interned cannot be in the cache
+	if (const char* interned = StringPool::find(name))
+	{
+		if (const MachO::Export* cached = findInCache(interned))
+			return cached;
+	}
+
+	// The trie is immutable, only successful lookups need the lock
+	if (!MachO::findExport(m_trie, m_trie + m_size, name, &exp))
+		return nullptr;
+
+	// Shared with all other images exporting or importing the same name
+	exp.name = StringPool::intern(name);
+
+	Darling::MutexLock l(m_cacheMutex);
+
+	if (const MachO::Export* cached = findInCache(exp.name))
+		return cached; // someone else was faster
+
+	exp.addr += m_base;
+	LOG << "export: " << name << " flags=" << std::hex << exp.flag << std::dec << " addr=" << (void*)exp.addr << std::endl;
+
+	MachO::Export* stored = new MachO::Export(exp);
+	m_exports.push_back(stored);
+	m_cache.insert(StringPool::hashInterned(exp.name), stored);
+
+	return stored;
+}
@@ -0,0 +1,56 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef EXPORTS_H
+#define EXPORTS_H
+#include <stdint.h>
+#include <vector>
+#include "MachO.h"
+#include "mutex.h"
+#include "AtomicHashSet.h"
+
+// Symbols exported by a single Mach-O image.
+// Nothing is read in advance: the first lookup of a name walks the image's export trie in the loaded __LINKEDIT
+// and symbols that are found get copied into a cache, which later lookups consult without taking any locks.
+class Exports
+{
+public:
+	Exports();
+	~Exports();
+
+	// The trie must stay mapped for as long as this object exists
+	void setTrie(const uint8_t* trie, size_t size, uintptr_t base);
+
+	// Looks up a symbol by its Mach-O name (including the leading underscore).
+	// The returned pointer stays valid for the lifetime of this object.
+	const MachO::Export* find(const char* name) const;
+private:
+	const MachO::Export* findInCache(const char* interned) const;
+
+	const uint8_t* m_trie;
+	size_t m_size;
+	uintptr_t m_base;
+
+	// Keyed by the interned name
+	mutable Darling::AtomicHashSet<const MachO::Export> m_cache;
+	mutable std::vector<MachO::Export*> m_exports;
+	mutable Darling::Mutex m_cacheMutex;
+};
+
+#endif
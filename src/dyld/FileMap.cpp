@@ -25,22 +25,111 @@ along with Darling.  If not, see <http://www.gnu.org/licenses/>.
 #include <iostream>
 #include <stdexcept>
 #include <sstream>
+#include <algorithm>
+
+FileMap::FileMap()
+	: m_snapshot(new Snapshot)
+{
+}
 
 FileMap::~FileMap()
 {
-	for (auto m : m_maps)
+	const Snapshot* s = m_snapshot.load();
+
+	for (ImageMap* map : s->images)
+	{
+		delete map->header;
+		delete map;
+	}
+
+	delete s;
+	for (const Snapshot* old : m_retiredSnapshots)
+		delete old;
+}
+
+bool FileMap::addRange(uintptr_t base, ImageMap* map)
+{
+	const Snapshot* old = m_snapshot.load(std::memory_order_relaxed);
+	size_t pos = std::lower_bound(old->bases.begin(), old->bases.end(), base) - old->bases.begin();
+	Snapshot* s;
+
+	if (pos < old->bases.size() && old->bases[pos] == base)
+		return false;
+
+	s = new Snapshot(*old);
+	s->bases.insert(s->bases.begin() + pos, base);
+	s->maps.insert(s->maps.begin() + pos, map);
+
+	if (map)
+	{
+		auto header = std::make_pair(const_cast<const mach_header*>(map->header), map);
+
+		s->images.push_back(map);
+		s->headers.insert(std::lower_bound(s->headers.begin(), s->headers.end(), header), header);
+	}
+
+	m_snapshot.store(s, std::memory_order_release);
+	m_retiredSnapshots.push_back(old);
+
+	return true;
+}
+
+static bool compareSymbolAddr(const FileMap::SymbolAddr& a, const FileMap::SymbolAddr& b)
+{
+	// Named entries go first, so that they win over function starts at the same address
+	if (a.addr != b.addr)
+		return a.addr < b.addr;
+	return a.strx != FileMap::NoName && b.strx == FileMap::NoName;
+}
+
+// Where the given part of the file ended up in memory, if it is mapped at all
+template <typename Segment>
+static const uint8_t* mappedData(const std::vector<Segment*>& segments, uintptr_t slide, uint32_t fileoff, uint32_t size)
+{
+	for (const Segment* seg : segments)
 	{
-		if (m.second)
-			delete m.second->header;
-		delete m.second;
+		if (size && fileoff >= seg->fileoff && fileoff + size <= seg->fileoff + seg->filesize)
+			return reinterpret_cast<const uint8_t*>(seg->vmaddr + slide + fileoff - seg->fileoff);
 	}
+	return nullptr;
 }
 
-const FileMap::ImageMap* FileMap::add(const MachO& mach, uintptr_t slide, uintptr_t base, bool bindLazy)
+template <typename Segment>
+static void mapSegments(const MachO& mach, const std::vector<Segment*>& segments, uintptr_t slide, FileMap::ImageMap* symbol_map)
+{
+	const MachO::SymtabInfo& symtab = mach.get_symtab_info();
+	std::pair<uint32_t,uint32_t> lazy_bind_info = mach.get_lazy_bind_info();
+	std::pair<uint32_t,uint32_t> function_starts = mach.get_function_starts();
+
+	for (const Segment* seg : segments)
+	{
+		symbol_map->segments.push_back(seg->vmaddr + slide);
+		if (seg->fileoff == 0 && seg->filesize)
+			symbol_map->text = seg->vmaddr + slide;
+	}
+
+	// Find where the loaded segments have the lazy binding info and the symbols
+	if ((symbol_map->lazy_binds = mappedData(segments, slide, lazy_bind_info.first, lazy_bind_info.second)))
+		symbol_map->lazy_binds_size = lazy_bind_info.second;
+
+	symbol_map->symtab = mappedData(segments, slide, symtab.symoff, symtab.nsyms * (mach.is64() ? 16 : 12));
+	symbol_map->strtab = reinterpret_cast<const char*>(mappedData(segments, slide, symtab.stroff, symtab.strsize));
+	if (symbol_map->symtab && symbol_map->strtab)
+	{
+		symbol_map->nsyms = symtab.nsyms;
+		symbol_map->strsize = symtab.strsize;
+	}
+
+	if ((symbol_map->function_starts = mappedData(segments, slide, function_starts.first, function_starts.second)))
+		symbol_map->function_starts_size = function_starts.second;
+}
+
+const FileMap::ImageMap* FileMap::add(const MachO& mach, uintptr_t slide, uintptr_t base, Exports* exports, const std::vector<LoadedLibrary*>& dependencies)
 {
 	ImageMap* symbol_map = new ImageMap;
 
 	symbol_map->filename = mach.filename();
+	symbol_map->exports = exports;
 	symbol_map->base = base;
 	symbol_map->slide = slide;
 	
@@ -50,47 +139,51 @@ const FileMap::ImageMap* FileMap::add(const MachO& mach, uintptr_t slide, uintpt
 	*symbol_map->header = mach.header();
 	
 	symbol_map->eh_frame = mach.get_eh_frame();
+	symbol_map->eh_frame_hdr = nullptr;
 	symbol_map->unwind_info = mach.get_unwind_info();
 	symbol_map->sections = mach.sections();
+	symbol_map->dependencies = dependencies;
+	symbol_map->two_level = (mach.header().flags & MH_TWOLEVEL) != 0;
 	
-	if (!bindLazy)
-	{
-		for (auto* b : mach.binds())
-		{
-			if (!b->is_lazy)
-				continue;
-			symbol_map->lazy_binds.push_back(*b);
-		}
-	}
+	symbol_map->lazy_binds = nullptr;
+	symbol_map->lazy_binds_size = 0;
+	symbol_map->symtab = nullptr;
+	symbol_map->nsyms = 0;
+	symbol_map->strtab = nullptr;
+	symbol_map->strsize = 0;
+	symbol_map->function_starts = nullptr;
+	symbol_map->function_starts_size = 0;
+	symbol_map->text = base;
+	symbol_map->is64 = mach.is64();
+	symbol_map->symbols = nullptr;
+
+	if (mach.is64())
+		mapSegments(mach, mach.segments64(), slide, symbol_map);
+	else
+		mapSegments(mach, mach.segments(), slide, symbol_map);
 
-	if (!m_maps.insert(std::make_pair(base, symbol_map)).second)
+	for (const char* rpath : mach.rpaths())
+		symbol_map->rpaths.push_back(rpath);
+
+	// The image map is complete, make it visible
+	Darling::MutexLock l(m_writeMutex);
+
+	if (!addRange(base, symbol_map))
 	{
 		std::stringstream ss;
 		ss << "dupicated base addr: " << (void*) base << " in " << mach.filename();
+		delete symbol_map->header;
+		delete symbol_map;
 		throw std::runtime_error(ss.str());
 	}
 
-	m_maps_vec.push_back(symbol_map);
-	m_maps_mach[symbol_map->header] = symbol_map;
-
-	for (MachO::Symbol sym : mach.symbols())
-	{
-		if (sym.name.empty() || sym.name[0] != '_')
-			continue;
-		sym.addr += slide;
-		if (sym.addr < base)
-			continue;
-		symbol_map->symbols.insert(std::make_pair(sym.addr, sym.name.substr(1)));
-	}
-	for (const char* rpath : mach.rpaths())
-		symbol_map->rpaths.push_back(rpath);
-
 	return symbol_map;
 }
 
 void FileMap::addWatchDog(uintptr_t addr)
 {
-	bool r = m_maps.insert(std::make_pair(addr, (ImageMap*)NULL)).second;
+	Darling::MutexLock l(m_writeMutex);
+	bool r = addRange(addr, nullptr);
 	assert(r);
 }
 
@@ -127,8 +220,9 @@ const char* FileMap::gdbInfoForAddr(const void* p) const
 
 const FileMap::ImageMap* FileMap::mainExecutable() const
 {
-	assert(!m_maps_vec.empty());
-	return m_maps_vec[0];
+	const Snapshot* s = snapshot();
+	assert(!s->images.empty());
+	return s->images[0];
 }
 
 const char* FileMap::fileNameForAddr(const void* p) const
@@ -139,62 +233,183 @@ const char* FileMap::fileNameForAddr(const void* p) const
 	return map->filename.c_str();
 }
 
+const FileMap::ImageMap* FileMap::findImage(const Snapshot* s, uintptr_t addr)
+{
+	const uintptr_t* bases = s->bases.data();
+	size_t n = s->bases.size(), pos = 0;
+
+	if (!n || addr < bases[0])
+		return nullptr;
+
+	// Index of the last start address <= addr, with conditional moves instead of unpredictable branches
+	while (n > 1)
+	{
+		size_t half = n / 2;
+		pos = (bases[pos + half] <= addr) ? pos + half : pos;
+		n -= half;
+	}
+
+	// Beyond the last start address there is nothing known to be mapped
+	if (pos + 1 == s->bases.size())
+		return nullptr;
+
+	return s->maps[pos];
+}
+
 const FileMap::ImageMap* FileMap::imageMapForAddr(const void* p) const
 {
-	uintptr_t addr = reinterpret_cast<uintptr_t>(p);
-	const ImageMap* symbol_map;
-	
-	std::map<uintptr_t, ImageMap*>::const_iterator found = m_maps.upper_bound(addr);
-	if (found == m_maps.begin() || found == m_maps.end())
-		return 0;
-	
-	--found;
-	return found->second;
+	return findImage(snapshot(), reinterpret_cast<uintptr_t>(p));
 }
 
 const FileMap::ImageMap* FileMap::imageMapForHeader(const mach_header* p) const
 {
-	auto it = m_maps_mach.find(const_cast<mach_header*>(p));
-	if (it == m_maps_mach.end())
+	const Snapshot* s = snapshot();
+	auto it = std::lower_bound(s->headers.begin(), s->headers.end(), std::make_pair(p, (ImageMap*) nullptr));
+
+	if (it == s->headers.end() || it->first != p)
 		return nullptr;
 	else
 		return it->second;
 }
 
-/*
 const FileMap::ImageMap* FileMap::imageMapForName(const std::string& name) const
 {
-	auto it = m_maps.find(name);
-	if (it == m_maps.end())
-		return nullptr;
-	else
-		return it->second;
+	for (ImageMap* map : snapshot()->images)
+	{
+		if (map->filename == name)
+			return map;
+	}
+	return nullptr;
+}
+
+// n_type bits from <mach-o/nlist.h>
+#define NLIST_STAB 0xe0
+#define NLIST_TYPE 0x0e
+#define NLIST_SECT 0x0e
+
+static uint64_t readUleb128(const uint8_t*& p, const uint8_t* end)
+{
+	uint64_t r = 0;
+	int bit = 0;
+
+	while (p < end)
+	{
+		uint8_t byte = *p++;
+		r |= uint64_t(byte & 0x7f) << bit;
+		bit += 7;
+		if (!(byte & 0x80))
+			break;
+	}
+	return r;
+}
+
+std::vector<FileMap::SymbolAddr>* FileMap::buildSymbols(const ImageMap* map)
+{
+	std::vector<SymbolAddr>* symbols = new std::vector<SymbolAddr>;
+	const size_t stride = map->is64 ? 16 : 12;
+
+	symbols->reserve(map->nsyms);
+
+	for (uint32_t i = 0; i < map->nsyms; i++)
+	{
+		// n_strx, n_type, n_sect, n_desc and then a 32 or 64-bit n_value
+		const uint8_t* nl = map->symtab + i * stride;
+		uint32_t strx;
+		uint8_t type = nl[4];
+		uint64_t value;
+
+		memcpy(&strx, nl, sizeof(strx));
+
+		if (type & NLIST_STAB || (type & NLIST_TYPE) != NLIST_SECT)
+			continue;
+		if (strx == 0 || strx >= map->strsize || map->strtab[strx] != '_')
+			continue;
+
+		if (map->is64)
+			memcpy(&value, nl + 8, sizeof(value));
+		else
+		{
+			uint32_t value32;
+			memcpy(&value32, nl + 8, sizeof(value32));
+			value = value32;
+		}
+
+		// Values below the image's base don't belong to it
+		if (uintptr_t(value) + map->slide < map->base)
+			continue;
+
+		symbols->push_back(SymbolAddr{ uintptr_t(value) + map->slide, strx });
+	}
+
+	// Stripped images still tell us where their functions begin
+	if (map->function_starts)
+	{
+		const uint8_t* p = map->function_starts;
+		const uint8_t* end = p + map->function_starts_size;
+		uintptr_t addr = map->text;
+
+		while (p < end)
+		{
+			uint64_t delta = readUleb128(p, end);
+			if (!delta)
+				break;
+			addr += delta;
+			symbols->push_back(SymbolAddr{ addr, NoName });
+		}
+	}
+
+	std::stable_sort(symbols->begin(), symbols->end(), compareSymbolAddr);
+	symbols->erase(std::unique(symbols->begin(), symbols->end(),
+		[](const SymbolAddr& a, const SymbolAddr& b) { return a.addr == b.addr; }), symbols->end());
+	symbols->shrink_to_fit();
+
+	return symbols;
+}
+
+const std::vector<FileMap::SymbolAddr>* FileMap::symbolsOf(const ImageMap* map) const
+{
+	const std::vector<SymbolAddr>* symbols = map->symbols.load(std::memory_order_acquire);
+
+	if (symbols)
+		return symbols;
+
+	Darling::MutexLock l(m_symbolsMutex);
+
+	if (!(symbols = map->symbols.load(std::memory_order_relaxed)))
+	{
+		symbols = buildSymbols(map);
+		map->symbols.store(symbols, std::memory_order_release);
+	}
+
+	return symbols;
 }
-*/
 
 bool FileMap::findSymbolInfo(const void* p, Dl_info* info) const
 {
 	uintptr_t addr = reinterpret_cast<uintptr_t>(p);
-	const ImageMap* symbol_map;
-	
-	std::map<uintptr_t, ImageMap*>::const_iterator found = m_maps.upper_bound(addr);
-	if (found == m_maps.begin() || found == m_maps.end())
+	const ImageMap* symbol_map = findImage(snapshot(), addr);
+
+	if (!symbol_map)
 		return false;
-	
-	--found;
-	symbol_map = found->second;
-	
-	std::map<uintptr_t, std::string>::const_iterator sfound = symbol_map->symbols.lower_bound(addr);
-	if (sfound != symbol_map->symbols.begin())
-	{
-		// found in lib and in symbols
-		info->dli_sname = sfound->second.c_str();
-		info->dli_saddr = reinterpret_cast<void*>(sfound->first);
-	}
-	
+
 	info->dli_fname = symbol_map->filename.c_str();
 	info->dli_fbase = reinterpret_cast<void*>(symbol_map->base);
-	
+	info->dli_sname = nullptr;
+	info->dli_saddr = nullptr;
+
+	// The closest symbol at or below addr
+	const std::vector<SymbolAddr>* symbols = symbolsOf(symbol_map);
+	auto sfound = std::upper_bound(symbols->begin(), symbols->end(), addr,
+		[](uintptr_t a, const SymbolAddr& sym) { return a < sym.addr; });
+
+	if (sfound != symbols->begin())
+	{
+		--sfound;
+		if (sfound->strx != NoName)
+			info->dli_sname = symbol_map->strtab + sfound->strx + 1;
+		info->dli_saddr = reinterpret_cast<void*>(sfound->addr);
+	}
+
 	return true;
 }
 
@@ -23,52 +23,106 @@ along with Darling.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdint.h>
 #include <string>
 #include <map>
-#include <list>
+#include <vector>
 #include "MachO.h"
+#include "ld.h"
 #include <dlfcn.h>
+#include <atomic>
 #include "../util/mutex.h"
 
+// All loaded Mach-O images, by address, mach_header and load order.
+//
+// Lookups take no locks, so that dladdr(), the stub binder or a crash handler never wait for a dlopen().
+// The tables are kept in an immutable snapshot that is replaced as a whole when an image is added;
+// readers keep using the snapshot they started with. Old snapshots and ImageMaps are never freed.
 class FileMap
 {
 public:
+	FileMap();
 	~FileMap();
 	
 	struct ImageMap;
 
-	const ImageMap* add(const MachO& mach, uintptr_t slide, uintptr_t base, bool bindLazy);
+	// Entry of the address -> symbol index used by dladdr()
+	struct SymbolAddr
+	{
+		uintptr_t addr;
+		uint32_t strx; // into the image's string table, NoName for function starts without a symbol
+	};
+	static const uint32_t NoName = ~0u;
+
+	const ImageMap* add(const MachO& mach, uintptr_t slide, uintptr_t base, Exports* exports, const std::vector<LoadedLibrary*>& dependencies);
 
 	void addWatchDog(uintptr_t addr);
 
 	struct ImageMap
 	{
 		std::string filename;
-		std::map<uintptr_t, std::string> symbols;
+
+		// Symbol table and function starts inside the loaded __LINKEDIT, null if they aren't mapped
+		const uint8_t* symtab;
+		uint32_t nsyms;
+		const char* strtab;
+		uint32_t strsize;
+		const uint8_t* function_starts;
+		uint32_t function_starts_size;
+		uintptr_t text; // slid __TEXT address, function starts are relative to it
+		bool is64;
+
+		// Sorted by address, built by the first dladdr() against this image
+		mutable std::atomic<const std::vector<SymbolAddr>*> symbols;
 		uintptr_t base, slide;
 		mach_header* header;
 		std::pair<uint64_t,uint64_t> eh_frame;
+		// Search table of the reworked __eh_frame, set once it is ready, used by our _Unwind_Find_FDE()
+		mutable std::atomic<const void*> eh_frame_hdr;
 		std::pair<uint64_t,uint64_t> unwind_info;
 		std::vector<MachO::Section> sections;
 		std::vector<std::string> rpaths;
+		Exports* exports;
 
-		std::list<MachO::Bind> lazy_binds;
-		mutable Darling::Mutex mutex_lazy_binds;
+		// Lazy binding info inside the mapped __LINKEDIT, decoded on demand by dyld_stub_binder_fixup
+		const uint8_t* lazy_binds;
+		size_t lazy_binds_size;
+		std::vector<uintptr_t> segments; // segment addresses after slide, indexed like in bind opcodes
+
+		// Libraries named by bind ordinals (ordinal 1 is at index 0), null for missing weak dylibs
+		std::vector<LoadedLibrary*> dependencies;
+		bool two_level; // MH_TWOLEVEL, binds name the library to look in
 	};
 	
 	const ImageMap* imageMapForAddr(const void* p) const;
 	const ImageMap* imageMapForHeader(const mach_header* p) const;
-	// const ImageMap* imageMapForName(const std::string& name) const;
+	const ImageMap* imageMapForName(const std::string& name) const;
 	const char* fileNameForAddr(const void* p) const;
 	const char* gdbInfoForAddr(const void* p) const;
 	bool findSymbolInfo(const void* addr, Dl_info* p) const; // used by __darwin_dladdr
 
-	const std::vector<ImageMap*>& images() const { return m_maps_vec; }
+	// In load order. The returned vector never changes, call this again to see images added since.
+	const std::vector<ImageMap*>& images() const { return snapshot()->images; }
 	const ImageMap* mainExecutable() const;
 
 private:
+	struct Snapshot
+	{
+		// Sorted start addresses, the image at bases[i] is maps[i] (null for watchdogs marking the end of an area)
+		std::vector<uintptr_t> bases;
+		std::vector<ImageMap*> maps;
+		std::vector<ImageMap*> images; // load order
+		std::vector<std::pair<const mach_header*, ImageMap*> > headers; // sorted
+	};
+
+	const Snapshot* snapshot() const { return m_snapshot.load(std::memory_order_acquire); }
+	static const ImageMap* findImage(const Snapshot* s, uintptr_t addr);
+	// Inserts a new address range, called with m_writeMutex held
+	bool addRange(uintptr_t base, ImageMap* map);
+	const std::vector<SymbolAddr>* symbolsOf(const ImageMap* map) const;
+	static std::vector<SymbolAddr>* buildSymbols(const ImageMap* map);
 
-	std::map<uintptr_t, ImageMap*> m_maps;
-	std::map<mach_header*, ImageMap*> m_maps_mach;
-	std::vector<ImageMap*> m_maps_vec; // for easier access
+	std::atomic<const Snapshot*> m_snapshot;
+	std::vector<const Snapshot*> m_retiredSnapshots;
+	Darling::Mutex m_writeMutex;
+	mutable Darling::Mutex m_symbolsMutex;
 	mutable char m_dumped_stack_frame_buf[4096];
 };
 
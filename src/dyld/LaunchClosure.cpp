@@ -0,0 +1,279 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "LaunchClosure.h"
+#include "log.h"
+#include "fnv.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+
+#define CLOSURE_MAGIC "darling-launch-closure"
+#define CLOSURE_VERSION 1
+
+static std::string lookupKey(const char* name, const std::string& context)
+{
+	std::string key = name;
+	key += '\0';
+	key += context;
+	return key;
+}
+
+LaunchClosure::LaunchClosure(const char* dir, const char* executable, const std::string& config)
+	: m_exeDev(0), m_exeIno(0), m_exeSize(0), m_exeMtime(0), m_exeMtimeNsec(0), m_active(true), m_valid(false),
+	m_recordedProbes(0), m_probes(0), m_stats(0), m_hits(0), m_misses(0)
+{
+	struct stat st;
+	std::stringstream ss;
+	char name[4096];
+	uint64_t key = Darling::FNV64_BASIS;
+
+	if (::stat(executable, &st) == 0)
+	{
+		m_exeDev = st.st_dev;
+		m_exeIno = st.st_ino;
+		m_exeSize = st.st_size;
+		m_exeMtime = st.st_mtim.tv_sec;
+		m_exeMtimeNsec = st.st_mtim.tv_nsec;
+	}
+
+	ss << std::hex << Darling::fnv1a64(config.data(), config.size(), key);
+	m_config = ss.str();
+
+	strncpy(name, executable, sizeof(name)-1);
+	name[sizeof(name)-1] = 0;
+
+	key = Darling::fnv1a64(&m_exeDev, sizeof(m_exeDev), key);
+	key = Darling::fnv1a64(&m_exeIno, sizeof(m_exeIno), key);
+
+	ss.str("");
+	ss << dir << '/' << basename(name) << '-' << std::hex << key << ".closure";
+	m_path = ss.str();
+
+	if (::mkdir(dir, 0755) != 0 && errno != EEXIST)
+		LOG << "Cannot create the launch closure directory " << dir << ": " << strerror(errno) << std::endl;
+
+	m_valid = read();
+	if (!m_valid)
+	{
+		m_lookups.clear();
+		m_recordedImages.clear();
+	}
+}
+
+static bool readIdentity(std::istream& in, uint64_t* dev, uint64_t* ino, uint64_t* size, int64_t* mtime, int64_t* mtimeNsec)
+{
+	return bool(in >> *dev >> *ino >> *size >> *mtime >> *mtimeNsec);
+}
+
+static bool sameFile(const char* path, uint64_t dev, uint64_t ino, uint64_t size, int64_t mtime, int64_t mtimeNsec)
+{
+	struct stat st;
+
+	if (::stat(path, &st) != 0)
+		return false;
+
+	return uint64_t(st.st_dev) == dev && uint64_t(st.st_ino) == ino && uint64_t(st.st_size) == size
+		&& st.st_mtim.tv_sec == mtime && st.st_mtim.tv_nsec == mtimeNsec;
+}
+
+bool LaunchClosure::read()
+{
+	std::ifstream in(m_path);
+	std::string line, word;
+	int version;
+
+	if (!in.is_open())
+		return false;
+
+	if (!(in >> word >> version) || word != CLOSURE_MAGIC || version != CLOSURE_VERSION)
+		return false;
+
+	while (std::getline(in, line))
+	{
+		std::istringstream ls(line);
+		uint64_t dev, ino, size;
+		int64_t mtime, mtimeNsec;
+
+		if (!(ls >> word))
+			continue;
+
+		if (word == "executable")
+		{
+			if (!readIdentity(ls, &dev, &ino, &size, &mtime, &mtimeNsec)
+				|| dev != m_exeDev || ino != m_exeIno || size != m_exeSize || mtime != m_exeMtime || mtimeNsec != m_exeMtimeNsec)
+			{
+				LOG << "Launch closure " << m_path << " is for a different executable\n";
+				return false;
+			}
+		}
+		else if (word == "config")
+		{
+			if (!(ls >> word) || word != m_config)
+			{
+				LOG << "Launch closure " << m_path << " is for a different library search configuration\n";
+				return false;
+			}
+		}
+		else if (word == "probes")
+			ls >> m_recordedProbes;
+		else if (word == "lib")
+		{
+			Library lib;
+
+			// Names, contexts and paths are separated by tabs, they may contain spaces
+			if (!readIdentity(ls, &dev, &ino, &size, &mtime, &mtimeNsec) || ls.get() != '\t'
+				|| !std::getline(ls, lib.name, '\t') || !std::getline(ls, lib.context, '\t') || !std::getline(ls, lib.path))
+			{
+				return false;
+			}
+
+			m_stats++;
+			if (!sameFile(lib.path.c_str(), dev, ino, size, mtime, mtimeNsec))
+			{
+				LOG << "Launch closure " << m_path << " is outdated: " << lib.path << " has changed\n";
+				return false;
+			}
+
+			m_lookups[lookupKey(lib.name.c_str(), lib.context)] = lib.path;
+		}
+		else if (word == "image")
+		{
+			Image img;
+
+			if (!(ls >> img.second) || ls.get() != '\t' || !std::getline(ls, img.first))
+				return false;
+			m_recordedImages.push_back(img);
+		}
+	}
+
+	LOG << "Using launch closure " << m_path << std::endl;
+	return true;
+}
+
+const char* LaunchClosure::lookup(const char* name, const std::string& context)
+{
+	if (!m_active)
+		return nullptr;
+
+	auto it = m_lookups.find(lookupKey(name, context));
+	if (it == m_lookups.end())
+	{
+		m_misses++;
+		return nullptr;
+	}
+
+	m_hits++;
+	return it->second.c_str();
+}
+
+void LaunchClosure::recordLookup(const char* name, const std::string& context, const char* path)
+{
+	if (!m_active)
+		return;
+
+	Library lib;
+	lib.name = name;
+	lib.context = context;
+	lib.path = path;
+	m_libraries.push_back(lib);
+}
+
+void LaunchClosure::recordImage(const char* path, size_t initFuncs)
+{
+	if (m_active)
+		m_images.push_back(Image(path, initFuncs));
+}
+
+void LaunchClosure::write()
+{
+	std::stringstream tmp;
+	std::ofstream out;
+
+	tmp << m_path << ".tmp" << getpid();
+	out.open(tmp.str().c_str());
+	if (!out.is_open())
+	{
+		LOG << "Cannot write the launch closure " << m_path << std::endl;
+		return;
+	}
+
+	out << CLOSURE_MAGIC << ' ' << CLOSURE_VERSION << '\n';
+	out << "executable " << m_exeDev << ' ' << m_exeIno << ' ' << m_exeSize << ' ' << m_exeMtime << ' ' << m_exeMtimeNsec << '\n';
+	out << "config " << m_config << '\n';
+
+	// A partially replayed launch didn't do the full search, keep the numbers of the last one that did
+	out << "probes " << (m_valid ? std::max(m_recordedProbes, m_probes) : m_probes) << '\n';
+
+	for (const Library& lib : m_libraries)
+	{
+		struct stat st;
+
+		if (::stat(lib.path.c_str(), &st) != 0)
+			continue;
+
+		out << "lib " << uint64_t(st.st_dev) << ' ' << uint64_t(st.st_ino) << ' ' << uint64_t(st.st_size) << ' '
+			<< int64_t(st.st_mtim.tv_sec) << ' ' << int64_t(st.st_mtim.tv_nsec) << '\t'
+			<< lib.name << '\t' << lib.context << '\t' << lib.path << '\n';
+	}
+
+	for (const Image& img : m_images)
+		out << "image " << img.second << '\t' << img.first << '\n';
+
+	out.close();
+
+	if (out.fail() || ::rename(tmp.str().c_str(), m_path.c_str()) != 0)
+	{
+		LOG << "Cannot write the launch closure " << m_path << std::endl;
+		::unlink(tmp.str().c_str());
+		return;
+	}
+
+	LOG << "Wrote launch closure " << m_path << std::endl;
+}
+
+void LaunchClosure::finish(bool printStatistics)
+{
+	if (!m_active)
+		return;
+
+	m_active = false;
+
+	if (!m_valid || m_misses || m_images != m_recordedImages)
+		write();
+
+	if (printStatistics)
+	{
+		std::cerr << "launch closure: " << m_hits << " libraries replayed, " << m_misses << " searched, "
+			<< m_probes << " path probes, " << m_stats << " closure checks";
+
+		if (m_valid && m_recordedProbes > m_probes + m_stats)
+			std::cerr << ", " << (m_recordedProbes - m_probes - m_stats) << " syscalls saved";
+
+		std::cerr << std::endl;
+	}
+}
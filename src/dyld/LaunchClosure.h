@@ -0,0 +1,80 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LAUNCHCLOSURE_H
+#define LAUNCHCLOSURE_H
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+
+// Library search results of an executable's launch (DYLD_CLOSURE_DIR).
+//
+// Remembers the absolute path every dependency resolved to, the identity of that file
+// and the order in which the images were loaded, which is also the order of their initializers.
+// The next launch of the same executable with the same search configuration checks the closure
+// with a single stat() per library and opens the libraries without searching for them.
+class LaunchClosure
+{
+public:
+	// config describes everything else the search results depend on (search paths, DYLD_LIBRARY_PATH, ...)
+	LaunchClosure(const char* dir, const char* executable, const std::string& config);
+
+	// Lookups are only replayed and recorded until the launch is complete
+	bool active() const { return m_active; }
+
+	// Path a library name has resolved to in the given search context, nullptr if unknown
+	const char* lookup(const char* name, const std::string& context);
+	void recordLookup(const char* name, const std::string& context, const char* path);
+
+	// Called for every loaded image, in load order
+	void recordImage(const char* path, size_t initFuncs);
+
+	// Counts a file system probe done while searching for a library
+	void countProbe() { m_probes++; }
+
+	// Writes a new closure if the old one was missing or incomplete
+	void finish(bool printStatistics);
+
+private:
+	bool read();
+	void write();
+
+	struct Library
+	{
+		std::string name, context, path;
+	};
+	typedef std::pair<std::string, size_t> Image;
+
+	std::string m_path, m_config;
+	uint64_t m_exeDev, m_exeIno, m_exeSize;
+	int64_t m_exeMtime, m_exeMtimeNsec;
+	bool m_active, m_valid;
+
+	std::map<std::string, std::string> m_lookups; // name + '\0' + context -> path
+	unsigned long m_recordedProbes;
+	std::vector<Image> m_recordedImages;
+
+	std::vector<Library> m_libraries; // done during this launch
+	std::vector<Image> m_images;
+	unsigned long m_probes, m_stats, m_hits, m_misses;
+};
+
+#endif
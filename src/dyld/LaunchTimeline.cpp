@@ -0,0 +1,226 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "LaunchTimeline.h"
+#include "log.h"
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <time.h>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+
+extern LaunchTimeline* g_launchTimeline;
+
+static const char* g_phaseNames[] = {
+	"parse", "map", "rebase", "dependencies", "bind", "eh_frame", "loader hooks", "initializers"
+};
+static_assert(sizeof(g_phaseNames) / sizeof(g_phaseNames[0]) == LaunchTimeline::PhaseCount, "Missing phase names");
+
+// The innermost span of the thread
+static __thread LaunchTimeline::Span* t_currentSpan = nullptr;
+
+static uint64_t now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+LaunchTimeline::LaunchTimeline(const char* traceFile)
+	: m_active(true)
+{
+	if (traceFile)
+		m_traceFile = traceFile;
+}
+
+LaunchTimeline::Span::Span(Phase phase, const std::string& image)
+	: m_active(false)
+{
+	if (g_launchTimeline)
+		start(phase, image.c_str());
+}
+
+LaunchTimeline::Span::Span(Phase phase, const char* image)
+	: m_active(false)
+{
+	if (g_launchTimeline)
+		start(phase, image ? image : "?");
+}
+
+void LaunchTimeline::Span::start(Phase phase, const char* image)
+{
+	m_phase = phase;
+	m_active = true;
+	m_image = image;
+	m_nested = 0;
+	m_parent = t_currentSpan;
+	t_currentSpan = this;
+	m_start = now();
+}
+
+LaunchTimeline::Span::~Span()
+{
+	if (!m_active)
+		return;
+
+	uint64_t duration = now() - m_start;
+
+	t_currentSpan = m_parent;
+	if (m_parent)
+		m_parent->m_nested += duration;
+
+	g_launchTimeline->record(m_phase, m_image, m_start, duration, duration - std::min(duration, m_nested));
+}
+
+void LaunchTimeline::record(Phase phase, const std::string& image, uint64_t start, uint64_t duration, uint64_t exclusive)
+{
+	Darling::MutexLock l(m_mutex);
+
+	if (!m_active)
+		return;
+
+	auto it = m_imageIndex.find(image);
+	int index;
+
+	if (it != m_imageIndex.end())
+		index = it->second;
+	else
+	{
+		index = m_images.size();
+		m_imageIndex[image] = index;
+		m_images.push_back(image);
+		m_exclusive.push_back(std::vector<uint64_t>(PhaseCount));
+	}
+
+	m_exclusive[index][phase] += exclusive;
+
+	if (!m_traceFile.empty())
+		m_events.push_back(Event{ phase, index, start, duration, int(syscall(SYS_gettid)) });
+}
+
+void LaunchTimeline::finish(bool printStatistics)
+{
+	Darling::MutexLock l(m_mutex);
+
+	if (!m_active)
+		return;
+	m_active = false;
+
+	if (printStatistics)
+		printSummary(std::cerr);
+	if (!m_traceFile.empty())
+		writeTrace();
+}
+
+void LaunchTimeline::printSummary(std::ostream& out) const
+{
+	std::vector<int> order;
+	std::vector<uint64_t> totals(m_images.size());
+	std::vector<uint64_t> phaseTotals(PhaseCount);
+	uint64_t total = 0;
+
+	for (size_t i = 0; i < m_images.size(); i++)
+	{
+		for (int p = 0; p < PhaseCount; p++)
+		{
+			totals[i] += m_exclusive[i][p];
+			phaseTotals[p] += m_exclusive[i][p];
+		}
+		total += totals[i];
+		order.push_back(i);
+	}
+
+	// The most expensive images first
+	std::sort(order.begin(), order.end(), [&totals](int a, int b) { return totals[a] > totals[b]; });
+
+	out << "launch timeline (ms, nested phases excluded):\n" << std::fixed << std::setprecision(2);
+	for (int p = 0; p < PhaseCount; p++)
+		out << std::setw(13) << g_phaseNames[p];
+	out << std::setw(13) << "total" << "  image\n";
+
+	for (int i : order)
+	{
+		for (int p = 0; p < PhaseCount; p++)
+			out << std::setw(13) << m_exclusive[i][p] / 1000.0;
+		out << std::setw(13) << totals[i] / 1000.0 << "  " << m_images[i] << '\n';
+	}
+
+	for (int p = 0; p < PhaseCount; p++)
+		out << std::setw(13) << phaseTotals[p] / 1000.0;
+	out << std::setw(13) << total / 1000.0 << "  (all images)\n";
+
+	out.unsetf(std::ios::floatfield);
+	out << std::setprecision(6);
+}
+
+static void writeJSONString(std::ostream& out, const std::string& str)
+{
+	out << '"';
+	for (char c : str)
+	{
+		if (c == '"' || c == '\\')
+			out << '\\' << c;
+		else if (uint8_t(c) < 0x20)
+		{
+			char esc[8];
+			snprintf(esc, sizeof(esc), "\\u%04x", c);
+			out << esc;
+		}
+		else
+			out << c;
+	}
+	out << '"';
+}
+
+void LaunchTimeline::writeTrace() const
+{
+	std::ofstream out(m_traceFile.c_str());
+	int pid = getpid();
+
+	if (!out.is_open())
+	{
+		std::cerr << "Cannot write the trace file " << m_traceFile << std::endl;
+		return;
+	}
+
+	out << "{\"traceEvents\":[\n";
+	for (size_t i = 0; i < m_events.size(); i++)
+	{
+		const Event& e = m_events[i];
+		const std::string& image = m_images[e.image];
+		size_t slash = image.rfind('/');
+
+		out << "{\"name\":";
+		writeJSONString(out, std::string(g_phaseNames[e.phase]) + ' ' + (slash != std::string::npos ? image.substr(slash+1) : image));
+		out << ",\"cat\":\"" << g_phaseNames[e.phase] << "\",\"ph\":\"X\",\"ts\":" << e.start << ",\"dur\":" << e.duration
+			<< ",\"pid\":" << pid << ",\"tid\":" << e.tid << ",\"args\":{\"image\":";
+		writeJSONString(out, image);
+		out << "}}" << (i + 1 < m_events.size() ? ",\n" : "\n");
+	}
+	out << "],\"displayTimeUnit\":\"ms\"}\n";
+
+	if (out.fail())
+		std::cerr << "Cannot write the trace file " << m_traceFile << std::endl;
+	else
+		LOG << "Wrote launch trace " << m_traceFile << std::endl;
+}
@@ -0,0 +1,88 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LAUNCHTIMELINE_H
+#define LAUNCHTIMELINE_H
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <ostream>
+#include "mutex.h"
+
+// Time spent in every launch phase of every image (DYLD_PRINT_STATISTICS, DYLD_TRACE_FILE).
+//
+// Phases are measured with Span objects, which may nest. The summary table counts the time of each span
+// without its nested spans, e.g. the dependencies column holds the time spent searching for the libraries,
+// not loading them. The trace file is in the Chrome trace_event format (chrome://tracing, Perfetto).
+class LaunchTimeline
+{
+public:
+	enum Phase
+	{
+		PhaseParse, PhaseMap, PhaseRebase, PhaseDependencies, PhaseBind,
+		PhaseEHFrame, PhaseLoaderHooks, PhaseInitializers, PhaseCount
+	};
+
+	// traceFile may be nullptr
+	LaunchTimeline(const char* traceFile);
+
+	// Measures a phase of an image if the timeline is enabled
+	class Span
+	{
+	public:
+		Span(Phase phase, const std::string& image);
+		Span(Phase phase, const char* image);
+		~Span();
+	private:
+		void start(Phase phase, const char* image);
+
+		Phase m_phase;
+		bool m_active;
+		std::string m_image;
+		uint64_t m_start, m_nested;
+		Span* m_parent;
+	};
+
+	// Spans are only recorded until the launch is complete
+	void finish(bool printStatistics);
+
+private:
+	struct Event
+	{
+		Phase phase;
+		int image; // index into m_images
+		uint64_t start, duration; // microseconds
+		int tid;
+	};
+
+	void record(Phase phase, const std::string& image, uint64_t start, uint64_t duration, uint64_t exclusive);
+	void printSummary(std::ostream& out) const;
+	void writeTrace() const;
+
+	std::string m_traceFile;
+	bool m_active;
+	std::vector<std::string> m_images; // in the order of their first span
+	std::map<std::string, int> m_imageIndex;
+	std::vector<std::vector<uint64_t> > m_exclusive; // [image][phase]
+	std::vector<Event> m_events;
+	Darling::Mutex m_mutex;
+};
+
+#endif
@@ -0,0 +1,308 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "LazyBindProfile.h"
+#include "MachOLoader.h"
+#include "FileMap.h"
+#include "log.h"
+#include "fnv.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <stdexcept>
+
+#define PROFILE_MAGIC "darling-lazy-bind-profile"
+#define PROFILE_VERSION 1
+
+extern FileMap g_file_map;
+
+static LazyBindProfile* g_lazyBindProfileInstance = nullptr;
+
+LazyBindProfile::LazyBindProfile(const char* dir, const char* executable)
+	: m_loader(nullptr), m_threadStarted(false), m_stop(false), m_dirty(false), m_recorded(0), m_eager(0), m_eagerFailed(0)
+{
+	std::stringstream ss;
+	std::string exe;
+	char name[4096];
+	char* real;
+	uint64_t key;
+
+	if (::mkdir(dir, 0755) != 0 && errno != EEXIST)
+		LOG << "Cannot create the lazy bind profile directory " << dir << ": " << strerror(errno) << std::endl;
+
+	// Profiles are per executable file, wherever it is started from
+	real = realpath(executable, nullptr);
+	exe = real ? real : executable;
+	free(real);
+
+	key = Darling::fnv1a64(exe.data(), exe.size());
+
+	strncpy(name, exe.c_str(), sizeof(name)-1);
+	name[sizeof(name)-1] = 0;
+
+	ss << dir << '/' << basename(name) << '-' << std::hex << key << ".lazybinds";
+	m_path = ss.str();
+
+	if (!read())
+		m_images.clear();
+
+	g_lazyBindProfileInstance = this;
+	pthread_atfork(prepareFork, parentAfterFork, childAfterFork);
+}
+
+void LazyBindProfile::prepareFork()
+{
+	// Neither the eager binding thread nor dyld_stub_binder may hold the mutex while the process is copied
+	if (g_lazyBindProfileInstance)
+		g_lazyBindProfileInstance->m_mutex.lock();
+}
+
+void LazyBindProfile::parentAfterFork()
+{
+	if (g_lazyBindProfileInstance)
+		g_lazyBindProfileInstance->m_mutex.unlock();
+}
+
+void LazyBindProfile::childAfterFork()
+{
+	if (!g_lazyBindProfileInstance)
+		return;
+
+	// The eager binding thread isn't copied into the child, and the parent writes the profile
+	g_lazyBindProfileInstance->m_threadStarted = false;
+	g_lazyBindProfileInstance->m_dirty = false;
+	g_lazyBindProfileInstance->m_mutex.unlock();
+}
+
+bool LazyBindProfile::identify(const std::string& path, Image* image)
+{
+	struct stat st;
+
+	if (::stat(path.c_str(), &st) != 0)
+		return false;
+
+	image->dev = st.st_dev;
+	image->ino = st.st_ino;
+	image->size = st.st_size;
+	image->mtime = st.st_mtim.tv_sec;
+	image->mtimeNsec = st.st_mtim.tv_nsec;
+	return true;
+}
+
+bool LazyBindProfile::read()
+{
+	std::ifstream in(m_path);
+	std::string line, word, path;
+	int version;
+	Image* current = nullptr;
+
+	if (!in.is_open())
+		return false;
+
+	if (!(in >> word >> version) || word != PROFILE_MAGIC || version != PROFILE_VERSION)
+		return false;
+
+	while (std::getline(in, line))
+	{
+		std::istringstream ls(line);
+		Image img, actual;
+
+		if (!(ls >> word))
+			continue;
+
+		if (word == "image")
+		{
+			if (!(ls >> img.dev >> img.ino >> img.size >> img.mtime >> img.mtimeNsec) || ls.get() != '\t' || !std::getline(ls, path))
+				return false;
+
+			// The offsets of a changed image mean nothing, its stubs are going to be recorded again
+			if (!identify(path, &actual) || actual.dev != img.dev || actual.ino != img.ino || actual.size != img.size
+				|| actual.mtime != img.mtime || actual.mtimeNsec != img.mtimeNsec)
+			{
+				LOG << "Lazy bind profile of " << path << " is outdated\n";
+				current = nullptr;
+				m_dirty = true;
+				continue;
+			}
+
+			current = &(m_images[path] = actual);
+			m_profiled.push_back(std::make_pair(path, std::vector<uintptr_t>()));
+		}
+		else if (word == "binds" && current)
+		{
+			uintptr_t offset;
+
+			while (ls >> std::hex >> offset)
+			{
+				current->offsets.insert(offset);
+				m_profiled.back().second.push_back(offset);
+			}
+		}
+	}
+
+	LOG << "Using lazy bind profile " << m_path << std::endl;
+	return true;
+}
+
+void LazyBindProfile::record(const std::string& image, uintptr_t lazyOffset)
+{
+	Darling::MutexLock l(m_mutex);
+	auto it = m_images.find(image);
+
+	if (it == m_images.end())
+	{
+		Image img;
+
+		// Once per image
+		if (!identify(image, &img))
+			return;
+		it = m_images.insert(std::make_pair(image, img)).first;
+	}
+
+	if (it->second.offsets.insert(lazyOffset).second)
+	{
+		m_recorded++;
+		m_dirty = true;
+	}
+}
+
+void LazyBindProfile::startEagerBinding(MachOLoader* loader)
+{
+	if (m_profiled.empty() || m_threadStarted)
+		return;
+
+	m_loader = loader;
+
+	// Joined by finish()
+	if (pthread_create(&m_thread, nullptr, eagerBindThread, this) != 0)
+	{
+		LOG << "Cannot start the eager binding thread\n";
+		return;
+	}
+	m_threadStarted = true;
+}
+
+void* LazyBindProfile::eagerBindThread(void* p)
+{
+	LazyBindProfile* self = static_cast<LazyBindProfile*>(p);
+	unsigned long bound = 0, failed = 0;
+
+	for (const auto& image : self->m_profiled)
+	{
+		const FileMap::ImageMap* img = g_file_map.imageMapForName(image.first);
+
+		// Not loaded during this launch (yet)
+		if (!img)
+			continue;
+
+		for (uintptr_t offset : image.second)
+		{
+			if (self->m_stop.load(std::memory_order_relaxed))
+				break;
+
+			try
+			{
+				if (self->m_loader->doLazyBind(img, offset, true))
+					bound++;
+			}
+			catch (const std::exception& e)
+			{
+				// The main thread gets the error once it calls the stub
+				LOG << "Eager binding failed: " << e.what() << std::endl;
+				failed++;
+			}
+		}
+	}
+
+	Darling::MutexLock l(self->m_mutex);
+	self->m_eager = bound;
+	self->m_eagerFailed = failed;
+
+	return nullptr;
+}
+
+void LazyBindProfile::write()
+{
+	std::stringstream tmp;
+	std::ofstream out;
+
+	tmp << m_path << ".tmp" << getpid();
+	out.open(tmp.str().c_str());
+	if (!out.is_open())
+	{
+		LOG << "Cannot write the lazy bind profile " << m_path << std::endl;
+		return;
+	}
+
+	out << PROFILE_MAGIC << ' ' << PROFILE_VERSION << '\n';
+
+	for (const auto& entry : m_images)
+	{
+		const Image& img = entry.second;
+
+		if (img.offsets.empty())
+			continue;
+
+		out << "image " << img.dev << ' ' << img.ino << ' ' << img.size << ' ' << img.mtime << ' ' << img.mtimeNsec
+			<< '\t' << entry.first << '\n';
+		out << "binds" << std::hex;
+		for (uintptr_t offset : img.offsets)
+			out << ' ' << offset;
+		out << std::dec << '\n';
+	}
+
+	out.close();
+
+	if (out.fail() || ::rename(tmp.str().c_str(), m_path.c_str()) != 0)
+	{
+		LOG << "Cannot write the lazy bind profile " << m_path << std::endl;
+		::unlink(tmp.str().c_str());
+	}
+}
+
+void LazyBindProfile::finish(bool printStatistics)
+{
+	// The process is going away, the thread must not keep binding while it's torn down
+	if (m_threadStarted)
+	{
+		m_stop.store(true, std::memory_order_relaxed);
+		pthread_join(m_thread, nullptr);
+		m_threadStarted = false;
+	}
+
+	Darling::MutexLock l(m_mutex);
+
+	if (m_dirty)
+		write();
+	m_dirty = false;
+
+	if (printStatistics)
+	{
+		std::cerr << "lazy bind profile: " << m_eager << " stubs bound eagerly (" << m_eagerFailed << " failed), "
+			<< m_recorded << " new stubs recorded" << std::endl;
+	}
+}
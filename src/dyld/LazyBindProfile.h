@@ -0,0 +1,82 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LAZYBINDPROFILE_H
+#define LAZYBINDPROFILE_H
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <atomic>
+#include <pthread.h>
+#include "mutex.h"
+
+class MachOLoader;
+
+// Lazy binds an executable actually uses (DYLD_BIND_PROFILE).
+//
+// Every stub resolved by dyld_stub_binder is recorded, per image, by its lazy bind offset.
+// The next launch binds the recorded stubs on a background thread right after the launch binds,
+// while the initializers are running. Lazy pointers are stored atomically, so the main thread
+// going through the same stub meanwhile either binds it itself or jumps to the final address.
+// All other stubs stay lazy.
+class LazyBindProfile
+{
+public:
+	LazyBindProfile(const char* dir, const char* executable);
+
+	// Called by dyld_stub_binder for every resolved stub
+	void record(const std::string& image, uintptr_t lazyOffset);
+
+	// Binds the profiled stubs of loaded images, returns immediately
+	void startEagerBinding(MachOLoader* loader);
+
+	// Stops the eager binding and writes the profile if new stubs have been used, called at exit
+	void finish(bool printStatistics);
+
+private:
+	struct Image
+	{
+		uint64_t dev, ino, size;
+		int64_t mtime, mtimeNsec;
+		std::set<uintptr_t> offsets;
+	};
+
+	bool read();
+	void write();
+	static bool identify(const std::string& path, Image* image);
+	static void* eagerBindThread(void* p);
+	static void prepareFork();
+	static void parentAfterFork();
+	static void childAfterFork();
+
+	std::string m_path;
+	std::map<std::string, Image> m_images;
+	std::vector<std::pair<std::string, std::vector<uintptr_t> > > m_profiled; // bound eagerly
+	MachOLoader* m_loader;
+	pthread_t m_thread;
+	bool m_threadStarted;
+	std::atomic<bool> m_stop; // the process is exiting, the eager binding thread must not touch the images anymore
+	bool m_dirty;
+	Darling::Mutex m_mutex;
+	unsigned long m_recorded, m_eager, m_eagerFailed;
+};
+
+#endif
@@ -0,0 +1,333 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "LazyFixups.h"
+#include "log.h"
+#include <linux/userfaultfd.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <string>
+
+#define LAZY_PAGE_SIZE 0x1000
+
+static LazyFixups* g_lazyFixupsInstance = nullptr;
+
+LazyFixups* LazyFixups::create()
+{
+	struct uffdio_api api;
+	int fd;
+
+	// Not limited to user mode faults: the kernel touches the lazy pages too, e.g. in write(2)
+	fd = syscall(__NR_userfaultfd, O_CLOEXEC);
+	if (fd == -1)
+	{
+		LOG << "userfaultfd is not available, fixups are done eagerly: " << strerror(errno) << std::endl;
+		return nullptr;
+	}
+
+	memset(&api, 0, sizeof(api));
+	api.api = UFFD_API;
+
+	if (::ioctl(fd, UFFDIO_API, &api) == -1)
+	{
+		LOG << "UFFDIO_API failed, fixups are done eagerly: " << strerror(errno) << std::endl;
+		::close(fd);
+		return nullptr;
+	}
+
+	LazyFixups* lf = new LazyFixups(fd);
+
+	if (pthread_create(&lf->m_thread, nullptr, handlerThread, lf) != 0)
+	{
+		LOG << "Cannot start the page fault handler, fixups are done eagerly\n";
+		delete lf;
+		return nullptr;
+	}
+
+	pthread_detach(lf->m_thread);
+
+	g_lazyFixupsInstance = lf;
+	pthread_atfork(prepareFork, nullptr, nullptr);
+
+	return lf;
+}
+
+LazyFixups::LazyFixups(int fd)
+	: m_fd(fd), m_thread(0), m_pages(0), m_populatedPages(0)
+{
+}
+
+struct LazySegment
+{
+	uintptr_t addr, size;
+	uint64_t fileoff;
+	int prot;
+};
+
+template <typename Segment>
+static void writableSegments(const std::vector<Segment*>& segments, intptr slide, std::vector<LazySegment>& out)
+{
+	for (const Segment* seg : segments)
+	{
+		if (!(seg->initprot & VM_PROT_WRITE) || !seg->filesize)
+			continue;
+
+		LazySegment ls;
+
+		// Same as in MachOLoader::loadSegments()
+		ls.prot = 0;
+		if (seg->maxprot & VM_PROT_READ)
+			ls.prot |= PROT_READ;
+		if (seg->maxprot & VM_PROT_WRITE)
+			ls.prot |= PROT_WRITE;
+		if (seg->maxprot & VM_PROT_EXECUTE)
+			ls.prot |= PROT_EXEC;
+
+		ls.addr = seg->vmaddr + slide;
+		ls.size = (seg->filesize + LAZY_PAGE_SIZE - 1) & ~uintptr_t(LAZY_PAGE_SIZE - 1);
+		ls.fileoff = seg->fileoff;
+		out.push_back(ls);
+	}
+}
+
+bool LazyFixups::registerImage(const MachO& mach, intptr slide)
+{
+	std::vector<LazySegment> segments;
+	int fd;
+
+	// Chained fixups are stored in the pointers themselves, they have to be read in anyway
+	if (mach.has_chained_fixups())
+		return false;
+
+	if (mach.is64())
+		writableSegments(mach.segments64(), slide, segments);
+	else
+		writableSegments(mach.segments(), slide, segments);
+
+	if (segments.empty())
+		return false;
+
+	fd = ::dup(mach.fd());
+	if (fd == -1)
+		return false;
+
+	Darling::MutexLock l(m_mutex);
+	bool registered = false;
+
+	for (const LazySegment& ls : segments)
+	{
+		struct uffdio_register reg;
+		void* addr = reinterpret_cast<void*>(ls.addr);
+
+		// The file mapping is replaced with empty memory, the pages are read in on the first touch
+		if (::mmap(addr, ls.size, ls.prot, MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0) == MAP_FAILED)
+			throw std::runtime_error("mmap(anon) failed on '" + mach.filename() + "': " + strerror(errno));
+
+		memset(&reg, 0, sizeof(reg));
+		reg.range.start = ls.addr;
+		reg.range.len = ls.size;
+		reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+
+		if (::ioctl(m_fd, UFFDIO_REGISTER, &reg) == -1)
+		{
+			LOG << "UFFDIO_REGISTER failed on " << mach.filename() << ": " << strerror(errno) << std::endl;
+
+			if (::mmap(addr, ls.size, ls.prot, MAP_PRIVATE | MAP_FIXED, mach.fd(), mach.offset() + ls.fileoff) == MAP_FAILED)
+				throw std::runtime_error("Failed to mmap '" + mach.filename() + "': " + strerror(errno));
+			continue;
+		}
+
+		Region* region = new Region;
+		region->start = ls.addr;
+		region->end = ls.addr + ls.size;
+		region->fd = fd;
+		region->fileOffset = mach.offset() + ls.fileoff;
+		region->slide = slide;
+		region->pages.resize(ls.size / LAZY_PAGE_SIZE);
+
+		m_regions[region->end] = region;
+		m_pages += region->pages.size();
+		registered = true;
+
+		LOG << "Lazy fixups for " << mach.filename() << ": " << addr << "-" << (void*)region->end << std::endl;
+	}
+
+	if (!registered)
+		::close(fd);
+
+	return registered;
+}
+
+LazyFixups::Region* LazyFixups::findRegion(uintptr_t addr) const
+{
+	auto it = m_regions.upper_bound(addr);
+
+	if (it == m_regions.end() || it->second->start > addr)
+		return nullptr;
+	return it->second;
+}
+
+bool LazyFixups::addFixup(uintptr_t addr, bool rebase, uintptr_t value)
+{
+	Darling::MutexLock l(m_mutex);
+	Region* region = findRegion(addr);
+
+	if (!region)
+		return false;
+
+	uintptr_t offset = (addr - region->start) % LAZY_PAGE_SIZE;
+	Page& page = region->pages[(addr - region->start) / LAZY_PAGE_SIZE];
+
+	// Populated pages are written directly, so are pointers spanning two pages
+	if (page.populated || offset + sizeof(uintptr_t) > LAZY_PAGE_SIZE)
+		return false;
+
+	page.fixups.push_back(Fixup{ uint16_t(offset), rebase, value });
+	return true;
+}
+
+bool LazyFixups::addRebase(uintptr_t addr)
+{
+	return addFixup(addr, true, 0);
+}
+
+bool LazyFixups::addBind(uintptr_t addr, uintptr_t value)
+{
+	return addFixup(addr, false, value);
+}
+
+void LazyFixups::populate(Region* region, size_t index)
+{
+	char buf[LAZY_PAGE_SIZE] __attribute__((aligned(LAZY_PAGE_SIZE)));
+	struct uffdio_copy copy;
+	Page& page = region->pages[index];
+	ssize_t rd;
+
+	rd = ::pread(region->fd, buf, sizeof(buf), region->fileOffset + index * LAZY_PAGE_SIZE);
+	if (rd < 0)
+		rd = 0;
+
+	// Past the end of file, just like a file mapping
+	memset(buf + rd, 0, sizeof(buf) - rd);
+
+	for (const Fixup& fixup : page.fixups)
+	{
+		uintptr_t* ptr = reinterpret_cast<uintptr_t*>(buf + fixup.offset);
+
+		if (fixup.rebase)
+			*ptr += region->slide;
+		else
+			*ptr = fixup.value;
+	}
+
+	memset(&copy, 0, sizeof(copy));
+	copy.dst = region->start + index * LAZY_PAGE_SIZE;
+	copy.src = uintptr_t(buf);
+	copy.len = LAZY_PAGE_SIZE;
+
+	if (::ioctl(m_fd, UFFDIO_COPY, &copy) == -1 && errno != EEXIST)
+		LOG << "UFFDIO_COPY failed at " << (void*)copy.dst << ": " << strerror(errno) << std::endl;
+
+	page.populated = true;
+	page.fixups.clear();
+	page.fixups.shrink_to_fit();
+	m_populatedPages++;
+}
+
+void LazyFixups::populateAll()
+{
+	Darling::MutexLock l(m_mutex);
+
+	for (auto& entry : m_regions)
+	{
+		Region* region = entry.second;
+
+		for (size_t i = 0; i < region->pages.size(); i++)
+		{
+			if (!region->pages[i].populated)
+				populate(region, i);
+		}
+	}
+}
+
+void LazyFixups::prepareFork()
+{
+	// The child doesn't inherit the registrations, it would see zero filled pages
+	if (g_lazyFixupsInstance)
+		g_lazyFixupsInstance->populateAll();
+}
+
+void* LazyFixups::handlerThread(void* p)
+{
+	LazyFixups* self = static_cast<LazyFixups*>(p);
+
+	while (true)
+	{
+		struct uffd_msg msg;
+		ssize_t rd = ::read(self->m_fd, &msg, sizeof(msg));
+
+		if (rd != sizeof(msg))
+		{
+			if (rd == -1 && (errno == EINTR || errno == EAGAIN))
+				continue;
+
+			LOG << "Reading from userfaultfd failed: " << strerror(errno) << std::endl;
+			break;
+		}
+
+		if (msg.event != UFFD_EVENT_PAGEFAULT)
+			continue;
+
+		uintptr_t addr = msg.arg.pagefault.address & ~uintptr_t(LAZY_PAGE_SIZE - 1);
+		Darling::MutexLock l(self->m_mutex);
+		Region* region = self->findRegion(addr);
+
+		if (!region)
+			continue;
+
+		size_t index = (addr - region->start) / LAZY_PAGE_SIZE;
+
+		if (!region->pages[index].populated)
+			self->populate(region, index);
+		else
+		{
+			// Populated in the meantime, only the faulting thread needs to be woken up
+			struct uffdio_range range;
+
+			range.start = addr;
+			range.len = LAZY_PAGE_SIZE;
+			::ioctl(self->m_fd, UFFDIO_WAKE, &range);
+		}
+	}
+
+	return nullptr;
+}
+
+void LazyFixups::printStatistics(std::ostream& out) const
+{
+	Darling::MutexLock l(m_mutex);
+
+	out << "lazy fixups: " << m_populatedPages << " of " << m_pages << " pages populated\n";
+}
@@ -0,0 +1,95 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LAZYFIXUPS_H
+#define LAZYFIXUPS_H
+#include <stdint.h>
+#include <vector>
+#include <map>
+#include <ostream>
+#include <pthread.h>
+#include "MachO.h"
+#include "arch.h"
+#include "mutex.h"
+
+// Applies rebases and binds to a page only when the page is first touched (DYLD_LAZY_FIXUPS).
+//
+// The writable segments of an image are replaced with empty anonymous memory registered with userfaultfd.
+// Rebases and binds of that image are not written, but collected in a per-page index.
+// When a page is touched, a handler thread reads the page from the file, applies the page's fixups
+// and installs the result with UFFDIO_COPY. Pages that are never touched never get dirtied.
+class LazyFixups
+{
+public:
+	// Returns nullptr if userfaultfd is not available to this process
+	static LazyFixups* create();
+
+	// Starts handling the writable segments of a freshly mapped image.
+	// Returns false if the image must be fixed up the usual way.
+	bool registerImage(const MachO& mach, intptr slide);
+
+	// Return false if the address is not in a page that is still to be populated, the caller has to write it then
+	bool addRebase(uintptr_t addr);
+	bool addBind(uintptr_t addr, uintptr_t value);
+
+	// Populates all pages, a forked child wouldn't have the handler thread
+	void populateAll();
+
+	void printStatistics(std::ostream& out) const;
+
+private:
+	LazyFixups(int fd);
+
+	struct Fixup
+	{
+		uint16_t offset; // within the page
+		bool rebase; // otherwise a bind
+		uintptr_t value;
+	};
+
+	struct Page
+	{
+		bool populated;
+		std::vector<Fixup> fixups;
+	};
+
+	struct Region
+	{
+		uintptr_t start, end;
+		int fd; // of the Mach-O file
+		uint64_t fileOffset;
+		intptr slide;
+		std::vector<Page> pages;
+	};
+
+	static void* handlerThread(void* p);
+	static void prepareFork();
+
+	Region* findRegion(uintptr_t addr) const;
+	bool addFixup(uintptr_t addr, bool rebase, uintptr_t value);
+	void populate(Region* region, size_t index);
+
+	int m_fd;
+	pthread_t m_thread;
+	std::map<uintptr_t, Region*> m_regions; // by end address
+	mutable Darling::Mutex m_mutex;
+	unsigned long m_pages, m_populatedPages;
+};
+
+#endif
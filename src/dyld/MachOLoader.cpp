@@ -20,7 +20,13 @@ along with Darling.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "config.h"
 #include "MachOLoader.h"
+#include "LaunchClosure.h"
+#include "LazyFixups.h"
+#include "LaunchTimeline.h"
+#include "ResolverStats.h"
+#include "LazyBindProfile.h"
 #include "MachO.h"
+#include "StringPool.h"
 #include "ld.h"
 #include "log.h"
 #include "trace.h"
@@ -37,19 +43,30 @@ along with Darling.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdexcept>
 #include <set>
 #include <sys/mman.h>
+#ifndef MAP_FIXED_NOREPLACE
+#	define MAP_FIXED_NOREPLACE 0x100000
+#endif
 #include <errno.h>
 #include <dlfcn.h>
 #include <libgen.h>
 #include "eh/EHSection.h"
+#include "UnwindHook.h"
 
 FileMap g_file_map;
-static std::vector<std::string> g_bound_names;
+static std::vector<const char*> g_bound_names; // interned in StringPool
 
 char g_darwin_loader_path[PATH_MAX] = "";
 
 extern char g_darwin_executable_path[PATH_MAX];
 extern bool g_trampoline;
 extern bool g_noWeak;
+extern bool g_forceFlat;
+extern const char* g_prebindCacheDir;
+extern bool g_printStatistics;
+extern bool g_lazyFixups;
+extern LaunchClosure* g_launchClosure;
+extern LaunchTimeline* g_launchTimeline;
+extern LazyBindProfile* g_lazyBindProfile;
 extern std::set<LoaderHookFunc*> g_machoLoaderHooks;
 extern MachOLoader* g_loader;
 
@@ -86,18 +103,18 @@ static void dumpInt(int bound_name_id)
 		fprintf(stderr, "%d: bound function id overflow\n", bound_name_id);
 		return;
 	}
-	if (g_bound_names[bound_name_id].empty())
+	if (!g_bound_names[bound_name_id])
 	{
 		fprintf(stderr, "%d: unbound function id\n", bound_name_id);
 		return;
 	}
 	printf("calling %s(%d)\n",
-			g_bound_names[bound_name_id].c_str(), bound_name_id);
+			g_bound_names[bound_name_id], bound_name_id);
 	fflush(stdout);
 }
 
 MachOLoader::MachOLoader()
-: m_last_addr(0), m_pTrampolineMgr(0)
+: m_last_addr(0), m_unslidImages(0), m_rebasedImages(0), m_rebasedPages(0), m_prebindCache(0), m_lazyFixups(0), m_weakBindsCoalesced(0), m_pTrampolineMgr(0)
 {
 #ifdef DEBUG
 	m_pUndefMgr = new UndefMgr;
@@ -111,16 +128,48 @@ MachOLoader::MachOLoader()
 			TrampolineMgr::loadFunctionInfo(info);
 	}
 #endif
+
+	if (g_lazyFixups)
+		m_lazyFixups = LazyFixups::create();
+
+	// Trampolines and stubs for missing symbols are not part of any library, lazily fixed up images are never rebased in memory
+	if (g_prebindCacheDir && !m_lazyFixups && !g_trampoline && !getenv("DYLD_IGN_MISSING_SYMS"))
+		m_prebindCache = new PrebindCache(g_prebindCacheDir);
 }
 
 MachOLoader::~MachOLoader()
 {
+	delete m_prebindCache;
 }
 
-void MachOLoader::loadDylibs(const MachO& mach, bool nobind, bool bindLazy)
+void MachOLoader::printStatistics(std::ostream& out) const
 {
-	for (std::string dylib : mach.dylibs())
+	size_t strong = 0;
+
+	out << "images: " << m_unslidImages << " at their preferred address, "
+		<< m_rebasedImages << " rebased (" << m_rebasedPages << " pages dirtied)\n";
+
+	for (const auto& def : m_weakDefinitions)
+		strong += def.second.strong;
+
+	out << "weak definitions: " << m_weakDefinitions.size() << " chosen (" << strong << " strong), "
+		<< m_weakBindsCoalesced << " binds coalesced\n";
+	out << "symbol names: " << StringPool::heapUsage() / 1024 << " KiB copied into the string pool\n";
+	if (m_lazyFixups)
+		m_lazyFixups->printStatistics(out);
+}
+
+std::vector<LoadedLibrary*> MachOLoader::loadDylibs(const MachO& mach, bool nobind, bool bindLazy)
+{
+	std::vector<LoadedLibrary*> libs;
+
+	libs.reserve(mach.dylibs().size());
+
+	for (size_t i = 0; i < mach.dylibs().size(); i++)
 	{
+		const char* dylib = mach.dylibs()[i];
+		void* lib;
+		
 		// __darwin_dlopen checks if already loaded
 		// automatically adds a reference if so
 		
@@ -132,14 +181,23 @@ void MachOLoader::loadDylibs(const MachO& mach, bool nobind, bool bindLazy)
 		else
 			flags |= DARWIN_RTLD_NOW;
 
-		if (!Darling::DlopenWithContext(dylib.c_str(), flags, m_rpathContext))
+		lib = Darling::DlopenWithContext(dylib, flags, m_rpathContext);
+		if (!lib && mach.is_weak_dylib(i))
+		{
+			LOG << "Weak dylib " << dylib << " not loaded: " << __darwin_dlerror() << std::endl;
+		}
+		else if (!lib)
 		{
 			LOG << "Failed to dlopen " << dylib << ", throwing an exception\n";
 			std::stringstream ss;
 			ss << "Cannot load " << dylib << ": " << __darwin_dlerror();
 			throw std::runtime_error(ss.str());
 		}
+
+		libs.push_back(static_cast<LoadedLibrary*>(lib));
 	}
+
+	return libs;
 }
 
 void MachOLoader::doMProtect()
@@ -149,10 +207,89 @@ void MachOLoader::doMProtect()
 	m_mprotects.clear();
 }
 
+// Reserves the range unless something is mapped there already
+static bool reserveRange(intptr addr, intptr size)
+{
+	void* p = ::mmap((void*) addr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+
+	if (p == MAP_FAILED)
+		return false;
+	if (p != (void*) addr)
+	{
+		// Kernels older than 4.17 take the address as a mere hint
+		::munmap(p, size);
+		return false;
+	}
+	return true;
+}
+
+// Finds the first unmapped range of the given size at or above the hint
+static intptr findFreeRange(intptr hint, intptr size)
+{
+	std::ifstream maps("/proc/self/maps");
+	std::string line;
+	intptr candidate = alignMem(hint, 0x1000);
+
+	// The mappings are sorted by address
+	while (std::getline(maps, line))
+	{
+		unsigned long start, end;
+
+		if (sscanf(line.c_str(), "%lx-%lx", &start, &end) != 2)
+			continue;
+		if (end <= candidate)
+			continue;
+		if (start >= candidate + size)
+			break;
+		candidate = end;
+	}
+
+	return candidate;
+}
+
+intptr MachOLoader::reserveImage(const MachO& mach, intptr preferred, intptr size)
+{
+	mach_header header = mach.header();
+	bool canSlide = header.filetype != MH_EXECUTE || (header.flags & MH_PIE);
+
+	if (preferred && preferred >= mmapMinAddr() && reserveRange(preferred, size))
+	{
+		LOG << "Mapping " << mach.filename() << " at its preferred address " << (void*)preferred << std::endl;
+		m_unslidImages++;
+		return preferred;
+	}
+
+	if (!canSlide)
+	{
+		checkMmapMinAddr(preferred);
+
+		std::stringstream ss;
+		ss << "Cannot map '" << mach.filename() << "' at " << (void*)preferred << ": the address range is in use";
+		throw std::runtime_error(ss.str());
+	}
+
+	// Another thread may take the range before we do
+	for (int attempt = 0; attempt < 16; attempt++)
+	{
+		intptr addr = findFreeRange(std::max(std::max(m_last_addr, preferred), mmapMinAddr()), size);
+
+		if (reserveRange(addr, size))
+		{
+			LOG << "will rebase: filename=" << mach.filename()
+				<< ", vmaddr=" << (void*)preferred
+				<< ", new addr=" << (void*)addr << std::endl;
+			return addr;
+		}
+	}
+
+	std::stringstream ss;
+	ss << "Cannot find " << size << " bytes of free address space for '" << mach.filename() << "'";
+	throw std::runtime_error(ss.str());
+}
+
 void MachOLoader::loadSegments(const MachO& mach, intptr* slide, intptr* base)
 {
-	*base = 0;
-	--*base;
+	intptr low = intptr(-1), high = 0;
 
 #ifdef DEBUG
 	if (m_pTrampolineMgr)
@@ -160,6 +297,22 @@ void MachOLoader::loadSegments(const MachO& mach, intptr* slide, intptr* base)
 #endif
 
 	const std::vector<Segment*>& segments = getSegments(mach);
+
+	// The whole image is reserved at once, so that mapping the segments with MAP_FIXED cannot clobber anything
+	for (Segment* seg : segments)
+	{
+		if (!strcmp(seg->segname, SEG_PAGEZERO) || !seg->vmsize)
+			continue;
+		low = std::min(low, intptr(seg->vmaddr));
+		high = std::max(high, intptr(alignMem(seg->vmaddr + seg->vmsize, 0x1000)));
+	}
+
+	if (low >= high)
+		throw std::runtime_error("No segments to map in '" + mach.filename() + "'");
+
+	*slide = reserveImage(mach, low, high - low) - low;
+	*base = low + *slide;
+
 	for (Segment* seg : segments)
 	{
 		const char* name = seg->segname;
@@ -193,17 +346,6 @@ void MachOLoader::loadSegments(const MachO& mach, intptr* slide, intptr* base)
 
 		intptr filesize = alignMem(seg->filesize, 0x1000);
 		intptr vmaddr = seg->vmaddr + *slide;
-		
-		if (vmaddr < m_last_addr)
-		{
-			LOG << "will rebase: filename=" << mach.filename()
-				<< ", vmaddr=" << (void*)vmaddr
-				<< ", last_addr=" << (void*)m_last_addr <<std::endl;
-			assert(seg == segments[0]);
-			vmaddr = m_last_addr;
-			*slide = vmaddr - seg->vmaddr;
-		}
-		*base = std::min(*base, vmaddr);
 
 		intptr vmsize = alignMem(seg->vmsize, 0x1000);
 		LOG << "mmap(file) " << mach.filename() << ' ' << name
@@ -225,7 +367,11 @@ void MachOLoader::loadSegments(const MachO& mach, intptr* slide, intptr* base)
 			ss << "Failed to mmap '" << mach.filename() << "': " << strerror(errno);
 			throw std::runtime_error(ss.str());
 		}
-		
+
+		// Start reading the pages that the rebases and binds will touch while the rest is still being parsed
+		if (prot & PROT_WRITE)
+			::madvise(mapped, filesize, MADV_WILLNEED);
+
 		assert(vmsize >= filesize);
 
 		if (vmsize > filesize)
@@ -249,7 +395,7 @@ void MachOLoader::loadSegments(const MachO& mach, intptr* slide, intptr* base)
 	}
 }
 
-void MachOLoader::checkMmapMinAddr(intptr addr)
+intptr MachOLoader::mmapMinAddr()
 {
 	static intptr minimum = -1;
 	if (minimum == intptr(-1))
@@ -261,6 +407,12 @@ void MachOLoader::checkMmapMinAddr(intptr addr)
 		else
 			f >> minimum;
 	}
+	return minimum;
+}
+
+void MachOLoader::checkMmapMinAddr(intptr addr)
+{
+	intptr minimum = mmapMinAddr();
 
 	if (addr < minimum)
 	{
@@ -271,48 +423,82 @@ void MachOLoader::checkMmapMinAddr(intptr addr)
 	}
 }
 
-void MachOLoader::doRebase(const MachO& mach, intptr slide)
+struct RebaseContext
+{
+	const MachO* mach;
+	intptr slide;
+	bool textRebases;
+	uintptr_t lastPage;
+	unsigned long pages;
+	LazyFixups* lazy;
+};
+
+bool MachOLoader::doRebase(const MachO& mach, intptr slide)
 {
-	for (const MachO::Rebase* rebase : mach.rebases())
+	RebaseContext ctx = { &mach, slide, false, 0, 0, m_lazyFixups };
+
+	// The rebases are decoded as we go, nothing gets allocated for them
+	mach.forEachRebase(rebaseCallback, &ctx);
+
+	m_rebasedImages++;
+	m_rebasedPages += ctx.pages;
+
+	return !ctx.textRebases;
+}
+
+void MachOLoader::rebaseCallback(const MachO::Rebase& rebase, void* p)
+{
+	RebaseContext* ctx = static_cast<RebaseContext*>(p);
+	const MachO& mach = *ctx->mach;
+	const intptr slide = ctx->slide;
+	void* addr = reinterpret_cast<void*>(rebase.vmaddr + slide);
+
+	// Rebases come sorted by address, so this counts every dirtied page once
+	if (uintptr_t(addr) / 0x1000 != ctx->lastPage)
+	{
+		ctx->lastPage = uintptr_t(addr) / 0x1000;
+		ctx->pages++;
+	}
+
+	switch (rebase.type)
 	{
-		void* addr = reinterpret_cast<void*>(rebase->vmaddr + slide);
-		switch (rebase->type)
+		case REBASE_TYPE_POINTER:
 		{
-			case REBASE_TYPE_POINTER:
-			{
-				uintptr_t* ptr = reinterpret_cast<uintptr_t*>(addr);
-				LOG << "rebase(ptr): " << addr << ' '
-					<< (void*)*ptr << " => "
-					<< (void*)(*ptr + slide) << " @" << ptr <<std::endl;
+			uintptr_t* ptr = reinterpret_cast<uintptr_t*>(addr);
+			LOG << "rebase(ptr): " << addr << ' '
+				<< (void*)*ptr << " => "
+				<< (void*)(*ptr + slide) << " @" << ptr <<std::endl;
+			if (!ctx->lazy || !ctx->lazy->addRebase(uintptr_t(ptr)))
 				*ptr += slide;
-				break;
-			}
-			case REBASE_TYPE_TEXT_ABSOLUTE32:
-			{
-				uint32_t* ptr = reinterpret_cast<uint32_t*>(addr);
-				LOG << "rebase(abs32): " << addr << ' '
-					<< std::hex << *ptr << std::dec << " => " << (void*)(mach.fixEndian(*ptr) + slide) << std::endl;
-				*ptr = mach.fixEndian(*ptr);
-				*ptr += static_cast<uint32_t>(slide);
-				break;
-			}
-			case REBASE_TYPE_TEXT_PCREL32: // TODO: test it
-			{
-				uint32_t* ptr = reinterpret_cast<uint32_t*>(addr);
-				LOG << "rebase(pcrel32): " << addr << ' '
-					<< std::hex << *ptr << std::dec << " => " << (void*)(uintptr_t(addr) + 4 - mach.fixEndian(*ptr)) << std::endl;
-				*ptr = mach.fixEndian(*ptr);
-				*ptr = uintptr_t(addr) + 4 - (*ptr);
-				break;
-			}
+			break;
+		}
+		case REBASE_TYPE_TEXT_ABSOLUTE32:
+		{
+			uint32_t* ptr = reinterpret_cast<uint32_t*>(addr);
+			LOG << "rebase(abs32): " << addr << ' '
+				<< std::hex << *ptr << std::dec << " => " << (void*)(mach.fixEndian(*ptr) + slide) << std::endl;
+			*ptr = mach.fixEndian(*ptr);
+			*ptr += static_cast<uint32_t>(slide);
+			ctx->textRebases = true;
+			break;
+		}
+		case REBASE_TYPE_TEXT_PCREL32: // TODO: test it
+		{
+			uint32_t* ptr = reinterpret_cast<uint32_t*>(addr);
+			LOG << "rebase(pcrel32): " << addr << ' '
+				<< std::hex << *ptr << std::dec << " => " << (void*)(uintptr_t(addr) + 4 - mach.fixEndian(*ptr)) << std::endl;
+			*ptr = mach.fixEndian(*ptr);
+			*ptr = uintptr_t(addr) + 4 - (*ptr);
+			ctx->textRebases = true;
+			break;
+		}
 
-			default:
-			{
-				std::stringstream ss;
-				ss << "Unknown rebase type: " << int(rebase->type);
-				
-				throw std::runtime_error(ss.str());
-			}
+		default:
+		{
+			std::stringstream ss;
+			ss << "Unknown rebase type: " << int(rebase.type);
+			
+			throw std::runtime_error(ss.str());
 		}
 	}
 }
@@ -357,157 +543,512 @@ void MachOLoader::loadInitFuncs(const MachO& mach, intptr slide)
 	}
 }
 
-void* MachOLoader::doBind(const std::vector<MachO::Bind*>& binds, intptr slide, bool resolveLazy)
+void* MachOLoader::doBind(const MachO& mach, const FileMap::ImageMap* img, bool resolveLazy, PrebindCache::Image* prebound)
 {
-	std::string last_weak_name;
-	uintptr_t last_weak_sym = 0;
-	size_t seen_weak_bind_index = 0;
-	size_t seen_weak_binds_orig_size = m_seen_weak_binds.size();
-	uintptr_t sym;
+	BindContext ctx;
 
-	g_bound_names.resize(binds.size());
+	ctx.loader = this;
+	ctx.mach = &mach;
+	ctx.img = img;
+	ctx.prebound = prebound;
+	ctx.lazy = m_lazyFixups;
+	ctx.slide = img->slide;
+	ctx.resolveLazy = resolveLazy;
+	ctx.sym = 0;
 
 	m_lastResolvedSymbol.clear();
 	m_lastResolvedAddress = 0;
 
-	for (const MachO::Bind* bind : binds)
+	if (!prebound || !m_prebindCache->applyBinds(prebound, resolveLazy, prebindCallback, &ctx))
+	{
+		// The binds are decoded as we go, nothing gets allocated for them
+		mach.forEachBind(bindCallback, &ctx);
+
+		// Chained fixups contain both rebases and binds
+		if (mach.has_chained_fixups())
+		{
+			if (prebound)
+				m_prebindCache->discardBinds(prebound);
+			doChainedFixups(mach, img);
+		}
+	}
+
+	if (prebound)
+		m_prebindCache->close(prebound, resolveLazy);
+
+	// This return value is used by dyld_stub_binder
+	return reinterpret_cast<void*>(ctx.sym);
+}
+
+// Bind and import names point into the mapped file, which is closed once the image is loaded.
+// The same bytes stay mapped in the image's __LINKEDIT, images are never unloaded,
+// so the pool can reference them there instead of copying them.
+static const char* internSymbolName(const MachO& mach, intptr slide, const char* name)
+{
+	uint64_t vmaddr = mach.vmaddrForFileOffset(uintptr_t(name) - mach.base());
+
+	if (!vmaddr)
+		return StringPool::intern(name);
+	return StringPool::internStable(reinterpret_cast<const char*>(vmaddr + slide));
+}
+
+void MachOLoader::bindCallback(const MachO::Bind& bind, void* p)
+{
+	BindContext* ctx = static_cast<BindContext*>(p);
+	ctx->loader->doBind(&bind, *ctx);
+}
+
+void MachOLoader::prebindCallback(uintptr_t* ptr, int type, uintptr_t target, void* p)
+{
+	BindContext* ctx = static_cast<BindContext*>(p);
+
+	writeBind(type, ptr, target);
+	ctx->sym = target;
+}
+
+void MachOLoader::doBind(const MachO::Bind* bind, BindContext& ctx)
+{
+	const intptr slide = ctx.slide;
+	uintptr_t sym;
+
+	if (bind->is_lazy)
+	{
+		if (!ctx.resolveLazy)
+		{
+			LOG << "Delaying lazy bind resolution, offset=" << std::hex << bind->offset << std::dec << std::endl;
+			return;
+		}
+		else
+			LOG << "Lazy bind resolution forced\n";
+	}
+	
+	if (bind->type == BIND_TYPE_POINTER || bind->type == BIND_TYPE_STUB)
+	{
+		const char* symbol = internSymbolName(*ctx.mach, slide, bind->name);
+		const char* name = symbol + 1;
+		uintptr_t* ptr = (uintptr_t*)(bind->vmaddr + slide);
+
+		sym = 0;
+	
+		if (bind->is_weak)
+		{
+			// The choice depends on all the other images
+			if (ctx.prebound)
+				m_prebindCache->discardBinds(ctx.prebound);
+			if (g_noWeak)
+				return;
+
+			sym = coalesceWeakDefinition(symbol, bind, ptr);
+
+			if (bind->type != BIND_TYPE_POINTER || !ctx.lazy || !ctx.lazy->addBind(uintptr_t(ptr), sym))
+				writeBind(bind->type, ptr, sym);
+			ctx.sym = sym;
+			return;
+		}
+		else // not weak
+		{
+			sym = resolveTwoLevel(ctx.img, bind->ordinal, symbol);
+			if (!sym)
+				sym = getSymbolAddress(symbol, bind, slide);
+
+			if (!bind->is_classic)
+				sym += bind->addend;
+		}
+
+		LOG << "bind " << name << ": "
+			<< std::hex << *ptr << std::dec << " => " << (void*)sym << " @" << ptr << std::endl;
+#ifdef DEBUG
+		if (g_trampoline)
+			sym = (uintptr_t) m_pTrampolineMgr->generate((void*)sym, name);
+#endif
+
+		if (bind->type != BIND_TYPE_POINTER || !ctx.lazy || !ctx.lazy->addBind(uintptr_t(ptr), sym))
+			writeBind(bind->type, ptr, sym);
+		ctx.sym = sym;
+
+		if (ctx.prebound)
+			m_prebindCache->recordBind(ctx.prebound, ptr, bind->type, sym);
+	}
+	else
+	{
+		std::stringstream ss;
+		ss << "Unknown bind type: " << int(bind->type);
+		throw std::runtime_error(ss.str());
+	}
+}
+
+bool MachOLoader::findWeakDefinition(const char* name, uintptr_t* addr)
+{
+	auto it = m_weakDefinitions.find(name);
+
+	if (it == m_weakDefinitions.end())
+		return false;
+
+	m_weakBindsCoalesced++;
+	*addr = it->second.addr;
+	return true;
+}
+
+uintptr_t MachOLoader::chooseWeakDefinition(const char* name, uintptr_t addr, bool strong)
+{
+	WeakDefinition def;
+
+	def.addr = addr;
+	def.strong = strong;
+	m_weakDefinitions.insert(std::make_pair(name, def));
+	return addr;
+}
+
+uintptr_t MachOLoader::coalesceWeakDefinition(const char* symbol, const MachO::Bind* bind, const uintptr_t* ptr)
+{
+	// Equal names are equal pointers, the suffix of an interned name is stable as well
+	const char* name = StringPool::internStable(symbol + 1);
+	WeakDefinition def;
+
+	if (findWeakDefinition(name, &def.addr))
+		return def.addr;
+
+	// The first image to use the symbol decides, a strong (non-weak) definition from any loaded image wins
+	if (bind->is_classic && bind->value)
+	{
+		def.addr = bind->value;
+		def.strong = false;
+	}
+	else if (void* strong = __darwin_dlsym(__DARLING_RTLD_STRONG, name))
+	{
+		LOG << "Weak reference overridden for " << name << std::endl;
+		def.addr = uintptr_t(strong);
+		def.strong = true;
+	}
+	else
+	{
+		LOG << "Weak reference not overriden for " << name << std::endl;
+		def.addr = bind->is_classic ? 0 : *ptr; // the image's own definition
+		def.strong = false;
+	}
+
+	LOG << "Bind (weak) " << name << " @" << ptr << " -> " << (void*)def.addr << std::endl;
+
+	return chooseWeakDefinition(name, def.addr, def.strong);
+}
+
+uintptr_t MachOLoader::coalesceWeakDefinition(const char* symbol, const MachO::ChainedImport& imp)
+{
+	const char* name = StringPool::internStable(symbol + 1);
+	uintptr_t sym;
+
+	if (findWeakDefinition(name, &sym))
+		return sym;
+
+	// Same choice as for the bind opcodes, except that the import doesn't carry the image's own definition
+	if ((sym = reinterpret_cast<uintptr_t>(__darwin_dlsym(__DARLING_RTLD_STRONG, name))))
+	{
+		LOG << "Weak reference overridden for " << name << std::endl;
+		return chooseWeakDefinition(name, sym, true);
+	}
+
+	try
+	{
+		sym = resolveSymbol(symbol);
+	}
+	catch (const std::exception&)
 	{
-		if (bind->is_lazy)
+		if (!imp.weak_import)
+			throw;
+	}
+
+	// A missing weak import isn't remembered, an image loaded later may define it
+	if (!sym)
+		return 0;
+
+	LOG << "Weak reference not overriden for " << name << std::endl;
+	return chooseWeakDefinition(name, sym, false);
+}
+
+struct ChainedFixupContext
+{
+	uint16_t format;
+	intptr slide;
+	uintptr_t imageBase; // where the mach header is mapped
+	uint32_t maxValidPointer;
+	const std::vector<uintptr_t>* imports;
+};
+
+static uintptr_t chainedImport(const ChainedFixupContext& ctx, uint32_t ordinal)
+{
+	if (ordinal >= ctx.imports->size())
+	{
+		std::stringstream ss;
+		ss << "Chained fixup import ordinal out of range: " << ordinal;
+		throw std::runtime_error(ss.str());
+	}
+	return (*ctx.imports)[ordinal];
+}
+
+// Walks a single chain of fixups, every entry contains the distance to the next one
+static void applyChain(uint8_t* loc, const ChainedFixupContext& ctx)
+{
+	uint32_t next;
+
+	do
+	{
+		if (ctx.format == DYLD_CHAINED_PTR_32)
 		{
-			if (!resolveLazy)
+			uint32_t* ptr = reinterpret_cast<uint32_t*>(loc);
+			const dyld_chained_ptr_32_bind bind = *reinterpret_cast<dyld_chained_ptr_32_bind*>(ptr);
+			const dyld_chained_ptr_32_rebase rebase = *reinterpret_cast<dyld_chained_ptr_32_rebase*>(ptr);
+
+			next = bind.next;
+
+			if (bind.bind)
+				*ptr = chainedImport(ctx, bind.ordinal) + bind.addend;
+			else if (rebase.target > ctx.maxValidPointer)
 			{
-				LOG << "Delaying lazy bind resolution, offset=" << std::hex << bind->offset << std::dec << std::endl;
-				continue;
+				// Not a pointer, but a small value stored with a bias
+				uint32_t bias = (0x04000000 + ctx.maxValidPointer) / 2;
+				*ptr = rebase.target - bias;
 			}
 			else
-				LOG << "Lazy bind resolution forced\n";
+				*ptr = rebase.target + ctx.slide;
 		}
-		
-		if (bind->type == BIND_TYPE_POINTER || bind->type == BIND_TYPE_STUB)
+		else
 		{
-			std::string name = bind->name.substr(1);
-			uintptr_t* ptr = (uintptr_t*)(bind->vmaddr + slide);
+			uint64_t* ptr = reinterpret_cast<uint64_t*>(loc);
+			const dyld_chained_ptr_64_bind bind = *reinterpret_cast<dyld_chained_ptr_64_bind*>(ptr);
+			const dyld_chained_ptr_64_rebase rebase = *reinterpret_cast<dyld_chained_ptr_64_rebase*>(ptr);
 
-			sym = 0;
-		
-			// FIXME: This unholy mess needs to be fixed, weak bind handling shouldn't be implemented separately like this
-			if (bind->is_weak)
+			next = bind.next;
+
+			if (bind.bind)
+				*ptr = chainedImport(ctx, bind.ordinal) + bind.addend;
+			else
 			{
-				if (g_noWeak)
-					continue;
-				if (last_weak_name == name)
-				{
-					sym = last_weak_sym;
-				}
+				uint64_t target = rebase.target;
+
+				if (ctx.format == DYLD_CHAINED_PTR_64_OFFSET)
+					target += ctx.imageBase;
 				else
-				{
-					last_weak_name = name;
-					if (seen_weak_bind_index != seen_weak_binds_orig_size && !strcmp(m_seen_weak_binds[seen_weak_bind_index].first.c_str(), name.c_str()))
-					{
-						last_weak_sym = sym =
-						m_seen_weak_binds[seen_weak_bind_index].second;
-						seen_weak_bind_index++;
-					}
-					else
-					{
-						if (bind->is_classic)
-						//if (false)
-						{
-							uintptr_t addr = bind->value;
-							if (!addr)
-							{
-								LOG << "Trying to resolve classic,weak,null\n";
-								addr = (uintptr_t) __darwin_dlsym(__DARLING_RTLD_STRONG, name.c_str());
-							}
-							LOG << "Bind (classic, weak) @" << ptr << " -> " << std::hex << uintptr_t(addr) << std::dec << std::endl;
-							
-							writeBind(bind->type, ptr, uintptr_t(addr));
-							last_weak_sym = uintptr_t(addr);
-						}
-						else
-						{
-							void* expAddr = __darwin_dlsym(__DARLING_RTLD_STRONG, name.c_str());
-							if (expAddr != nullptr)
-							{
-								LOG << "Weak reference overridden for " << name << std::endl;
-								LOG << (void*)*ptr << " -> " << (void*)expAddr << " @" << ptr << std::endl;
-
-								writeBind(bind->type, ptr, uintptr_t(expAddr));
-
-								*ptr = last_weak_sym = uintptr_t(expAddr);
-							}
-							else
-							{
-								LOG << "Weak reference not overriden for " << name << std::endl;
-								last_weak_sym = *ptr;
-							}
-						}
-					}
-					
-					m_seen_weak_binds.push_back(make_pair(name, last_weak_sym));
-					while (seen_weak_bind_index != seen_weak_binds_orig_size && strcmp(m_seen_weak_binds[seen_weak_bind_index].first.c_str(), name.c_str()) <= 0)
-						seen_weak_bind_index++;
-					
-					continue;
-				}
-			}
-			else // not weak
-			{
-				sym = getSymbolAddress(bind->name, bind, slide);
+					target += ctx.slide;
 
-				if (!bind->is_classic)
-					sym += bind->addend;
+				*ptr = target | (uint64_t(rebase.high8) << 56);
 			}
+		}
 
-			LOG << "bind " << name << ": "
-				<< std::hex << *ptr << std::dec << " => " << (void*)sym << " @" << ptr << std::endl;
-#ifdef DEBUG
-			if (g_trampoline)
-				sym = (uintptr_t) m_pTrampolineMgr->generate((void*)sym, name.c_str());
-#endif
+		loc += next * 4;
+	}
+	while (next);
+}
 
-			writeBind(bind->type, ptr, sym);
+static void applyChainedFixupsPage(uint8_t* page, const dyld_chained_starts_in_segment* seg, uint16_t pageIndex, const ChainedFixupContext& ctx)
+{
+	uint16_t start = seg->page_start[pageIndex];
+
+	if (start == DYLD_CHAINED_PTR_START_NONE)
+		return;
+
+	if (start & DYLD_CHAINED_PTR_START_MULTI)
+	{
+		// The page has several chains, their starts are stored after page_start[page_count]
+		uint16_t index = start & ~DYLD_CHAINED_PTR_START_MULTI;
+		bool last;
+
+		do
+		{
+			uint16_t offset = seg->page_start[index++];
+
+			last = (offset & DYLD_CHAINED_PTR_START_LAST) != 0;
+			applyChain(page + (offset & ~DYLD_CHAINED_PTR_START_LAST), ctx);
 		}
-		else
+		while (!last);
+	}
+	else
+		applyChain(page + start, ctx);
+}
+
+template <typename Segment>
+static uintptr_t imageBaseAddress(const std::vector<Segment*>& segments, intptr slide)
+{
+	// The segment mapping the beginning of the file contains the mach header
+	for (const Segment* seg : segments)
+	{
+		if (seg->fileoff == 0 && seg->filesize != 0)
+			return seg->vmaddr + slide;
+	}
+	throw std::runtime_error("Cannot find the segment containing the mach header");
+}
+
+uintptr_t MachOLoader::resolveChainedImport(const FileMap::ImageMap* img, const char* symbol, const MachO::ChainedImport& imp)
+{
+	uintptr_t sym = 0;
+
+	if (imp.ordinal == BIND_SPECIAL_DYLIB_WEAK_LOOKUP)
+	{
+		// Coalesced weak definition, every image has to end up with the same one
+		sym = coalesceWeakDefinition(symbol, imp);
+		return sym ? sym + imp.addend : 0;
+	}
+
+	try
+	{
+		sym = resolveTwoLevel(img, imp.ordinal, symbol);
+		if (!sym)
+			sym = resolveSymbol(symbol);
+	}
+	catch (const std::exception&)
+	{
+		if (!imp.weak_import)
+			throw;
+	}
+
+	if (!sym)
+		return 0; // missing weak import
+
+	return sym + imp.addend;
+}
+
+void MachOLoader::doChainedFixups(const MachO& mach, const FileMap::ImageMap* img)
+{
+	const intptr slide = img->slide;
+	ChainedFixupContext ctx;
+	std::vector<uintptr_t> imports;
+	const auto& starts = mach.chained_starts();
+
+	imports.reserve(mach.chained_imports().size());
+
+	for (const MachO::ChainedImport& imp : mach.chained_imports())
+		imports.push_back(resolveChainedImport(img, internSymbolName(mach, slide, imp.name), imp));
+
+	ctx.slide = slide;
+	ctx.imports = &imports;
+
+	if (mach.is64())
+		ctx.imageBase = imageBaseAddress(mach.segments64(), slide);
+	else
+		ctx.imageBase = imageBaseAddress(mach.segments(), slide);
+
+	for (size_t i = 0; i < starts.size(); i++)
+	{
+		const dyld_chained_starts_in_segment* seg = starts[i];
+		uint8_t* segStart;
+
+		if (!seg)
+			continue;
+
+		switch (seg->pointer_format)
 		{
-			std::stringstream ss;
-			ss << "Unknown bind type: " << bind->type;
-			throw std::runtime_error(ss.str());
+#ifdef __x86_64__
+			case DYLD_CHAINED_PTR_64:
+			case DYLD_CHAINED_PTR_64_OFFSET:
+#else
+			case DYLD_CHAINED_PTR_32:
+#endif
+				break;
+			default:
+			{
+				std::stringstream ss;
+				ss << "Unsupported chained fixups pointer format " << seg->pointer_format << " in " << mach.filename();
+				throw std::runtime_error(ss.str());
+			}
 		}
+
+		ctx.format = seg->pointer_format;
+		ctx.maxValidPointer = seg->max_valid_pointer;
+		segStart = reinterpret_cast<uint8_t*>(ctx.imageBase + seg->segment_offset);
+
+		LOG << "Applying chained fixups to " << seg->page_count << " pages at " << (void*)segStart << std::endl;
+
+		// Every page has its own chains, there are no pointers from one page to another
+		for (uint16_t page = 0; page < seg->page_count; page++)
+			applyChainedFixupsPage(segStart + page * seg->page_size, seg, page, ctx);
 	}
+}
 
-	std::inplace_merge(m_seen_weak_binds.begin(), m_seen_weak_binds.begin() + seen_weak_binds_orig_size, m_seen_weak_binds.end());
+uintptr_t MachOLoader::resolveTwoLevel(const FileMap::ImageMap* img, int ordinal, const char* name)
+{
+	const Exports* exports = nullptr;
+	const MachO::Export* exp;
 
-	// This return value is used by dyld_stub_binder
-	return reinterpret_cast<void*>(sym);
+	if (!img->two_level || g_forceFlat)
+		return 0;
+
+	if (ordinal == BIND_SPECIAL_DYLIB_SELF)
+		exports = img->exports;
+	else if (ordinal == BIND_SPECIAL_DYLIB_MAIN_EXECUTABLE)
+		exports = m_mainExports;
+	else if (ordinal > 0 && size_t(ordinal) <= img->dependencies.size())
+	{
+		const LoadedLibrary* lib = img->dependencies[ordinal - 1];
+
+		// Native libraries stand in for many Darwin libraries and have no export trie
+		if (lib && lib->type == LoadedLibraryDylib)
+			exports = lib->exports;
+	}
+
+	if (!exports)
+		return 0;
+
+	// Symbols the library re-exports from elsewhere are left to the flat lookup
+	exp = exports->find(name);
+	if (!exp)
+		return 0;
+
+	// Same precedence as in the flat lookup
+	if (name[0] == '_')
+	{
+		if (void* native = Darling::FindDarwinOverride(name + 1))
+			return reinterpret_cast<uintptr_t>(native);
+	}
+
+	LOG << "Two-level bind of " << name << " (ordinal " << ordinal << ")\n";
+	return exp->addr;
 }
 
-uintptr_t MachOLoader::getSymbolAddress(const std::string& oname, const MachO::Bind* bind, intptr slide)
+uintptr_t MachOLoader::getSymbolAddress(const char* oname, const MachO::Bind* bind, intptr slide)
 {
-	std::string name;
 	uintptr_t sym;
 
 	if (oname == m_lastResolvedSymbol)
 		return m_lastResolvedAddress;
 
+	sym = resolveSymbol(oname, bind, slide);
+
+	m_lastResolvedSymbol = oname;
+	m_lastResolvedAddress = sym;
+
+	return sym;
+}
+
+uintptr_t MachOLoader::resolveSymbol(const char* oname, const MachO::Bind* bind, intptr slide)
+{
+	const char* name;
+	uintptr_t sym;
+#ifndef __x86_64__
+	char stripped[512];
+#endif
+
 	if (oname[0] != '_')
 	{
 		// assume local (e.g. dyld_stub_binder)
 		name = oname;
-		sym = reinterpret_cast<uintptr_t>(dlsym(dlopen(0, 0), name.c_str()));
+		sym = reinterpret_cast<uintptr_t>(dlsym(dlopen(0, 0), name));
 	}
 	else
 	{
-		name = oname.substr(1);
+		name = oname + 1;
 
 		// TODO: remove, replace with aliases
 #ifndef __x86_64__
 		static const char* SUF_UNIX03 = "$UNIX2003";
 		static const size_t SUF_UNIX03_LEN = strlen(SUF_UNIX03);
-		if (name.size() > SUF_UNIX03_LEN && !strcmp(name.c_str() + name.size() - SUF_UNIX03_LEN, SUF_UNIX03))
-			name = name.substr(0, name.size() - SUF_UNIX03_LEN);
+		size_t len = strlen(name);
+		if (len > SUF_UNIX03_LEN && len < sizeof(stripped) && !strcmp(name + len - SUF_UNIX03_LEN, SUF_UNIX03))
+		{
+			memcpy(stripped, name, len - SUF_UNIX03_LEN);
+			stripped[len - SUF_UNIX03_LEN] = 0;
+			name = stripped;
+		}
 #endif
-		sym = reinterpret_cast<uintptr_t>(__darwin_dlsym(DARWIN_RTLD_DEFAULT, name.c_str()));
+		sym = reinterpret_cast<uintptr_t>(__darwin_dlsym(DARWIN_RTLD_DEFAULT, name));
 	}
 	
 	if (!sym)
@@ -520,8 +1061,8 @@ uintptr_t MachOLoader::getSymbolAddress(const std::string& oname, const MachO::B
 			{
 				std::cerr << "!!! Undefined symbol: " << name << std::endl;
 							
-				char* dname = new char[name.size()+1];
-				strcpy(dname, name.c_str());
+				char* dname = new char[strlen(name)+1];
+				strcpy(dname, name);
 				
 				sym = reinterpret_cast<uintptr_t>(m_pUndefMgr->generateNew(dname));
 			}
@@ -537,8 +1078,45 @@ uintptr_t MachOLoader::getSymbolAddress(const std::string& oname, const MachO::B
 			sym = uintptr_t(bind->value) + slide;
 	}
 
-	m_lastResolvedSymbol = oname;
-	m_lastResolvedAddress = sym;
+	return sym;
+}
+
+uintptr_t MachOLoader::doLazyBind(const FileMap::ImageMap* img, uintptr_t lazyOffset, bool eager)
+{
+	MachO::LazyBind bind;
+	const char* symbol;
+	uintptr_t* ptr;
+	uintptr_t sym;
+
+	if (lazyOffset >= img->lazy_binds_size
+		|| !MachO::readLazyBind(img->lazy_binds + lazyOffset, img->lazy_binds + img->lazy_binds_size, &bind)
+		|| size_t(bind.seg_index) >= img->segments.size())
+	{
+		std::stringstream ss;
+		ss << "Lazy bind not found for offset 0x" << std::hex << lazyOffset << " in " << img->filename;
+		throw std::runtime_error(ss.str());
+	}
+
+	// A stub instruction cannot be rewritten while another thread may be executing it
+	if (eager && bind.type != BIND_TYPE_POINTER)
+		return 0;
+
+	// The lazy binding info is read from the loaded __LINKEDIT
+	symbol = StringPool::internStable(bind.name);
+	ptr = reinterpret_cast<uintptr_t*>(img->segments[bind.seg_index] + bind.seg_offset);
+	sym = resolveTwoLevel(img, bind.ordinal, symbol);
+	if (!sym)
+		sym = resolveSymbol(symbol);
+	sym += bind.addend;
+
+	LOG << "lazy bind " << bind.name << ": " << std::hex << *ptr << std::dec << " => " << (void*)sym << " @" << ptr << std::endl;
+
+	// Other threads may be going through the same stub right now.
+	// They either still see the stub helper, which leads them here as well, or the final address.
+	if (bind.type == BIND_TYPE_POINTER)
+		__atomic_store_n(ptr, sym, __ATOMIC_RELEASE);
+	else
+		writeBind(bind.type, ptr, sym);
 
 	return sym;
 }
@@ -566,21 +1144,31 @@ void MachOLoader::writeBind(int type, uintptr_t* ptr, uintptr_t newAddr)
 #endif
 }
 
-void MachOLoader::loadExports(const MachO& mach, intptr base, Exports* exports)
+void MachOLoader::loadExports(const MachO& mach, intptr base, intptr slide, Exports* exports)
 {
-	exports->rehash(exports->size() + mach.exports().size());
-	
-	for (MachO::Export* exp : mach.exports())
+	std::pair<uint32_t,uint32_t> trie = mach.get_export_trie_info();
+
+	if (trie.first && trie.second)
 	{
-		exp->addr += base;
-		// TODO(hamaji): Not 100% sure, but we may need to consider weak symbols.
-		if (!exports->insert(make_pair(exp->name, *exp)).second)
-		{
-			// Until we support two-level namespaces, duplicate symbols may happen where they would not happen on Darwin.
-			// In this case we simply use the first known symbol.
-			LOG << "Warning: duplicate exported symbol name: " << exp->name << std::endl;
-		}
+		// Symbols are looked up straight in the loaded __LINKEDIT, only when somebody asks for them
+		uint64_t addr = mach.vmaddrForFileOffset(trie.first);
+		if (!addr)
+			throw std::runtime_error("The export trie is not mapped into memory");
+
+		exports->setTrie(reinterpret_cast<const uint8_t*>(addr + slide), trie.second, base);
 	}
+
+	m_symbolIndex.addExports(exports);
+}
+
+void MachOLoader::unloadExports(Exports* exports)
+{
+	m_symbolIndex.removeExports(exports);
+	m_exports.remove(exports);
+
+	// Never freed: symbol lookups don't lock and may still be reading them.
+	// The image itself stays mapped too.
+	m_unloadedExports.push_back(exports);
 }
 
 const std::string& MachOLoader::getCurrentLoader() const
@@ -607,14 +1195,35 @@ void MachOLoader::load(const MachO& mach, std::string sourcePath, Exports* expor
 	intptr slide = 0;
 	intptr base = 0;
 	const FileMap::ImageMap* img;
+	std::vector<LoadedLibrary*> dependencies;
+	PrebindCache::Image* prebound = nullptr;
+	size_t initFuncCount;
 	size_t origRpathCount;
 
 	m_exports.push_back(exports);
+	m_symbolIndex.registerImage(exports);
 	pushCurrentLoader(sourcePath.c_str());
 
-	loadSegments(mach, &slide, &base);
+	{
+		LaunchTimeline::Span span(LaunchTimeline::PhaseMap, sourcePath);
+		loadSegments(mach, &slide, &base);
+	}
+
+	if (m_lazyFixups)
+		m_lazyFixups->registerImage(mach, slide);
+
+	if (m_prebindCache)
+		prebound = m_prebindCache->open(mach, slide);
+
+	if (!prebound || !m_prebindCache->mapRebased(prebound))
+	{
+		LaunchTimeline::Span span(LaunchTimeline::PhaseRebase, sourcePath);
 
-	doRebase(mach, slide);
+		// Images mapped at their preferred address need no rebasing
+		bool cacheable = slide ? doRebase(mach, slide) : true;
+		if (prebound)
+			m_prebindCache->rebased(prebound, cacheable);
+	}
 	doMProtect(); // decrease the segment protection value
 	
 	
@@ -622,29 +1231,40 @@ void MachOLoader::load(const MachO& mach, std::string sourcePath, Exports* expor
 	
 	for (const char* rpath : mach.rpaths())
 		m_rpathContext.push_back(rpath);
-	loadDylibs(mach, bindLater, bindLazy);
+	{
+		LaunchTimeline::Span span(LaunchTimeline::PhaseDependencies, sourcePath);
+		dependencies = loadDylibs(mach, bindLater, bindLazy);
+	}
 	m_rpathContext.resize(origRpathCount);
 	
+	initFuncCount = m_init_funcs.size();
 	loadInitFuncs(mach, slide);
 
-	loadExports(mach, base, exports);
+	if (g_launchClosure)
+		g_launchClosure->recordImage(sourcePath.c_str(), m_init_funcs.size() - initFuncCount);
+
+	loadExports(mach, base, slide, exports);
 	
 	
-	img = g_file_map.add(mach, slide, base, bindLazy);
+	img = g_file_map.add(mach, slide, base, exports, dependencies);
 	
 	if (!bindLater)
-		doBind(mach.binds(), slide, !bindLazy);
+	{
+		LaunchTimeline::Span span(LaunchTimeline::PhaseBind, sourcePath);
+		doBind(mach, img, !bindLazy, prebound);
+	}
 	doRelocations(mach.relocations(), base, slide);
 
 	if (!bindLater)
 	{
+		LaunchTimeline::Span span(LaunchTimeline::PhaseLoaderHooks, sourcePath);
 		for (LoaderHookFunc* func : g_machoLoaderHooks)
 			func(img->header, slide);
 	}
 	else
 	{
-		LOG << mach.binds().size() << " binds pending\n";
-		m_pendingBinds.push_back(PendingBind{ &mach, img->header, slide, bindLazy });
+		LOG << "Binds pending for " << mach.filename() << std::endl;
+		m_pendingBinds.push_back(PendingBind{ &mach, img, prebound, bindLazy });
 	}
 	
 	popCurrentLoader();
@@ -654,16 +1274,22 @@ void MachOLoader::doPendingBinds()
 {
 	for (const PendingBind& b : m_pendingBinds)
 	{
-		LOG << "Perform " << b.macho->binds().size() << " binds\n";
-		doBind(b.macho->binds(), b.slide, b.bindLazy);
+		LOG << "Perform binds for " << b.macho->filename() << std::endl;
+		{
+			LaunchTimeline::Span span(LaunchTimeline::PhaseBind, b.img->filename);
+			doBind(*b.macho, b.img, b.bindLazy, b.prebound);
+		}
 
 		auto eh_frame = b.macho->get_eh_frame();
 		if (eh_frame.first)
 		{
+			LaunchTimeline::Span span(LaunchTimeline::PhaseEHFrame, b.img->filename);
+
 			try
 			{
 				EHSection ehSection;
 				void *reworked_eh_data, *original_eh_data;
+				const void* search_table = nullptr;
 				
 				// On Darwin/i386, esp and ebp register numbers are swapped
 #ifdef __i386__
@@ -673,7 +1299,7 @@ void MachOLoader::doPendingBinds()
 				};
 #endif
 				
-				original_eh_data = (void*) (eh_frame.first + b.slide);
+				original_eh_data = (void*) (eh_frame.first + b.img->slide);
 				LOG << "Reworking __eh_frame at " << original_eh_data << std::endl;
 				
 				ehSection.load(original_eh_data, eh_frame.second);
@@ -682,10 +1308,22 @@ void MachOLoader::doPendingBinds()
 				ehSection.swapRegisterNumbers(regSwap);
 #endif
 				
-				ehSection.store(&reworked_eh_data, nullptr);
+				if (UnwindHook::active())
+					ehSection.store(&reworked_eh_data, nullptr, &search_table);
+				else
+					ehSection.store(&reworked_eh_data, nullptr);
 				
-				LOG << "Registering reworked __eh_frame at " << reworked_eh_data << std::endl;
-				__register_frame(reworked_eh_data); // TODO: free when unloading the image
+				if (search_table)
+				{
+					// Found by our _Unwind_Find_FDE() from now on
+					LOG << "Publishing reworked __eh_frame at " << reworked_eh_data << std::endl;
+					b.img->eh_frame_hdr.store(search_table, std::memory_order_release);
+				}
+				else
+				{
+					LOG << "Registering reworked __eh_frame at " << reworked_eh_data << std::endl;
+					__register_frame(reworked_eh_data); // TODO: free when unloading the image
+				}
 			}
 			catch (const std::exception& e)
 			{
@@ -694,8 +1332,9 @@ void MachOLoader::doPendingBinds()
 			}
 		}
 
+		LaunchTimeline::Span span(LaunchTimeline::PhaseLoaderHooks, b.img->filename);
 		for (LoaderHookFunc* func : g_machoLoaderHooks)
-			func(b.header, b.slide);
+			func(b.img->header, b.img->slide);
 	}
 	m_pendingBinds.clear();
 }
@@ -714,6 +1353,7 @@ void MachOLoader::runPendingInitFuncs(int argc, char** argv, char** envp, char**
 	for (size_t i = 0; i < m_init_funcs.size(); i++)
 	{
 		void** init_func = (void**) m_init_funcs[i];
+		LaunchTimeline::Span span(LaunchTimeline::PhaseInitializers, g_launchTimeline ? g_file_map.fileNameForAddr(*init_func) : nullptr);
 		LOG << "calling initializer function " << *init_func << std::endl;
 		
 		// TODO: missing ProgramVars! http://blogs.embarcadero.com/eboling/2010/01/29/5639/
@@ -751,10 +1391,21 @@ void MachOLoader::run(MachO& mach, int argc, char** argv, char** envp, bool bind
 
 	g_file_map.addWatchDog(m_last_addr + 1);
 
-	//g_timer.print(mach.filename().c_str());
-
 	doPendingBinds();
+
+	// Libraries loaded from now on are not a part of the launch
+	if (g_launchClosure)
+		g_launchClosure->finish(g_printStatistics);
+
+	// The stubs the last runs have used get bound while the initializers run
+	if (g_lazyBindProfile)
+		g_lazyBindProfile->startEagerBinding(this);
+
 	runPendingInitFuncs(argc, argv, &envCopy[0], apple);
+
+	// The application's own code is not a part of the launch
+	if (g_launchTimeline)
+		g_launchTimeline->finish(g_printStatistics);
 	
 	mach.close();
 	
@@ -829,38 +1480,19 @@ extern "C" void* dyld_stub_binder_fixup(const FileMap::ImageMap** imageMap, uint
 		}
 	}
 
-	std::vector<MachO::Bind*> toBind; // will hold only the single item we need to bind
-
-	(*imageMap)->mutex_lazy_binds.lock();
-
-	for (auto it = (*imageMap)->lazy_binds.begin(); it != (*imageMap)->lazy_binds.end(); it++)
-	{
-		if (it->offset == lazyOffset)
-		{
-			toBind.push_back(const_cast<MachO::Bind*>(&*it));
-			break;
-		}
-	}
-
-	if (toBind.empty())
-	{
-		std::cerr << "dyld_stub_binder_fixup(): Lazy bind not found for offset " << std::hex << lazyOffset << std::dec << std::endl;
-		abort();
-	}
-
-	void* addr;
 	try
 	{
-		addr = g_loader->doBind(toBind, (*imageMap)->slide, true);
+		ResolverStats::Timer timer(ResolverStats::LazyBind);
+
+		if (g_lazyBindProfile)
+			g_lazyBindProfile->record((*imageMap)->filename, lazyOffset);
+		return reinterpret_cast<void*>(g_loader->doLazyBind(*imageMap, lazyOffset));
 	}
 	catch (const std::exception& e)
 	{
 		std::cerr << "dyld_stub_binder_fixup(): Failed to resolve the symbol: " << e.what() << std::endl;
 		abort();
 	}
-
-	(*imageMap)->mutex_lazy_binds.unlock();
-	return addr;
 }
 
 #ifdef DEBUG
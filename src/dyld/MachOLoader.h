@@ -23,14 +23,21 @@ along with Darling.  If not, see <http://www.gnu.org/licenses/>.
 #include <vector>
 #include <string>
 #include <map>
+#include <unordered_map>
 #include <utility>
 #include <stack>
+#include <ostream>
 #include <stdint.h>
 #include "MachO.h"
 #include "arch.h"
 #include "ld.h"
 #include "UndefinedFunction.h"
 #include "Trampoline.h"
+#include "SymbolIndex.h"
+#include "FileMap.h"
+#include "PrebindCache.h"
+
+class LazyFixups;
 
 class MachOLoader
 {
@@ -54,16 +61,22 @@ public:
 	void loadSegments(const MachO& mach, intptr* slide, intptr* base);
 	
 	
-	void doRebase(const MachO& mach, intptr slide);
+	// Applies rebases straight from the rebase opcodes.
+	// Returns false if some of them modify the code (the image cannot be prebound then).
+	bool doRebase(const MachO& mach, intptr slide);
 	
 	// Puts initializer functions of that module into the list of initializers to be run
 	void loadInitFuncs(const MachO& mach, intptr slide);
 	
-	// Loads libraries this module depends on
-	void loadDylibs(const MachO& mach, bool nobinds, bool bindLazy);
+	// Loads libraries this module depends on, returns them in the order of bind ordinals
+	std::vector<LoadedLibrary*> loadDylibs(const MachO& mach, bool nobinds, bool bindLazy);
 	
 	// Resolves all external symbols required by this module
-	void* doBind(const std::vector<MachO::Bind*>& binds, intptr slide, bool resolveLazy = false);
+	// Uses and finally releases the prebind cache state of the image, if any
+	void* doBind(const MachO& mach, const FileMap::ImageMap* img, bool resolveLazy = false, PrebindCache::Image* prebound = nullptr);
+
+	// Applies LC_DYLD_CHAINED_FIXUPS (rebases and binds at once), page by page
+	void doChainedFixups(const MachO& mach, const FileMap::ImageMap* img);
 
 	// Binds external relocations
 	void doRelocations(const std::vector<MachO::Relocation*>& rels, intptr base, intptr slide);
@@ -72,8 +85,11 @@ public:
 	// We initially set the maximum value.
 	void doMProtect();
 	
-	// Creates a list of publicly visible functions in this module
-	void loadExports(const MachO& mach, intptr base, Exports* exports);
+	// Makes the symbols exported by this module available for lookups
+	void loadExports(const MachO& mach, intptr base, intptr slide, Exports* exports);
+
+	// Removes the module's exports from the global namespace (dlclose)
+	void unloadExports(Exports* exports);
 	
 	// Loads a Mach-O file and does all the processing
 	void load(const MachO& mach, std::string sourcePath, Exports* exports = 0, bool bindLater = false, bool bindLazy = false);
@@ -92,28 +108,82 @@ public:
 	
 	const std::list<Exports*>& getExports() const { return m_exports; }
 	Exports* getMainExecutableExports() const { return m_mainExports; }
+	SymbolIndex& getSymbolIndex() { return m_symbolIndex; }
 	
+	// Image mapping and rebasing counters (DYLD_PRINT_STATISTICS)
+	void printStatistics(std::ostream& out) const;
+
 	// Gets the path to the currently loaded Mach-O file
 	const std::string& getCurrentLoader() const;
+
+	// Resolves a single lazy bind, called by dyld_stub_binder, possibly from multiple threads at once.
+	// Eager binds (DYLD_BIND_PROFILE) only bind lazy pointers, which can be stored atomically, 0 is returned otherwise.
+	uintptr_t doLazyBind(const FileMap::ImageMap* img, uintptr_t lazyOffset, bool eager = false);
 	
 private:
 	// Jumps to the application entry
 	void boot(uint64_t entry, int argc, char** argv, char** envp, char** apple);
 
-	void writeBind(int type, uintptr_t* ptr, uintptr_t newAddr);
+	// State carried between the binds of a single module
+	struct BindContext
+	{
+		MachOLoader* loader;
+		const MachO* mach;
+		const FileMap::ImageMap* img;
+		PrebindCache::Image* prebound;
+		LazyFixups* lazy;
+		intptr slide;
+		bool resolveLazy;
+		uintptr_t sym;
+	};
+
+	static void rebaseCallback(const MachO::Rebase& rebase, void* ctx);
+	static void bindCallback(const MachO::Bind& bind, void* ctx);
+	static void prebindCallback(uintptr_t* ptr, int type, uintptr_t target, void* ctx);
+	void doBind(const MachO::Bind* bind, BindContext& ctx);
+	// Returns the definition all images use for a weakly bound symbol, the name is interned and includes the underscore
+	uintptr_t coalesceWeakDefinition(const char* symbol, const MachO::Bind* bind, const uintptr_t* ptr);
+	uintptr_t coalesceWeakDefinition(const char* symbol, const MachO::ChainedImport& imp);
+	// Looks for the definition chosen earlier, the name is interned and lacks the leading underscore
+	bool findWeakDefinition(const char* name, uintptr_t* addr);
+	uintptr_t chooseWeakDefinition(const char* name, uintptr_t addr, bool strong);
+
+	uintptr_t resolveChainedImport(const FileMap::ImageMap* img, const char* symbol, const MachO::ChainedImport& imp);
+	// Looks the symbol up in the library the bind ordinal names, 0 means that a flat lookup should be done instead
+	uintptr_t resolveTwoLevel(const FileMap::ImageMap* img, int ordinal, const char* name);
+	static void writeBind(int type, uintptr_t* ptr, uintptr_t newAddr);
 	// The name should include the extra underscore at the beginning
-	uintptr_t getSymbolAddress(const std::string& name, const MachO::Bind* bind = nullptr, intptr slide = 0);
+	uintptr_t getSymbolAddress(const char* name, const MachO::Bind* bind = nullptr, intptr slide = 0);
+	// Same as above, without using the last resolved symbol cache (safe to call without locking)
+	uintptr_t resolveSymbol(const char* name, const MachO::Bind* bind = nullptr, intptr slide = 0);
+
+	// Reserves address space for the whole image, at its preferred address if possible
+	intptr reserveImage(const MachO& mach, intptr preferred, intptr size);
 
 	// checks sysctl mmap_min_addr
 	static void checkMmapMinAddr(intptr addr);
+	static intptr mmapMinAddr();
 	void pushCurrentLoader(const char* currentLoader);
 	void popCurrentLoader();
 private:
 	intptr m_last_addr;
+	unsigned long m_unslidImages, m_rebasedImages, m_rebasedPages;
 	std::vector<uint64_t> m_init_funcs;
 	std::list<Exports*> m_exports;
 	Exports* m_mainExports;
-	std::vector<std::pair<std::string, uintptr_t> > m_seen_weak_binds;
+	SymbolIndex m_symbolIndex;
+	PrebindCache* m_prebindCache;
+	LazyFixups* m_lazyFixups;
+	std::vector<Exports*> m_unloadedExports;
+
+	// Weak definitions chosen so far, by the interned symbol name
+	struct WeakDefinition
+	{
+		uintptr_t addr;
+		bool strong; // found with __DARLING_RTLD_STRONG
+	};
+	std::unordered_map<const char*, WeakDefinition> m_weakDefinitions;
+	unsigned long m_weakBindsCoalesced;
 	UndefMgr* m_pUndefMgr;
 	TrampolineMgr* m_pTrampolineMgr;
 	
@@ -130,8 +200,8 @@ private:
 	struct PendingBind
 	{
 		const MachO* macho;
-		const mach_header* header;
-		intptr slide;
+		const FileMap::ImageMap* img;
+		PrebindCache::Image* prebound;
 		bool bindLazy;
 	};
 	std::vector<PendingBind> m_pendingBinds;
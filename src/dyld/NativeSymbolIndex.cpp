@@ -0,0 +1,383 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "NativeSymbolIndex.h"
+#include "SymbolIndex.h"
+#include "StringPool.h"
+#include "log.h"
+#include <dlfcn.h>
+#include <elf.h>
+#include <cstring>
+#include <algorithm>
+
+// Objects outside of the Darwin dlopen() list come after all of its libraries
+#define GLOBAL_SCOPE_RANK 0x10000000u
+
+// How many symbols inGlobalScope() asks ::dlsym() about before giving up
+#define MAX_SCOPE_PROBES 64
+
+namespace
+{
+	struct Object
+	{
+		ElfW(Addr) base;
+		const ElfW(Dyn)* dynamic;
+		uint32_t rank;
+	};
+}
+
+// Dynamic entries are relocated by ld.so, except for objects like the vDSO
+template <typename T>
+static const T* dynamicPointer(ElfW(Addr) base, ElfW(Addr) ptr)
+{
+	return reinterpret_cast<const T*>(ptr < base ? base + ptr : ptr);
+}
+
+static size_t gnuHashSymbolCount(const uint32_t* hashtab)
+{
+	uint32_t nbuckets = hashtab[0], symoffset = hashtab[1], bloomSize = hashtab[2];
+	const uint32_t* buckets = reinterpret_cast<const uint32_t*>(reinterpret_cast<const ElfW(Addr)*>(hashtab + 4) + bloomSize);
+	const uint32_t* chains = buckets + nbuckets;
+	uint32_t last = 0;
+
+	for (uint32_t i = 0; i < nbuckets; i++)
+		last = std::max(last, buckets[i]);
+
+	if (last < symoffset)
+		return symoffset;
+
+	// The chain of the last bucket ends with a set lowest bit
+	while (!(chains[last - symoffset] & 1))
+		last++;
+	return last + 1;
+}
+
+bool NativeSymbolIndex::readDynamic(ElfW(Addr) base, const ElfW(Dyn)* dynamic, DynamicInfo* info)
+{
+	const uint32_t *hash = nullptr, *gnuhash = nullptr;
+
+	memset(info, 0, sizeof(*info));
+
+	for (const ElfW(Dyn)* d = dynamic; d->d_tag != DT_NULL; d++)
+	{
+		switch (d->d_tag)
+		{
+			case DT_SYMTAB:
+				info->symtab = dynamicPointer<ElfW(Sym)>(base, d->d_un.d_ptr);
+				break;
+			case DT_STRTAB:
+				info->strtab = dynamicPointer<char>(base, d->d_un.d_ptr);
+				break;
+			case DT_VERSYM:
+				info->versym = dynamicPointer<ElfW(Half)>(base, d->d_un.d_ptr);
+				break;
+			case DT_HASH:
+				hash = dynamicPointer<uint32_t>(base, d->d_un.d_ptr);
+				break;
+			case DT_GNU_HASH:
+				gnuhash = dynamicPointer<uint32_t>(base, d->d_un.d_ptr);
+				break;
+		}
+	}
+
+	if (!info->symtab || !info->strtab)
+		return false;
+
+	if (gnuhash)
+		info->count = gnuHashSymbolCount(gnuhash);
+	else if (hash)
+		info->count = hash[1]; // nchain
+	else
+		return false;
+
+	return true;
+}
+
+NativeSymbolIndex::NativeSymbolIndex()
+	: m_table(nullptr), m_readers(0)
+{
+}
+
+NativeSymbolIndex::Table::Table()
+	: generation(0), adds(0), subs(0), nextScopeRank(GLOBAL_SCOPE_RANK), entries(4096)
+{
+}
+
+int NativeSymbolIndex::countersCallback(struct dl_phdr_info* info, size_t size, void* data)
+{
+	Counters* counters = static_cast<Counters*>(data);
+
+	counters->adds = info->dlpi_adds;
+	counters->subs = info->dlpi_subs;
+	return 1; // the same for every object
+}
+
+NativeSymbolIndex::Counters NativeSymbolIndex::currentCounters()
+{
+	Counters counters = { 0, 0 };
+
+	dl_iterate_phdr(countersCallback, &counters);
+	return counters;
+}
+
+int NativeSymbolIndex::phdrCallback(struct dl_phdr_info* info, size_t size, void* data)
+{
+	std::vector<Object>* objects = static_cast<std::vector<Object>*>(data);
+
+	for (int i = 0; i < info->dlpi_phnum; i++)
+	{
+		if (info->dlpi_phdr[i].p_type == PT_DYNAMIC)
+		{
+			Object obj = { info->dlpi_addr, reinterpret_cast<const ElfW(Dyn)*>(info->dlpi_addr + info->dlpi_phdr[i].p_vaddr), 0 };
+			objects->push_back(obj);
+			break;
+		}
+	}
+	return 0;
+}
+
+bool NativeSymbolIndex::isCurrent(const Table* table, unsigned long generation, const Counters& counters)
+{
+	return table && table->generation.load(std::memory_order_acquire) == generation
+		&& table->adds.load(std::memory_order_relaxed) == counters.adds
+		&& table->subs.load(std::memory_order_relaxed) == counters.subs;
+}
+
+NativeSymbolIndex::Table* NativeSymbolIndex::update(Table* table, const std::vector<void*>& handles, unsigned long generation, const Counters& counters)
+{
+	std::vector<Object> scope;
+	size_t objects = 0;
+
+	// Ranks only ever get appended, anything that has gone away needs a new table
+	if (!table || table->subs.load(std::memory_order_relaxed) != counters.subs || handles.size() < table->handles.size()
+		|| !std::equal(table->handles.begin(), table->handles.end(), handles.begin()))
+	{
+		table = new Table;
+	}
+
+	for (size_t i = table->handles.size(); i < handles.size(); i++)
+	{
+		struct link_map* lm;
+		DynamicInfo info;
+
+		if (dlinfo(handles[i], RTLD_DI_LINKMAP, &lm) == 0 && lm->l_ld && readDynamic(lm->l_addr, lm->l_ld, &info))
+		{
+			addObject(table, lm->l_addr, info, uint32_t(i));
+			objects++;
+		}
+		table->handles.push_back(handles[i]);
+	}
+
+	dl_iterate_phdr(phdrCallback, &scope);
+
+	// RTLD_DEFAULT doesn't search libraries opened with RTLD_LOCAL.
+	// Objects that have been looked at once aren't probed again.
+	for (const Object& obj : scope)
+	{
+		DynamicInfo info;
+
+		if (!table->scope.insert(obj.dynamic).second)
+			continue;
+		if (readDynamic(obj.base, obj.dynamic, &info) && inGlobalScope(obj.base, info))
+		{
+			addObject(table, obj.base, info, table->nextScopeRank++);
+			objects++;
+		}
+	}
+
+	table->adds.store(counters.adds, std::memory_order_relaxed);
+	table->subs.store(counters.subs, std::memory_order_relaxed);
+	table->generation.store(generation, std::memory_order_release);
+
+	LOG << "Native symbol index: " << objects << " objects added\n";
+	return table;
+}
+
+bool NativeSymbolIndex::isVisible(const DynamicInfo& info, size_t index)
+{
+	const ElfW(Sym)& sym = info.symtab[index];
+	int type = sym.st_info & 0xf; // ELF_ST_TYPE
+	int bind = sym.st_info >> 4; // ELF_ST_BIND
+
+	if (sym.st_shndx == SHN_UNDEF || !sym.st_value)
+		return false;
+	if (bind != STB_GLOBAL && bind != STB_WEAK && bind != STB_GNU_UNIQUE)
+		return false;
+	if (type == STT_TLS || type == STT_SECTION || type == STT_FILE)
+		return false;
+
+	// Hidden (non-default) versions and local symbols are not visible to dlsym()
+	if (info.versym && ((info.versym[index] & 0x8000) || info.versym[index] == 0))
+		return false;
+
+	return true;
+}
+
+bool NativeSymbolIndex::inGlobalScope(ElfW(Addr) base, const DynamicInfo& info)
+{
+	int probes = 0;
+
+	// Ask ::dlsym() about some of the object's own definitions:
+	// getting one of them back proves the object is searched, getting nothing proves it isn't.
+	// A definition from an object earlier in the scope says nothing, so try another symbol.
+	for (size_t i = 1; i < info.count && probes < MAX_SCOPE_PROBES; i++)
+	{
+		const ElfW(Sym)& sym = info.symtab[i];
+		const char* name = info.strtab + sym.st_name;
+		void* addr;
+
+		if (!isVisible(info, i) || (sym.st_info & 0xf) == STT_GNU_IFUNC || !*name)
+			continue;
+
+		probes++;
+		addr = ::dlsym(RTLD_DEFAULT, name);
+
+		if (addr == reinterpret_cast<void*>(base + sym.st_value))
+			return true;
+		if (!addr)
+			return false;
+	}
+
+	// Nothing to tell by, or everything is shadowed and the object's ranking doesn't matter
+	return probes > 0;
+}
+
+void NativeSymbolIndex::addObject(Table* table, ElfW(Addr) base, const DynamicInfo& info, uint32_t rank)
+{
+	table->blocks.push_back(std::vector<Entry>());
+	std::vector<Entry>& block = table->blocks.back();
+
+	for (size_t i = 1; i < info.count; i++)
+	{
+		const ElfW(Sym)& sym = info.symtab[i];
+		Entry e;
+
+		if (!isVisible(info, i))
+			continue;
+
+		// The object may be unloaded by native code without dyld noticing until the next lookup
+		e.name = StringPool::intern(info.strtab + sym.st_name);
+		e.addr = reinterpret_cast<void*>(base + sym.st_value);
+		e.rank = rank;
+		e.ifunc = (sym.st_info & 0xf) == STT_GNU_IFUNC;
+
+		block.push_back(e);
+	}
+
+	// Not resized anymore, the table can point into it
+	for (const Entry& e : block)
+	{
+		size_t hash = StringPool::hashInterned(e.name);
+		const Entry* other = find(table, e.name, hash);
+
+		if (!other)
+			table->entries.insert(hash, &e);
+		else if (e.rank < other->rank)
+			table->entries.replace(hash, other, &e);
+	}
+}
+
+const NativeSymbolIndex::Entry* NativeSymbolIndex::find(const Table* table, const char* interned, size_t hash)
+{
+	return table->entries.find(hash, [interned](const Entry* e) { return e->name == interned; });
+}
+
+const NativeSymbolIndex::Entry* NativeSymbolIndex::find(const Table* table, const char* name)
+{
+	const char* interned = StringPool::find(name);
+
+	// Every indexed name has been interned
+	if (!interned)
+		return nullptr;
+	return find(table, interned, StringPool::hashInterned(interned));
+}
+
+void NativeSymbolIndex::retire(Table* table)
+{
+	if (table)
+		m_retiredTables.push_back(table);
+
+	// Pairs with the increment in lookup(): a lookup that comes later sees the current tables.
+	// The caller is a lookup too.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (m_readers.load() != 1)
+		return;
+
+	for (Table* t : m_retiredTables)
+		delete t;
+	m_retiredTables.clear();
+	m_table.load(std::memory_order_relaxed)->entries.freeRetired();
+}
+
+bool NativeSymbolIndex::lookup(const char* translated, const char* symbol, const std::vector<void*>& handles, void** addr)
+{
+	const unsigned long generation = SymbolIndex::currentNativeGeneration();
+	const Counters counters = currentCounters();
+	const Entry *e1, *e2 = nullptr;
+	Table* table;
+	bool answered = true;
+
+	m_readers.fetch_add(1);
+	table = m_table.load();
+
+	// Native code may load and unload objects without dyld noticing, the counters of ld.so catch that
+	if (!isCurrent(table, generation, counters))
+	{
+		// Whoever holds the ld.so lock (e.g. running constructors) may be waiting for this,
+		// while the update calls ::dlsym(), which takes the ld.so lock
+		if (!m_publishMutex.trylock())
+		{
+			m_readers.fetch_sub(1, std::memory_order_release);
+			return false;
+		}
+
+		table = m_table.load(std::memory_order_relaxed);
+		if (!isCurrent(table, generation, counters))
+		{
+			Table* updated = update(table, handles, generation, counters);
+
+			if (updated != table)
+			{
+				m_table.store(updated);
+				retire(table);
+			}
+			else
+				retire(nullptr);
+			table = updated;
+		}
+
+		m_publishMutex.unlock();
+	}
+
+	e1 = find(table, translated);
+	if (strcmp(translated, symbol) != 0)
+		e2 = find(table, symbol);
+
+	// ::dlsym(RTLD_DEFAULT) is only done for the translated name first, then for the original one
+	if (e2 && (!e1 || std::min(e2->rank, GLOBAL_SCOPE_RANK) < std::min(e1->rank, GLOBAL_SCOPE_RANK)))
+		e1 = e2;
+
+	if (e1 && e1->ifunc)
+		answered = false;
+	else
+		*addr = e1 ? e1->addr : nullptr;
+
+	m_readers.fetch_sub(1, std::memory_order_release);
+	return answered;
+}
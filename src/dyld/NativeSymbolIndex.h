@@ -0,0 +1,116 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef NATIVESYMBOLINDEX_H
+#define NATIVESYMBOLINDEX_H
+#include <stdint.h>
+#include <vector>
+#include <list>
+#include <set>
+#include <atomic>
+#include <link.h>
+#include "mutex.h"
+#include "AtomicHashSet.h"
+
+// Hash index of the dynamic symbols of all loaded ELF objects, read from their .dynsym.
+// Replaces probing every native library with ::dlsym() when a symbol isn't exported by any Mach-O image.
+//
+// Definitions from the libraries dlopen()ed by Darwin code win in their load order,
+// followed by the rest of the global scope in the dl_iterate_phdr() order, which is what RTLD_DEFAULT searches.
+// Objects native code has dlopen()ed with RTLD_LOCAL are left out.
+// Only default symbol versions are indexed, just like ::dlsym() would return.
+//
+// The first lookup after SymbolIndex::currentNativeGeneration() changes or ld.so loads an object
+// (dl_iterate_phdr()'s dlpi_adds) adds the new objects to the index. Only once an object is unloaded
+// (dlpi_subs) or a library leaves the Darwin dlopen() list is the index rebuilt from scratch.
+// Objects native code has promoted to RTLD_GLOBAL later on are missed, so the caller
+// has to confirm misses with ::dlsym(RTLD_DEFAULT).
+//
+// The names are interned in StringPool, as native code may unload an object while a lookup is running.
+// Lookups take no locks, except for the one that updates the index. Replaced tables are freed
+// by an update that finds no other lookup running.
+class NativeSymbolIndex
+{
+public:
+	NativeSymbolIndex();
+
+	// Looks up both names in the order dlsymNative() probes them.
+	// Returns false if the index cannot answer, *addr is nullptr if neither name is defined.
+	bool lookup(const char* translated, const char* symbol, const std::vector<void*>& handles, void** addr);
+
+private:
+	// Objects ld.so has loaded and unloaded so far
+	struct Counters
+	{
+		unsigned long long adds, subs;
+	};
+
+	struct Entry
+	{
+		const char* name; // interned
+		void* addr;
+		uint32_t rank; // lower wins
+		bool ifunc; // the address is the resolver's, only ::dlsym() can tell the real one
+	};
+
+	struct Table
+	{
+		Table();
+
+		// What the table has indexed so far
+		std::atomic<unsigned long> generation; // SymbolIndex::currentNativeGeneration()
+		std::atomic<unsigned long long> adds, subs; // ld.so's counters
+		std::vector<void*> handles; // the Darwin dlopen() list
+		std::set<const ElfW(Dyn)*> scope; // objects of the global scope, including those found to be RTLD_LOCAL
+		uint32_t nextScopeRank;
+
+		Darling::AtomicHashSet<const Entry> entries; // keyed by the interned name
+		std::list<std::vector<Entry>> blocks; // entries of each object
+	};
+
+	struct DynamicInfo
+	{
+		const ElfW(Sym)* symtab;
+		const char* strtab;
+		const ElfW(Half)* versym;
+		size_t count;
+	};
+
+	static Counters currentCounters();
+	static bool isCurrent(const Table* table, unsigned long generation, const Counters& counters);
+	static Table* update(Table* table, const std::vector<void*>& handles, unsigned long generation, const Counters& counters);
+	static const Entry* find(const Table* table, const char* interned, size_t hash);
+	static const Entry* find(const Table* table, const char* name);
+
+	static bool readDynamic(ElfW(Addr) base, const ElfW(Dyn)* dynamic, DynamicInfo* info);
+	static bool isVisible(const DynamicInfo& info, size_t index);
+	static bool inGlobalScope(ElfW(Addr) base, const DynamicInfo& info);
+	static void addObject(Table* table, ElfW(Addr) base, const DynamicInfo& info, uint32_t rank);
+	static int phdrCallback(struct dl_phdr_info* info, size_t size, void* data);
+	static int countersCallback(struct dl_phdr_info* info, size_t size, void* data);
+
+	void retire(Table* table);
+
+	std::atomic<Table*> m_table;
+	std::atomic<unsigned> m_readers; // lookups that may be probing a table right now
+	std::vector<Table*> m_retiredTables;
+	Darling::Mutex m_publishMutex;
+};
+
+#endif
@@ -0,0 +1,704 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "PrebindCache.h"
+#include "FileMap.h"
+#include "log.h"
+#include "fnv.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <libgen.h>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include <map>
+
+extern FileMap g_file_map;
+extern bool g_forceFlat;
+
+#define PREBIND_MAGIC 0x43425044 // "DPBC"
+#define PREBIND_VERSION 2
+#define PREBIND_NO_LIBRARY 0xffffffffu // null bind target (missing weak import)
+#define PREBIND_PAGE_SIZE 0x1000
+
+enum { FlagBinds = 1, FlagLazyResolved = 2 };
+enum { LibraryMachO, LibraryNative };
+
+// The file starts with the header, followed by CacheSegment[segmentCount], CacheLibrary[libraryCount],
+// CacheBind[bindCount] and library names. Segment contents are stored at page aligned offsets after that.
+struct CacheHeader
+{
+	uint32_t magic, version;
+	uint64_t dev, ino, size;
+	int64_t mtime, mtimeNsec;
+	uint64_t offset; // of the architecture in a fat file
+	uint64_t slide;
+	uint64_t namespaceHash; // of all the libraries loaded at the time of binding
+	uint32_t segmentCount, libraryCount, bindCount, flags;
+	uint64_t stringsSize;
+};
+
+struct CacheSegment
+{
+	uint64_t addr, size, fileOffset;
+	int32_t prot, reserved;
+};
+
+struct CacheLibrary
+{
+	uint64_t dev, ino, size;
+	int64_t mtime, mtimeNsec;
+	uint32_t kind, name; // name is an offset into the strings
+};
+
+struct CacheBind
+{
+	uint64_t address, offset; // offset from the library's base
+	uint32_t library, type;
+};
+
+struct PrebindCache::Image
+{
+	std::string path;
+	struct stat st;
+	uint64_t archOffset;
+	intptr slide;
+	std::vector<CacheSegment> segments; // writable segments of the loaded image
+
+	// Existing entry for this file and slide, mapped read-only
+	int fd;
+	const uint8_t* entry;
+	size_t entrySize;
+	bool rebasesMapped;
+	bool cacheable;
+
+	// Segment contents after a rebase done the usual way
+	std::vector<std::vector<uint8_t> > snapshot;
+
+	// Binds done the usual way
+	bool recording, bindsDiscarded;
+	uint64_t namespaceHash;
+	std::vector<CacheLibrary> libraries;
+	std::vector<CacheBind> binds;
+	std::string strings;
+	std::map<std::string, uint32_t> libraryIndex;
+
+	const CacheHeader* header() const { return reinterpret_cast<const CacheHeader*>(entry); }
+	const CacheSegment* cachedSegments() const { return reinterpret_cast<const CacheSegment*>(header() + 1); }
+	const CacheLibrary* cachedLibraries() const { return reinterpret_cast<const CacheLibrary*>(cachedSegments() + header()->segmentCount); }
+	const CacheBind* cachedBinds() const { return reinterpret_cast<const CacheBind*>(cachedLibraries() + header()->libraryCount); }
+	const char* cachedStrings() const { return reinterpret_cast<const char*>(cachedBinds() + header()->bindCount); }
+};
+
+static uint64_t alignPage(uint64_t p)
+{
+	return (p + PREBIND_PAGE_SIZE - 1) & ~uint64_t(PREBIND_PAGE_SIZE - 1);
+}
+
+struct LoadedFile
+{
+	std::string path;
+	uint64_t dev, ino, size;
+	int64_t mtime, mtimeNsec;
+};
+
+// Files of the loaded libraries by their load address, they don't change while loaded.
+// Only used with the loader lock held.
+static std::map<uintptr_t, LoadedFile> g_loadedFiles;
+
+// Mixes in the path and the identity of the file loaded at base (which doesn't exist for e.g. the vDSO)
+static uint64_t hashLoadedFile(uint64_t h, const char* path, uintptr_t base)
+{
+	LoadedFile& file = g_loadedFiles[base];
+
+	if (file.path != path || (!file.dev && !file.ino))
+	{
+		struct stat st;
+
+		file.path = path;
+		memset(&st, 0, sizeof(st));
+		::stat(*path ? path : "/proc/self/exe", &st);
+
+		file.dev = st.st_dev;
+		file.ino = st.st_ino;
+		file.size = st.st_size;
+		file.mtime = st.st_mtim.tv_sec;
+		file.mtimeNsec = st.st_mtim.tv_nsec;
+	}
+
+	h = Darling::fnv1a64(path, strlen(path) + 1, h);
+	h = Darling::fnv1a64(&file.dev, sizeof(file.dev), h);
+	h = Darling::fnv1a64(&file.ino, sizeof(file.ino), h);
+	h = Darling::fnv1a64(&file.size, sizeof(file.size), h);
+	h = Darling::fnv1a64(&file.mtime, sizeof(file.mtime), h);
+	return Darling::fnv1a64(&file.mtimeNsec, sizeof(file.mtimeNsec), h);
+}
+
+static int hashNativeLibrary(struct dl_phdr_info* info, size_t size, void* data)
+{
+	uint64_t* h = static_cast<uint64_t*>(data);
+	*h = hashLoadedFile(*h, info->dlpi_name, info->dlpi_addr);
+	return 0;
+}
+
+// Identifies the set of loaded libraries and how symbols are looked up in them, flat lookups depend on it.
+// A library replaced on disk under the same name also changes which definitions they find.
+static uint64_t currentNamespaceHash()
+{
+	uint64_t h = Darling::FNV64_BASIS;
+	uint8_t flat = g_forceFlat;
+
+	h = Darling::fnv1a64(&flat, sizeof(flat), h);
+
+	for (const FileMap::ImageMap* map : g_file_map.images())
+		h = hashLoadedFile(h, map->filename.c_str(), map->base);
+
+	dl_iterate_phdr(hashNativeLibrary, &h);
+	return h;
+}
+
+static bool sameFile(const struct stat& st, uint64_t dev, uint64_t ino, uint64_t size, int64_t mtime, int64_t mtimeNsec)
+{
+	return uint64_t(st.st_dev) == dev && uint64_t(st.st_ino) == ino && uint64_t(st.st_size) == size
+		&& st.st_mtim.tv_sec == mtime && st.st_mtim.tv_nsec == mtimeNsec;
+}
+
+template <typename Segment>
+static void writableSegments(const std::vector<Segment*>& segments, intptr slide, std::vector<CacheSegment>& out)
+{
+	for (const Segment* seg : segments)
+	{
+		if (!(seg->initprot & VM_PROT_WRITE) || !seg->filesize)
+			continue;
+
+		CacheSegment cs;
+		int prot = 0;
+
+		// Same as in MachOLoader::loadSegments()
+		if (seg->maxprot & VM_PROT_READ)
+			prot |= PROT_READ;
+		if (seg->maxprot & VM_PROT_WRITE)
+			prot |= PROT_WRITE;
+		if (seg->maxprot & VM_PROT_EXECUTE)
+			prot |= PROT_EXEC;
+
+		cs.addr = seg->vmaddr + slide;
+		cs.size = alignPage(seg->filesize);
+		cs.fileOffset = 0;
+		cs.prot = prot;
+		cs.reserved = 0;
+		out.push_back(cs);
+	}
+}
+
+PrebindCache::PrebindCache(const char* dir)
+	: m_dir(dir)
+{
+	if (::mkdir(dir, 0755) != 0 && errno != EEXIST)
+		LOG << "Cannot create the prebind cache directory " << dir << ": " << strerror(errno) << std::endl;
+}
+
+// Maps the existing entry if it is for this very file and slide
+static void readEntry(PrebindCache::Image* image)
+{
+	struct stat st;
+	void* mapped;
+	const CacheHeader* hdr;
+	size_t metaSize;
+
+	image->fd = ::open(image->path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (image->fd == -1)
+		return;
+
+	if (::fstat(image->fd, &st) != 0 || size_t(st.st_size) < sizeof(CacheHeader))
+		goto invalid;
+
+	mapped = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, image->fd, 0);
+	if (mapped == MAP_FAILED)
+		goto invalid;
+
+	image->entry = static_cast<const uint8_t*>(mapped);
+	image->entrySize = st.st_size;
+	hdr = image->header();
+
+	if (hdr->magic != PREBIND_MAGIC || hdr->version != PREBIND_VERSION
+		|| !sameFile(image->st, hdr->dev, hdr->ino, hdr->size, hdr->mtime, hdr->mtimeNsec)
+		|| hdr->offset != image->archOffset || hdr->slide != image->slide
+		|| hdr->segmentCount != image->segments.size())
+	{
+		goto invalid;
+	}
+
+	metaSize = sizeof(CacheHeader) + hdr->segmentCount * sizeof(CacheSegment) + uint64_t(hdr->libraryCount) * sizeof(CacheLibrary)
+		+ uint64_t(hdr->bindCount) * sizeof(CacheBind) + hdr->stringsSize;
+	if (metaSize > image->entrySize || (hdr->stringsSize && image->cachedStrings()[hdr->stringsSize - 1] != 0))
+		goto invalid;
+
+	for (uint32_t i = 0; i < hdr->segmentCount; i++)
+	{
+		const CacheSegment& cs = image->cachedSegments()[i];
+		const CacheSegment& seg = image->segments[i];
+
+		if (cs.addr != seg.addr || cs.size != seg.size || cs.prot != seg.prot
+			|| cs.fileOffset % PREBIND_PAGE_SIZE || cs.fileOffset + cs.size > image->entrySize)
+		{
+			goto invalid;
+		}
+	}
+
+	for (uint32_t i = 0; i < hdr->libraryCount; i++)
+	{
+		if (image->cachedLibraries()[i].name >= hdr->stringsSize)
+			goto invalid;
+	}
+
+	for (uint32_t i = 0; i < hdr->bindCount; i++)
+	{
+		uint32_t lib = image->cachedBinds()[i].library;
+		if (lib != PREBIND_NO_LIBRARY && lib >= hdr->libraryCount)
+			goto invalid;
+	}
+
+	return;
+
+invalid:
+	LOG << "Prebind cache entry " << image->path << " is outdated\n";
+	if (image->entry)
+		::munmap(const_cast<uint8_t*>(image->entry), image->entrySize);
+	::close(image->fd);
+	image->fd = -1;
+	image->entry = nullptr;
+	image->entrySize = 0;
+}
+
+PrebindCache::Image* PrebindCache::open(const MachO& mach, intptr slide)
+{
+	Image* image = new Image;
+	std::stringstream ss;
+	char name[4096];
+	uint64_t key = Darling::FNV64_BASIS;
+
+	if (::fstat(mach.fd(), &image->st) != 0)
+	{
+		delete image;
+		return nullptr;
+	}
+
+	image->archOffset = mach.offset();
+	image->slide = slide;
+	image->fd = -1;
+	image->entry = nullptr;
+	image->entrySize = 0;
+	image->rebasesMapped = false;
+	image->cacheable = true;
+	image->recording = false;
+	image->bindsDiscarded = false;
+	image->namespaceHash = 0;
+
+	// Unslid images need no rebasing, their entries only hold binds
+	if (slide && mach.is64())
+		writableSegments(mach.segments64(), slide, image->segments);
+	else if (slide)
+		writableSegments(mach.segments(), slide, image->segments);
+
+	// A changed file keeps its entry name, the old entry simply gets replaced
+	key = Darling::fnv1a64(&image->st.st_dev, sizeof(image->st.st_dev), key);
+	key = Darling::fnv1a64(&image->st.st_ino, sizeof(image->st.st_ino), key);
+	key = Darling::fnv1a64(&image->archOffset, sizeof(image->archOffset), key);
+
+	strncpy(name, mach.filename().c_str(), sizeof(name)-1);
+	name[sizeof(name)-1] = 0;
+
+	ss << m_dir << '/' << basename(name) << '-' << std::hex << key;
+	image->path = ss.str();
+
+	readEntry(image);
+	return image;
+}
+
+bool PrebindCache::mapRebased(Image* image)
+{
+	if (!image->entry)
+		return false;
+
+	for (uint32_t i = 0; i < image->header()->segmentCount; i++)
+	{
+		const CacheSegment& cs = image->cachedSegments()[i];
+		void* mapped;
+
+		LOG << "mmap(prebound) " << image->path << ": " << (void*)cs.addr << "-" << (void*)(cs.addr + cs.size) << std::endl;
+
+		mapped = ::mmap(reinterpret_cast<void*>(cs.addr), cs.size, cs.prot, MAP_PRIVATE | MAP_FIXED, image->fd, cs.fileOffset);
+		if (mapped == MAP_FAILED)
+		{
+			std::stringstream ss;
+			ss << "Failed to mmap '" << image->path << "': " << strerror(errno);
+			throw std::runtime_error(ss.str());
+		}
+	}
+
+	image->rebasesMapped = true;
+	return true;
+}
+
+void PrebindCache::rebased(Image* image, bool cacheable)
+{
+	if (!cacheable)
+	{
+		LOG << "Image cannot be prebound: " << image->path << std::endl;
+		image->cacheable = false;
+		return;
+	}
+
+	image->snapshot.resize(image->segments.size());
+	for (size_t i = 0; i < image->segments.size(); i++)
+	{
+		const uint8_t* start = reinterpret_cast<const uint8_t*>(image->segments[i].addr);
+		image->snapshot[i].assign(start, start + image->segments[i].size);
+	}
+}
+
+// Finds the current base address of a library a cached bind points into
+static bool libraryBase(const CacheLibrary& lib, const char* name, uintptr_t* base)
+{
+	struct stat st;
+
+	if (lib.kind == LibraryMachO)
+	{
+		const FileMap::ImageMap* map = g_file_map.imageMapForName(name);
+
+		if (!map || ::stat(name, &st) != 0)
+			return false;
+		*base = map->base;
+	}
+	else
+	{
+		struct link_map* lm;
+		void* handle;
+
+		// An empty name stands for the dyld executable
+		if (::stat(*name ? name : "/proc/self/exe", &st) != 0)
+			return false;
+
+		handle = ::dlopen(*name ? name : nullptr, RTLD_LAZY | RTLD_NOLOAD);
+		if (!handle)
+			return false;
+
+		if (::dlinfo(handle, RTLD_DI_LINKMAP, &lm) != 0)
+		{
+			::dlclose(handle);
+			return false;
+		}
+
+		*base = lm->l_addr;
+		::dlclose(handle);
+	}
+
+	return sameFile(st, lib.dev, lib.ino, lib.size, lib.mtime, lib.mtimeNsec);
+}
+
+bool PrebindCache::applyBinds(Image* image, bool resolveLazy, BindFunc func, void* ctx)
+{
+	const CacheHeader* hdr = image->header();
+
+	image->namespaceHash = currentNamespaceHash();
+
+	if (image->rebasesMapped && (hdr->flags & FlagBinds) && bool(hdr->flags & FlagLazyResolved) == resolveLazy
+		&& hdr->namespaceHash == image->namespaceHash)
+	{
+		std::vector<uintptr_t> bases(hdr->libraryCount);
+		bool valid = true;
+
+		for (uint32_t i = 0; i < hdr->libraryCount && valid; i++)
+		{
+			const CacheLibrary& lib = image->cachedLibraries()[i];
+			valid = libraryBase(lib, image->cachedStrings() + lib.name, &bases[i]);
+		}
+
+		if (valid)
+		{
+			LOG << "Applying " << hdr->bindCount << " prebound binds from " << image->path << std::endl;
+
+			for (uint32_t i = 0; i < hdr->bindCount; i++)
+			{
+				const CacheBind& b = image->cachedBinds()[i];
+				uintptr_t target = 0;
+
+				if (b.library != PREBIND_NO_LIBRARY)
+					target = bases[b.library] + b.offset;
+
+				func(reinterpret_cast<uintptr_t*>(b.address), b.type, target, ctx);
+			}
+			return true;
+		}
+	}
+
+	image->recording = image->cacheable;
+	return false;
+}
+
+// Finds the library containing the address, adds it to the image's library list
+static bool findLibrary(PrebindCache::Image* image, uintptr_t addr, uint32_t* index, uint64_t* offset)
+{
+	std::string name;
+	const char* statName;
+	uint32_t kind;
+	uintptr_t base;
+	Dl_info info;
+	struct link_map* lm = nullptr;
+
+	if (::dladdr1(reinterpret_cast<void*>(addr), &info, reinterpret_cast<void**>(&lm), RTLD_DL_LINKMAP) && lm)
+	{
+		name = lm->l_name;
+		base = lm->l_addr;
+		kind = LibraryNative;
+		statName = name.empty() ? "/proc/self/exe" : name.c_str();
+	}
+	else
+	{
+		const FileMap::ImageMap* map = g_file_map.imageMapForAddr(reinterpret_cast<void*>(addr));
+		bool inside = false;
+
+		if (!map)
+			return false;
+
+		// Make sure it isn't just some memory mapped after the image
+		for (const MachO::Section& sect : map->sections)
+		{
+			if (addr - map->slide >= sect.addr && addr - map->slide < sect.addr + sect.size)
+			{
+				inside = true;
+				break;
+			}
+		}
+		if (!inside)
+			return false;
+
+		name = map->filename;
+		base = map->base;
+		kind = LibraryMachO;
+		statName = name.c_str();
+	}
+
+	*offset = addr - base;
+
+	auto it = image->libraryIndex.find(name);
+	if (it != image->libraryIndex.end())
+	{
+		*index = it->second;
+		return true;
+	}
+
+	struct stat st;
+	CacheLibrary lib;
+
+	if (::stat(statName, &st) != 0)
+		return false;
+
+	lib.dev = st.st_dev;
+	lib.ino = st.st_ino;
+	lib.size = st.st_size;
+	lib.mtime = st.st_mtim.tv_sec;
+	lib.mtimeNsec = st.st_mtim.tv_nsec;
+	lib.kind = kind;
+	lib.name = image->strings.size();
+
+	image->strings.append(name.c_str(), name.size() + 1);
+
+	*index = image->libraries.size();
+	image->libraries.push_back(lib);
+	image->libraryIndex[name] = *index;
+
+	return true;
+}
+
+void PrebindCache::recordBind(Image* image, uintptr_t* ptr, int type, uintptr_t target)
+{
+	CacheBind b;
+
+	if (!image->recording || image->bindsDiscarded)
+		return;
+
+	b.address = reinterpret_cast<uintptr_t>(ptr);
+	b.type = type;
+	b.library = PREBIND_NO_LIBRARY;
+	b.offset = 0;
+
+	if (target && !findLibrary(image, target, &b.library, &b.offset))
+	{
+		LOG << "Bind target " << (void*)target << " is not in any library, not caching binds of " << image->path << std::endl;
+		discardBinds(image);
+		return;
+	}
+
+	image->binds.push_back(b);
+}
+
+void PrebindCache::discardBinds(Image* image)
+{
+	image->bindsDiscarded = true;
+	image->binds.clear();
+	image->libraries.clear();
+	image->libraryIndex.clear();
+	image->strings.clear();
+}
+
+static bool writeAll(int fd, const void* data, size_t len, off_t offset)
+{
+	const char* p = static_cast<const char*>(data);
+
+	while (len > 0)
+	{
+		ssize_t done = ::pwrite(fd, p, len, offset);
+		if (done < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += done;
+		len -= done;
+		offset += done;
+	}
+	return true;
+}
+
+bool PrebindCache::writeEntry(Image* image, bool resolveLazy)
+{
+	CacheHeader hdr;
+	std::vector<CacheSegment> segments = image->segments;
+	std::string tmp = image->path + ".XXXXXX";
+	std::vector<char> tmpName(tmp.begin(), tmp.end());
+	bool withBinds = image->recording && !image->bindsDiscarded;
+	uint64_t pos;
+	bool ok = true;
+	int fd;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = PREBIND_MAGIC;
+	hdr.version = PREBIND_VERSION;
+	hdr.dev = image->st.st_dev;
+	hdr.ino = image->st.st_ino;
+	hdr.size = image->st.st_size;
+	hdr.mtime = image->st.st_mtim.tv_sec;
+	hdr.mtimeNsec = image->st.st_mtim.tv_nsec;
+	hdr.offset = image->archOffset;
+	hdr.slide = image->slide;
+	hdr.segmentCount = segments.size();
+
+	if (withBinds)
+	{
+		hdr.namespaceHash = image->namespaceHash;
+		hdr.libraryCount = image->libraries.size();
+		hdr.bindCount = image->binds.size();
+		hdr.stringsSize = image->strings.size();
+		hdr.flags = FlagBinds | (resolveLazy ? FlagLazyResolved : 0);
+	}
+
+	pos = alignPage(sizeof(hdr) + segments.size() * sizeof(CacheSegment) + hdr.libraryCount * sizeof(CacheLibrary)
+		+ hdr.bindCount * sizeof(CacheBind) + hdr.stringsSize);
+
+	for (CacheSegment& cs : segments)
+	{
+		cs.fileOffset = pos;
+		pos += cs.size;
+	}
+
+	tmpName.push_back(0);
+	fd = ::mkstemp(&tmpName[0]);
+	if (fd == -1)
+	{
+		LOG << "Cannot create " << &tmpName[0] << ": " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	pos = 0;
+	ok = writeAll(fd, &hdr, sizeof(hdr), pos);
+	pos += sizeof(hdr);
+	ok = ok && writeAll(fd, segments.data(), segments.size() * sizeof(CacheSegment), pos);
+	pos += segments.size() * sizeof(CacheSegment);
+
+	if (withBinds)
+	{
+		ok = ok && writeAll(fd, image->libraries.data(), image->libraries.size() * sizeof(CacheLibrary), pos);
+		pos += image->libraries.size() * sizeof(CacheLibrary);
+		ok = ok && writeAll(fd, image->binds.data(), image->binds.size() * sizeof(CacheBind), pos);
+		pos += image->binds.size() * sizeof(CacheBind);
+		ok = ok && writeAll(fd, image->strings.data(), image->strings.size(), pos);
+	}
+
+	for (size_t i = 0; i < segments.size() && ok; i++)
+	{
+		const void* data;
+
+		// The rebased contents either come from this run or from the entry being replaced
+		if (image->rebasesMapped)
+			data = image->entry + image->cachedSegments()[i].fileOffset;
+		else
+			data = image->snapshot[i].data();
+
+		ok = writeAll(fd, data, segments[i].size, segments[i].fileOffset);
+	}
+
+	::close(fd);
+
+	if (!ok || ::rename(&tmpName[0], image->path.c_str()) != 0)
+	{
+		LOG << "Cannot write " << image->path << ": " << strerror(errno) << std::endl;
+		::unlink(&tmpName[0]);
+		return false;
+	}
+
+	LOG << "Wrote prebind cache entry " << image->path << " (" << hdr.bindCount << " binds)\n";
+	return true;
+}
+
+void PrebindCache::close(Image* image, bool resolveLazy)
+{
+	bool write = false;
+
+	if (image->cacheable)
+	{
+		if (!image->rebasesMapped)
+			write = true;
+		else if (image->recording)
+		{
+			// Don't rewrite an entry that had no binds to begin with
+			write = !image->bindsDiscarded || (image->header()->flags & FlagBinds);
+		}
+	}
+
+	if (write)
+		writeEntry(image, resolveLazy);
+
+	if (image->entry)
+		::munmap(const_cast<uint8_t*>(image->entry), image->entrySize);
+	if (image->fd != -1)
+		::close(image->fd);
+	delete image;
+}
@@ -0,0 +1,70 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PREBINDCACHE_H
+#define PREBINDCACHE_H
+#include <stdint.h>
+#include <string>
+#include "MachO.h"
+#include "arch.h"
+
+// On-disk cache of fixed up Mach-O images (DYLD_PREBIND_CACHE).
+//
+// Every entry belongs to a single file (device, inode, size and mtime) loaded at a particular slide.
+// It holds the writable segments of slid images as they look after rebasing, which then get mapped
+// straight from the cache file instead of applying the rebases again.
+// It also holds the target of every bind as an offset into the library defining the symbol,
+// so that no symbols need to be looked up as long as none of those libraries has changed
+// and the same set of libraries is loaded.
+class PrebindCache
+{
+public:
+	// The directory is created if it doesn't exist
+	PrebindCache(const char* dir);
+
+	// State of a single image between the load phases
+	struct Image;
+
+	typedef void (*BindFunc)(uintptr_t* ptr, int type, uintptr_t target, void* ctx);
+
+	// Called right after the image's segments have been mapped, returns nullptr if the image cannot be cached
+	Image* open(const MachO& mach, intptr slide);
+
+	// Maps the cached rebased segments over the image.
+	// Returns false if there are none, the rebases must be done the usual way then and passed to rebased().
+	bool mapRebased(Image* image);
+	void rebased(Image* image, bool cacheable);
+
+	// Calls func for every cached bind.
+	// Returns false if the binds are missing or outdated, they must be done the usual way then and passed to recordBind().
+	bool applyBinds(Image* image, bool resolveLazy, BindFunc func, void* ctx);
+	void recordBind(Image* image, uintptr_t* ptr, int type, uintptr_t target);
+	// The binds of this image cannot be cached (e.g. weak binds)
+	void discardBinds(Image* image);
+
+	// Updates the cache file if needed, the image must not be used afterwards
+	void close(Image* image, bool resolveLazy);
+
+private:
+	bool writeEntry(Image* image, bool resolveLazy);
+
+	std::string m_dir;
+};
+
+#endif
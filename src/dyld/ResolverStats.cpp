@@ -0,0 +1,97 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ResolverStats.h"
+#include <inttypes.h>
+
+// Zero initialized before any constructor runs, so counting works from the very start
+ResolverStats::Data ResolverStats::s_counters[ResolverStats::CounterCount];
+
+const char* ResolverStats::s_names[ResolverStats::CounterCount] = {
+	"dlsym", "dlsym __darwin hits", "dlsym Mach-O hits", "dlsym native fallback", "dlsym misses", "lazy binds"
+};
+
+void ResolverStats::record(Counter c, uint64_t ns)
+{
+	Data& d = s_counters[c];
+	int bucket = 0;
+
+	// Bucket i holds samples below 2^i ns, the last one everything above
+	if (ns)
+		bucket = 64 - __builtin_clzll(ns);
+	if (bucket >= DYLD_STATISTICS_BUCKETS)
+		bucket = DYLD_STATISTICS_BUCKETS - 1;
+
+	d.count.fetch_add(1, std::memory_order_relaxed);
+	d.totalNs.fetch_add(ns, std::memory_order_relaxed);
+	d.histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+int ResolverStats::get(struct dyld_statistics_counter* counters, uint32_t* count)
+{
+	uint32_t n = *count;
+
+	*count = CounterCount;
+	if (!counters)
+		return 0;
+	if (n > uint32_t(CounterCount))
+		n = CounterCount;
+
+	for (uint32_t i = 0; i < n; i++)
+	{
+		counters[i].name = s_names[i];
+		counters[i].count = s_counters[i].count.load(std::memory_order_relaxed);
+		counters[i].total_ns = s_counters[i].totalNs.load(std::memory_order_relaxed);
+
+		for (int b = 0; b < DYLD_STATISTICS_BUCKETS; b++)
+			counters[i].histogram[b] = s_counters[i].histogram[b].load(std::memory_order_relaxed);
+	}
+
+	return n < uint32_t(CounterCount) ? -1 : 0;
+}
+
+void ResolverStats::print(FILE* out)
+{
+	fprintf(out, "symbol resolution:\n");
+
+	for (int i = 0; i < CounterCount; i++)
+	{
+		const Data& d = s_counters[i];
+		uint64_t count = d.count.load(std::memory_order_relaxed);
+		uint64_t total = d.totalNs.load(std::memory_order_relaxed);
+
+		fprintf(out, "  %-22s %10" PRIu64, s_names[i], count);
+
+		// Only some counters are timed
+		if (total)
+		{
+			fprintf(out, "  %10.3f ms  [", total / 1e6);
+			for (int b = 0; b < DYLD_STATISTICS_BUCKETS; b++)
+			{
+				uint64_t samples = d.histogram[b].load(std::memory_order_relaxed);
+				if (samples && b == DYLD_STATISTICS_BUCKETS - 1)
+					fprintf(out, " >=2^%d ns: %" PRIu64, b - 1, samples);
+				else if (samples)
+					fprintf(out, " <2^%d ns: %" PRIu64, b, samples);
+			}
+			fprintf(out, " ]");
+		}
+		fprintf(out, "\n");
+	}
+}
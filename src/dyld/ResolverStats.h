@@ -0,0 +1,85 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RESOLVERSTATS_H
+#define RESOLVERSTATS_H
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <atomic>
+#include "public.h"
+
+// Process wide counters of symbol resolution after launch, read by _dyld_get_statistics().
+//
+// Always enabled: updating a counter is a few relaxed atomic additions, there are no locks,
+// and the latency histograms have power of two buckets, so recording a sample needs no search.
+class ResolverStats
+{
+public:
+	enum Counter
+	{
+		Dlsym, // __darwin_dlsym() with RTLD_DEFAULT
+		DlsymDarwinPrefixed, // found as __darwin_<name> in a native library
+		DlsymExport, // found in a Mach-O image
+		DlsymNative, // translateSymbol() and the native library loop
+		DlsymMiss, // not found at all
+		LazyBind, // stubs bound by dyld_stub_binder
+		CounterCount
+	};
+
+	static void count(Counter c)
+	{
+		s_counters[c].count.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	static void record(Counter c, uint64_t ns);
+
+	// Records the lifetime of the object
+	class Timer
+	{
+	public:
+		Timer(Counter c) : m_counter(c), m_start(now()) {}
+		~Timer() { record(m_counter, now() - m_start); }
+	private:
+		Counter m_counter;
+		uint64_t m_start;
+	};
+
+	static int get(struct dyld_statistics_counter* counters, uint32_t* count);
+	static void print(FILE* out);
+
+private:
+	static uint64_t now()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+	}
+
+	struct Data
+	{
+		std::atomic<uint64_t> count, totalNs;
+		std::atomic<uint64_t> histogram[DYLD_STATISTICS_BUCKETS];
+	};
+
+	static Data s_counters[CounterCount];
+	static const char* s_names[CounterCount];
+};
+
+#endif
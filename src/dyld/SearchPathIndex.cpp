@@ -0,0 +1,73 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "SearchPathIndex.h"
+#include "log.h"
+#include <sys/types.h>
+#include <dirent.h>
+#include <cerrno>
+#include <cstring>
+
+SearchPathIndex::~SearchPathIndex()
+{
+	for (auto& pair : m_dirs)
+		delete pair.second;
+}
+
+const SearchPathIndex::Directory* SearchPathIndex::readDirectory(const std::string& dir)
+{
+	auto it = m_dirs.find(dir);
+	if (it != m_dirs.end())
+		return it->second;
+
+	Directory* entries = nullptr;
+
+	if (DIR* d = ::opendir(dir.c_str()))
+	{
+		entries = new Directory;
+
+		while (struct dirent* ent = ::readdir(d))
+			entries->insert(ent->d_name);
+
+		::closedir(d);
+		LOG << "Indexed " << entries->size() << " entries of " << dir << std::endl;
+	}
+	else if (errno == ENOENT || errno == ENOTDIR)
+		entries = new Directory; // nothing can be found there
+	else
+		LOG << "Cannot list " << dir << ", its entries will be probed: " << strerror(errno) << std::endl;
+
+	m_dirs[dir] = entries;
+	return entries;
+}
+
+SearchPathIndex::Presence SearchPathIndex::find(const std::string& path)
+{
+	size_t slash = path.rfind('/');
+	const Directory* dir;
+
+	if (slash == std::string::npos)
+		dir = readDirectory(".");
+	else
+		dir = readDirectory(slash ? path.substr(0, slash) : "/");
+
+	if (!dir)
+		return Unknown;
+	return dir->count(path.substr(slash + 1)) ? Present : Absent;
+}
@@ -0,0 +1,55 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SEARCHPATHINDEX_H
+#define SEARCHPATHINDEX_H
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+// Contents of the library search directories, so that looking for a library
+// doesn't need an access() call for every directory in the search path.
+// Every directory is read once, when it's first needed, and the results are kept for the life of the process.
+// Not thread safe, used under the dlopen() lock.
+class SearchPathIndex
+{
+public:
+	~SearchPathIndex();
+
+	enum Presence { Absent, Present, Unknown };
+
+	// Whether the path names an existing directory entry (which may still be unreadable).
+	// Absent if the directory doesn't exist. Unknown if it exists but cannot be listed (e.g. execute-only),
+	// the path has to be probed then.
+	Presence find(const std::string& path);
+
+	// Names that weren't found in any of the search directories
+	bool isMissing(const std::string& name) const { return m_missing.count(name) != 0; }
+	void addMissing(const std::string& name) { m_missing.insert(name); }
+
+private:
+	typedef std::unordered_set<std::string> Directory;
+
+	const Directory* readDirectory(const std::string& dir);
+
+	std::unordered_map<std::string, Directory*> m_dirs; // null for directories that cannot be read
+	std::unordered_set<std::string> m_missing;
+};
+
+#endif
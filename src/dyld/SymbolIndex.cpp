@@ -0,0 +1,233 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "SymbolIndex.h"
+#include "StringPool.h"
+#include "log.h"
+#include "fnv.h"
+#include <cstdlib>
+#include <cassert>
+
+#define EXPORT_SYMBOL_FLAGS_WEAK_DEFINITION 0x04
+
+static char g_unresolved;
+void* const SymbolIndex::Unresolved = &g_unresolved;
+std::atomic<unsigned long> SymbolIndex::s_nativeGeneration(1);
+
+SymbolIndex::SymbolIndex()
+	: m_entries(1024), m_nextOrder(0), m_misses(0)
+{
+	ImageList* list = new ImageList;
+
+	list->generation = 0;
+	m_images = list;
+}
+
+SymbolIndex::~SymbolIndex()
+{
+	delete m_images.load();
+
+	for (ImageList* list : m_retiredImages)
+		delete list;
+	m_entries.forEach([](Entry* e) { delete e; });
+}
+
+SymbolIndex::Entry* SymbolIndex::newEntry(const char* name)
+{
+	Entry* e = new Entry;
+
+	e->name = name;
+	e->seq = 0;
+	e->exportGeneration = ~0ul;
+	e->exp = nullptr;
+	e->strongExp = nullptr;
+	e->native = nullptr;
+
+	return e;
+}
+
+SymbolIndex::Entry* SymbolIndex::findEntry(const char* name, size_t hash) const
+{
+	return m_entries.find(hash, [name](const Entry* e) { return strcmp(e->name, name) == 0; });
+}
+
+void SymbolIndex::registerImage(const Exports* exports)
+{
+	Darling::MutexLock l(m_writeMutex);
+	unsigned order = m_nextOrder++;
+
+	m_order[exports] = order;
+}
+
+void SymbolIndex::publishImages(ImageList* list)
+{
+	ImageList* old = m_images.load(std::memory_order_relaxed);
+
+	list->generation = old->generation + 1;
+	for (auto& pair : m_ready)
+		list->images.push_back(pair.second);
+
+	m_images.store(list, std::memory_order_release);
+	m_retiredImages.push_back(old);
+}
+
+void SymbolIndex::addExports(const Exports* exports)
+{
+	Darling::MutexLock l(m_writeMutex);
+
+	auto it = m_order.find(exports);
+	assert(it != m_order.end());
+
+	// Images may finish loading out of order (dependencies first), so the load order decides
+	m_ready[it->second] = exports;
+	publishImages(new ImageList);
+}
+
+void SymbolIndex::removeExports(const Exports* exports)
+{
+	Darling::MutexLock l(m_writeMutex);
+
+	auto it = m_order.find(exports);
+	if (it == m_order.end())
+		return;
+
+	m_ready.erase(it->second);
+	m_order.erase(it);
+
+	// Cached entries notice the new generation and resolve again
+	publishImages(new ImageList);
+}
+
+void SymbolIndex::resolveExports(const ImageList* list, const char* name, const MachO::Export** exp, const MachO::Export** strongExp)
+{
+	char underscored[512];
+	bool haveUnderscored = strlen(name) + 2 <= sizeof(underscored);
+
+	*exp = *strongExp = nullptr;
+
+	// Darwin symbol names carry an extra underscore, callers of dlsym() don't use it
+	if (haveUnderscored)
+	{
+		underscored[0] = '_';
+		strcpy(underscored + 1, name);
+	}
+
+	for (const Exports* exports : list->images)
+	{
+		// An exact match ("foo") wins over an underscored one ("_foo") within the same image
+		for (int i = 0; i < 2 && !(*exp && *strongExp); i++)
+		{
+			const MachO::Export* found;
+
+			if (i == 0)
+				found = exports->find(name);
+			else if (haveUnderscored)
+				found = exports->find(underscored);
+			else
+				break;
+
+			if (!found)
+				continue;
+			if (!*exp)
+				*exp = found;
+			if (!*strongExp && !(found->flag & EXPORT_SYMBOL_FLAGS_WEAK_DEFINITION))
+				*strongExp = found;
+		}
+
+		if (*exp && *strongExp)
+			break;
+	}
+}
+
+void SymbolIndex::lookupExports(Entry& e, const MachO::Export** exp, const MachO::Export** strongExp) const
+{
+	const ImageList* list = m_images.load(std::memory_order_acquire);
+	unsigned seq = e.seq.load(std::memory_order_acquire);
+
+	if (!(seq & 1) && e.exportGeneration.load(std::memory_order_relaxed) == list->generation)
+	{
+		*exp = e.exp.load(std::memory_order_relaxed);
+		*strongExp = e.strongExp.load(std::memory_order_relaxed);
+
+		// Make sure nobody has changed the entry while we were reading it
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (e.seq.load(std::memory_order_relaxed) == seq)
+			return;
+	}
+
+	resolveExports(list, e.name, exp, strongExp);
+
+	// Store the result unless another thread is doing the same right now
+	if (!(seq & 1) && e.seq.compare_exchange_strong(seq, seq + 1, std::memory_order_relaxed))
+	{
+		std::atomic_thread_fence(std::memory_order_release);
+		e.exp.store(*exp, std::memory_order_relaxed);
+		e.strongExp.store(*strongExp, std::memory_order_relaxed);
+		e.exportGeneration.store(list->generation, std::memory_order_relaxed);
+		e.seq.store(seq + 2, std::memory_order_release);
+	}
+}
+
+unsigned long SymbolIndex::resolve(const char* name, const MachO::Export** exp, const MachO::Export** strongExp) const
+{
+	const ImageList* list = m_images.load(std::memory_order_acquire);
+
+	resolveExports(list, name, exp, strongExp);
+	return list->generation;
+}
+
+SymbolIndex::Entry* SymbolIndex::find(const char* name) const
+{
+	return findEntry(name, Darling::fnv1a32(name));
+}
+
+SymbolIndex::Entry& SymbolIndex::findOrInsert(const char* name)
+{
+	size_t hash = Darling::fnv1a32(name);
+
+	if (Entry* e = findEntry(name, hash))
+		return *e;
+
+	Darling::MutexLock l(m_writeMutex);
+
+	if (Entry* e = findEntry(name, hash))
+		return *e; // someone else was faster
+
+	Entry* e = newEntry(StringPool::intern(name));
+	m_entries.insert(hash, e);
+
+	return *e;
+}
+
+void SymbolIndex::insertMiss(const char* name, unsigned long exportGeneration, unsigned long nativeGeneration, unsigned long hooksGeneration)
+{
+	size_t hash = Darling::fnv1a32(name);
+	Darling::MutexLock l(m_writeMutex);
+
+	if (m_misses >= MaxMisses || findEntry(name, hash))
+		return;
+
+	// exp and strongExp stay nullptr, a lookup in a newer generation resolves again
+	Entry* e = newEntry(StringPool::intern(name));
+	e->exportGeneration = exportGeneration;
+	e->native = new NativeResult { nativeGeneration, hooksGeneration, nullptr, nullptr };
+
+	m_entries.insert(hash, e);
+	m_misses++;
+}
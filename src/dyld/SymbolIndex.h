@@ -0,0 +1,139 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMBOLINDEX_H
+#define SYMBOLINDEX_H
+#include <stdint.h>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <atomic>
+#include "MachO.h"
+#include "ld.h"
+#include "mutex.h"
+#include "AtomicHashSet.h"
+
+// Process-wide cache of symbol lookups in all loaded Mach-O images.
+// Used by __darwin_dlsym(RTLD_DEFAULT) so that a repeated lookup costs a single hash probe
+// instead of probing the export trie of every loaded image.
+//
+// Entries are filled in on demand and remember the image list generation they were resolved for.
+// Loading or unloading an image bumps the generation, which makes stale entries resolve again.
+//
+// Lookups take no locks. The image list is published through an atomic pointer and replaced as a whole
+// when it changes; the old versions are kept around, as readers may still be using them.
+// Modifications are serialized by an internal mutex.
+class SymbolIndex
+{
+public:
+	SymbolIndex();
+	~SymbolIndex();
+
+	// Replaced as a whole (with a compare-and-swap against the version the result was computed from),
+	// so that a thread that started before a generation change cannot store a stale result.
+	// Never freed, like the TranslationCache results.
+	struct NativeResult
+	{
+		unsigned long nativeGeneration; // currentNativeGeneration() before the lookups
+		unsigned long hooksGeneration; // dlsym hook list generation fallback was translated with
+		void* native; // __darwin_ prefixed native symbol, takes precedence over Mach-O exports
+		void* fallback; // native symbol found after name translation, or Unresolved
+	};
+
+	struct Entry
+	{
+		const char* name; // interned in StringPool
+
+		// Mach-O definitions, valid while exportGeneration matches the image list.
+		// Odd seq means that somebody is updating them right now.
+		std::atomic<unsigned> seq;
+		std::atomic<unsigned long> exportGeneration;
+		std::atomic<const MachO::Export*> exp; // first definition in image load order
+		std::atomic<const MachO::Export*> strongExp; // first definition that isn't weak (for __DARLING_RTLD_STRONG)
+
+		// Cached native resolution, nullptr until the first lookup
+		std::atomic<const NativeResult*> native;
+	};
+
+	static void* const Unresolved;
+
+	// Must be called when the image starts loading, assigns the image a position in the load order
+	void registerImage(const Exports* exports);
+
+	// Makes the symbols of an already registered image visible
+	void addExports(const Exports* exports);
+
+	// Removes an image from the index.
+	// The Exports must stay allocated, lookups running in parallel may still reference them.
+	void removeExports(const Exports* exports);
+
+	// Symbol name without the leading underscore.
+	// Entries are never removed, so only names that have resolved to something should be inserted.
+	Entry* find(const char* name) const;
+	Entry& findOrInsert(const char* name);
+
+	// Remembers that a name has resolved to nothing, with the generations of the failed lookups.
+	// Only the first MaxMisses such names get an entry, so that probing for missing symbols
+	// (NSClassFromString(), plugins) can't grow the index forever.
+	void insertMiss(const char* name, unsigned long exportGeneration, unsigned long nativeGeneration, unsigned long hooksGeneration);
+
+	// Finds the Mach-O definitions of the entry's symbol, consulting the images only if the entry is stale
+	void lookupExports(Entry& e, const MachO::Export** exp, const MachO::Export** strongExp) const;
+
+	// Same for a name that has no entry, nothing is cached. Returns the image list generation it has used.
+	unsigned long resolve(const char* name, const MachO::Export** exp, const MachO::Export** strongExp) const;
+
+	// Changes whenever dyld loads or unloads a native (ELF) library.
+	// Libraries that native code dlopen()s behind our back are only noticed with the next change.
+	static unsigned long currentNativeGeneration() { return s_nativeGeneration.load(std::memory_order_acquire); }
+	static void nativeLibrariesChanged() { s_nativeGeneration.fetch_add(1, std::memory_order_acq_rel); }
+
+private:
+	static const unsigned MaxMisses = 4096;
+
+	// Images in load order
+	struct ImageList
+	{
+		unsigned long generation;
+		std::vector<const Exports*> images;
+	};
+
+	static Entry* newEntry(const char* name);
+	static void resolveExports(const ImageList* list, const char* name, const MachO::Export** exp, const MachO::Export** strongExp);
+
+	Entry* findEntry(const char* name, size_t hash) const;
+	void publishImages(ImageList* list);
+
+	Darling::AtomicHashSet<Entry> m_entries;
+
+	std::atomic<ImageList*> m_images;
+	std::vector<ImageList*> m_retiredImages;
+
+	std::map<const Exports*, unsigned> m_order; // for all registered images
+	std::map<unsigned, const Exports*> m_ready; // images whose symbols are visible
+	unsigned m_nextOrder;
+	unsigned m_misses;
+
+	Darling::Mutex m_writeMutex;
+
+	static std::atomic<unsigned long> s_nativeGeneration;
+};
+
+#endif
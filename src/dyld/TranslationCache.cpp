@@ -0,0 +1,84 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "TranslationCache.h"
+#include "StringPool.h"
+
+TranslationCache::TranslationCache()
+	: m_entries(256)
+{
+}
+
+TranslationCache::Entry* TranslationCache::findEntry(const char* interned) const
+{
+	return m_entries.find(StringPool::hashInterned(interned), [interned](const Entry* e) { return e->name == interned; });
+}
+
+const char* TranslationCache::find(const char* name, unsigned long generation) const
+{
+	const char* interned = StringPool::find(name);
+	const Entry* e;
+	const Result* r;
+
+	// A name that has never been interned cannot have been translated
+	if (!interned || !(e = findEntry(interned)))
+		return nullptr;
+
+	r = e->result.load(std::memory_order_acquire);
+	if (r->generation != generation)
+		return nullptr;
+
+	return r->translated;
+}
+
+const char* TranslationCache::insert(const char* name, const char* translated, unsigned long generation)
+{
+	Darling::MutexLock l(m_writeMutex);
+	const char* interned = StringPool::intern(name);
+	Entry* e = findEntry(interned);
+	bool isNew = !e;
+	Result* r;
+
+	if (e)
+	{
+		const Result* old = e->result.load(std::memory_order_relaxed);
+
+		// A thread that started before the hook list changed must not replace a newer result
+		if (old->generation >= generation)
+			return old->translated;
+	}
+	else
+	{
+		e = new Entry;
+		e->name = interned;
+		e->result.store(nullptr, std::memory_order_relaxed);
+	}
+
+	r = new Result;
+	r->translated = StringPool::intern(translated);
+	r->generation = generation;
+
+	e->result.store(r, std::memory_order_release);
+
+	// Published only once the entry has a result
+	if (isNew)
+		m_entries.insert(StringPool::hashInterned(interned), e);
+
+	return r->translated;
+}
@@ -0,0 +1,65 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRANSLATIONCACHE_H
+#define TRANSLATIONCACHE_H
+#include <stdint.h>
+#include <atomic>
+#include "mutex.h"
+#include "AtomicHashSet.h"
+
+// Memoized Darwin -> native symbol name translations, keyed by the original name.
+//
+// Results remember the dlsym hook list generation they were computed with and are recomputed
+// once a hook is registered or removed, so that hooks can override the libSystem name map too.
+//
+// Lookups take no locks. Both names are interned in StringPool and entries and results are never freed,
+// so returned names stay valid forever.
+class TranslationCache
+{
+public:
+	TranslationCache();
+
+	// Returns nullptr if the name hasn't been translated in this generation yet
+	const char* find(const char* name, unsigned long generation) const;
+
+	// Remembers a translation, returns a stable copy of it
+	const char* insert(const char* name, const char* translated, unsigned long generation);
+
+private:
+	// Replaced as a whole, so that the name and the generation always match
+	struct Result
+	{
+		const char* translated;
+		unsigned long generation;
+	};
+
+	struct Entry
+	{
+		const char* name; // interned
+		std::atomic<const Result*> result;
+	};
+
+	Entry* findEntry(const char* interned) const;
+
+	Darling::AtomicHashSet<Entry> m_entries;
+	Darling::Mutex m_writeMutex;
+};
+
+#endif
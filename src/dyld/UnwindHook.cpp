@@ -0,0 +1,77 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "UnwindHook.h"
+#include "FileMap.h"
+#include "eh/EHSection.h"
+#include "CompactUnwind.h"
+#include <dlfcn.h>
+
+extern FileMap g_file_map;
+
+// From libgcc's unwind-dw2-fde.h
+struct dwarf_eh_bases
+{
+	void* tbase;
+	void* dbase;
+	void* func;
+};
+
+typedef const void* (*FindFDE)(void* pc, struct dwarf_eh_bases* bases);
+
+extern "C" const void* _Unwind_Find_FDE(void* pc, struct dwarf_eh_bases* bases)
+{
+	static FindFDE libgccFindFDE = (FindFDE) dlsym(RTLD_NEXT, "_Unwind_Find_FDE");
+	const FileMap::ImageMap* map = g_file_map.imageMapForAddr(pc);
+
+	if (map)
+	{
+		const void* table = map->eh_frame_hdr.load(std::memory_order_acquire);
+		uintptr_t start;
+
+		// Functions described by __unwind_info have no FDE, unless their encoding says to use DWARF
+		const void* fde = CompactUnwind::findFDE(map, reinterpret_cast<uintptr_t>(pc), &start);
+
+		if (!fde && table)
+			fde = EHSection::findFDE(table, reinterpret_cast<uintptr_t>(pc), &start);
+
+		if (fde)
+		{
+			// Our FDEs only use absolute and pc relative pointers
+			bases->tbase = nullptr;
+			bases->dbase = nullptr;
+			bases->func = reinterpret_cast<void*>(start);
+			return fde;
+		}
+
+		// Images without a table have registered their __eh_frame with libgcc
+		if (table)
+			return nullptr;
+	}
+
+	if (!libgccFindFDE)
+		return nullptr;
+	return libgccFindFDE(pc, bases);
+}
+
+bool UnwindHook::active()
+{
+	static bool active = dlsym(RTLD_DEFAULT, "_Unwind_Find_FDE") == reinterpret_cast<void*>(_Unwind_Find_FDE);
+	return active;
+}
@@ -0,0 +1,36 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef UNWINDHOOK_H
+#define UNWINDHOOK_H
+
+// dyld defines its own _Unwind_Find_FDE(), which libgcc calls through its PLT.
+//
+// Frames inside Mach-O images are described by their __unwind_info (see CompactUnwind)
+// or found with a binary search in the table EHSection::store() builds next to the reworked __eh_frame,
+// without taking libgcc's global lock and without libgcc having to classify and sort the FDEs
+// of every registered object on the first throw. All other addresses are passed on to libgcc.
+class UnwindHook
+{
+public:
+	// Whether libgcc's lookups end up in our _Unwind_Find_FDE(), otherwise frames need __register_frame()
+	static bool active();
+};
+
+#endif
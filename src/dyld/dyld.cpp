@@ -36,12 +36,22 @@ along with Darling.  If not, see <http://www.gnu.org/licenses/>.
 #include <libgen.h>
 #include "dyld.h"
 #include "ld.h"
+#include "LaunchTimeline.h"
+#include "ResolverStats.h"
+#include "LazyBindProfile.h"
 
 char g_darwin_executable_path[4096] = "";
 char g_dyld_path[4096] = "";
 char g_sysroot[4096] = "";
 bool g_trampoline = false;
 bool g_noWeak = false;
+bool g_forceFlat = false;
+bool g_noSymbolIndex = false;
+const char* g_prebindCacheDir = nullptr;
+bool g_printStatistics = false;
+bool g_lazyFixups = false;
+LaunchTimeline* g_launchTimeline = nullptr;
+LazyBindProfile* g_lazyBindProfile = nullptr;
 
 MachO* g_mainBinary = 0;
 MachOLoader* g_loader = 0;
@@ -51,6 +61,8 @@ char** g_argv;
 static void autoSysrootSearch();
 static void setupExecutablePath(const char* relativePath);
 static void setupDyldPath(const char* relativePath);
+static void printStatistics();
+static void finishLazyBindProfile();
 
 int main(int argc, char** argv, char** envp)
 {
@@ -69,7 +81,15 @@ int main(int argc, char** argv, char** envp)
 			"\tDYLD_TRAMPOLINE=1 - access all bound functions via a debug trampoline\n"
 #endif
 			"\tDYLD_ROOT_PATH=<path> - set the base for library path resolution (overrides autodetection)\n"
-			"\tDYLD_BIND_AT_LAUNCH=1 - force dyld to bind all lazy references on startup\n";
+			"\tDYLD_BIND_AT_LAUNCH=1 - force dyld to bind all lazy references on startup\n"
+			"\tDYLD_NO_SYMBOL_INDEX=1 - search all images one by one in dlsym() (for benchmarking)\n"
+			"\tDYLD_FORCE_FLAT_NAMESPACE=1 - ignore the library ordinals of two-level namespace binds\n"
+			"\tDYLD_PREBIND_CACHE=<dir> - keep fixed up images in the given directory to speed up subsequent launches\n"
+			"\tDYLD_LAZY_FIXUPS=1 - rebase and bind writable pages on their first access (needs userfaultfd)\n"
+			"\tDYLD_BIND_PROFILE=<dir> - bind the lazy stubs used by previous runs eagerly, on a background thread\n"
+			"\tDYLD_CLOSURE_DIR=<dir> - keep library search results in the given directory to speed up subsequent launches\n"
+			"\tDYLD_PRINT_STATISTICS=1 - print launch statistics, including the time spent in each image\n"
+			"\tDYLD_TRACE_FILE=<path> - write a Chrome trace of the launch phases of each image\n";
 		return 1;
 	}
 
@@ -103,8 +123,36 @@ int main(int argc, char** argv, char** envp)
 			g_trampoline = true;
 		if (getenv("DYLD_NO_WEAK"))
 			g_noWeak = true;
+		if (getenv("DYLD_FORCE_FLAT_NAMESPACE") && atoi(getenv("DYLD_FORCE_FLAT_NAMESPACE")))
+			g_forceFlat = true;
+		if (getenv("DYLD_NO_SYMBOL_INDEX") && atoi(getenv("DYLD_NO_SYMBOL_INDEX")))
+			g_noSymbolIndex = true;
+		if (getenv("DYLD_PREBIND_CACHE") && *getenv("DYLD_PREBIND_CACHE"))
+			g_prebindCacheDir = getenv("DYLD_PREBIND_CACHE");
+		if (getenv("DYLD_LAZY_FIXUPS") && atoi(getenv("DYLD_LAZY_FIXUPS")))
+			g_lazyFixups = true;
+		if (getenv("DYLD_PRINT_STATISTICS") && atoi(getenv("DYLD_PRINT_STATISTICS")))
+		{
+			g_printStatistics = true;
+			atexit(printStatistics);
+		}
+		if (g_printStatistics || (getenv("DYLD_TRACE_FILE") && *getenv("DYLD_TRACE_FILE")))
+		{
+			const char* traceFile = getenv("DYLD_TRACE_FILE");
+			g_launchTimeline = new LaunchTimeline(traceFile && *traceFile ? traceFile : nullptr);
+		}
+		if (getenv("DYLD_CLOSURE_DIR") && *getenv("DYLD_CLOSURE_DIR"))
+			initLaunchClosure(getenv("DYLD_CLOSURE_DIR"), argv[1]);
+		if (getenv("DYLD_BIND_PROFILE") && *getenv("DYLD_BIND_PROFILE"))
+		{
+			g_lazyBindProfile = new LazyBindProfile(getenv("DYLD_BIND_PROFILE"), argv[1]);
+			atexit(finishLazyBindProfile);
+		}
 
-		g_mainBinary = MachO::readFile(argv[1], ARCH_NAME);
+		{
+			LaunchTimeline::Span span(LaunchTimeline::PhaseParse, g_darwin_executable_path);
+			g_mainBinary = MachO::readFile(argv[1], ARCH_NAME, false, false);
+		}
 		
 		if (!g_mainBinary)
 			throw std::runtime_error("Cannot open binary file");
@@ -178,6 +226,18 @@ int main(int argc, char** argv, char** envp)
 	}
 }
 
+void printStatistics()
+{
+	if (g_loader)
+		g_loader->printStatistics(std::cerr);
+	ResolverStats::print(stderr);
+}
+
+void finishLazyBindProfile()
+{
+	g_lazyBindProfile->finish(g_printStatistics);
+}
+
 extern "C" const char* dyld_getDarwinExecutablePath()
 {
 	return g_darwin_executable_path;
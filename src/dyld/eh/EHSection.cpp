@@ -24,6 +24,7 @@ along with Darling.  If not, see <http://www.gnu.org/licenses/>.
 #include <limits>
 #include <memory>
 #include <cstring>
+#include <algorithm>
 #include "log.h"
 #include "CFIWalker.h"
 
@@ -202,15 +203,50 @@ void EHSection::loadFDE(BufReader& reader, uint64_t endPos, CIE* cie)
 	cie->fdes.push_back(fde);
 }
 
-void EHSection::store(void** mem, uintptr_t* length)
+// .eh_frame_hdr encodings used by the search table
+#define EH_HDR_VERSION 1
+#define EH_HDR_FRAME_PTR_ENC 0x00 // DW_EH_PE_absptr
+#define EH_HDR_COUNT_ENC 0x03 // DW_EH_PE_udata4
+#define EH_HDR_TABLE_ENC 0x3b // DW_EH_PE_datarel|DW_EH_PE_sdata4
+#define EH_HDR_TABLE_ENC_WIDE 0x3c // DW_EH_PE_datarel|DW_EH_PE_sdata8, when the image is too far from the table
+
+// Function start of an FDE that has just been written
+static bool fdeStartAddress(DwarfPointer ptr, uintptr_t* addr)
+{
+	switch (ptr.encoding & 0x70)
+	{
+		case 0: // DW_EH_PE_absptr
+			*addr = uintptr_t(ptr.getSigned());
+			return true;
+		case 0x10: // DW_EH_PE_pcrel
+			*addr = ptr.originalLocation + uintptr_t(ptr.getSigned());
+			return true;
+		default:
+			return false;
+	}
+}
+
+void EHSection::store(void** mem, uintptr_t* length, const void** searchTable)
 {
 	uintptr_t originalLength = m_originalEnd - m_originalStart;
 	uintptr_t newLength;
+	std::vector<std::pair<uintptr_t,uintptr_t> > entries;
+	bool tableValid = searchTable != nullptr;
 	
 	// We're being pessimistic here, but we cannot use a resizable buffer,
 	// since a possible move doing realloc() would invalidate the relative pointers
 	newLength = originalLength * 2;
 	
+	if (searchTable != nullptr)
+	{
+		size_t count = 0;
+		for (CIE* cie : m_cies)
+			count += cie->fdes.size();
+		
+		entries.reserve(count);
+		newLength += 3*sizeof(uint64_t) + count * 2*sizeof(uint64_t); // header, alignment, widest entries
+	}
+	
 	*mem = new char[newLength];
 	
 	BufWriter writer (*mem, newLength);
@@ -223,7 +259,16 @@ void EHSection::store(void** mem, uintptr_t* length)
 		
 		// Write all the FDEs contained
 		for (FDE* fde : cie->fdes)
+		{
+			uintptr_t fdeStart = writer.pos(), start;
+			
 			storeFDE(writer, fde, cie, cieStart);
+			
+			if (tableValid && fdeStartAddress(fde->startAddress, &start))
+				entries.push_back(std::make_pair(start, fdeStart));
+			else
+				tableValid = false;
+		}
 	}
 	
 	// terminating entry
@@ -231,6 +276,183 @@ void EHSection::store(void** mem, uintptr_t* length)
 	
 	if (length != nullptr)
 		*length = writer.pos() - reinterpret_cast<uintptr_t>(*mem);
+	
+	if (searchTable != nullptr)
+	{
+		if (tableValid)
+		{
+			writer.moveTo((writer.pos() + sizeof(uint64_t) - 1) & ~uintptr_t(sizeof(uint64_t) - 1));
+			*searchTable = writer.posPtr();
+			storeSearchTable(writer, reinterpret_cast<uintptr_t>(*mem), entries);
+		}
+		else
+		{
+			LOG << "Cannot build a search table for this __eh_frame\n";
+			*searchTable = nullptr;
+		}
+	}
+}
+
+void EHSection::storeSearchTable(BufWriter& writer, uintptr_t ehFrame, std::vector<std::pair<uintptr_t,uintptr_t> >& entries)
+{
+	uintptr_t base = writer.pos();
+	bool wide = false;
+	
+	std::sort(entries.begin(), entries.end());
+	
+	for (const auto& e : entries)
+	{
+		intptr_t delta = intptr_t(e.first - base);
+		if (delta != intptr_t(int32_t(delta)))
+			wide = true;
+	}
+	
+	writer.write(EH_HDR_VERSION);
+	writer.write(EH_HDR_FRAME_PTR_ENC);
+	writer.write(EH_HDR_COUNT_ENC);
+	writer.write(wide ? EH_HDR_TABLE_ENC_WIDE : EH_HDR_TABLE_ENC);
+	writer.writePtr(ehFrame);
+	writer.write32(uint32_t(entries.size()));
+	
+	for (const auto& e : entries)
+	{
+		if (wide)
+		{
+			writer.write64S(int64_t(e.first - base));
+			writer.write64S(int64_t(e.second - base));
+		}
+		else
+		{
+			writer.write32S(int32_t(e.first - base));
+			writer.write32S(int32_t(e.second - base));
+		}
+	}
+	
+	LOG << "Built a search table for " << entries.size() << " FDEs\n";
+}
+
+// Pointer encoding of the FDEs belonging to the CIE the reader is positioned at (after the id)
+uint8_t EHSection::fdePointerEncoding(BufReader& reader)
+{
+	uint8_t version = reader.read();
+	const char* augmentationString = reader.readString();
+	
+	if (*augmentationString != 'z')
+		return 0; // DW_EH_PE_absptr
+	
+	reader.readULEB128(); // code alignment
+	reader.readLEB128(); // data alignment
+	
+	if (version == 1)
+		reader.read();
+	else
+		reader.readULEB128();
+	
+	reader.readULEB128(); // augmentation data length
+	
+	for (const char* augP = augmentationString+1; *augP; augP++)
+	{
+		switch (*augP)
+		{
+			case 'R':
+				return reader.read();
+			case 'L':
+				reader.read();
+				break;
+			case 'P':
+				reader.readDwarfPointer(reader.read());
+				break;
+			case 'S':
+				break;
+			default:
+				return 0xff;
+		}
+	}
+	
+	return 0;
+}
+
+const void* EHSection::findFDE(const void* searchTable, uintptr_t pc, uintptr_t* funcStart)
+{
+	const char* hdr = static_cast<const char*>(searchTable);
+	const bool wide = uint8_t(hdr[3]) == EH_HDR_TABLE_ENC_WIDE;
+	const size_t entrySize = wide ? 2*sizeof(int64_t) : 2*sizeof(int32_t);
+	const char* table = hdr + 4 + sizeof(uintptr_t) + sizeof(uint32_t);
+	uintptr_t ehFrame;
+	uint32_t count;
+	size_t lo = 0, n;
+	
+	memcpy(&ehFrame, hdr + 4, sizeof(ehFrame));
+	memcpy(&count, hdr + 4 + sizeof(uintptr_t), sizeof(count));
+	
+	auto entry = [=](size_t index, int field) -> uintptr_t
+	{
+		const char* p = table + index*entrySize + field*(entrySize/2);
+		if (wide)
+		{
+			int64_t v;
+			memcpy(&v, p, sizeof(v));
+			return uintptr_t(hdr + v);
+		}
+		else
+		{
+			int32_t v;
+			memcpy(&v, p, sizeof(v));
+			return uintptr_t(hdr + v);
+		}
+	};
+	
+	if (!count || pc < entry(0, 0))
+		return nullptr;
+	
+	// The last entry starting at or below pc
+	for (n = count; n > 1; )
+	{
+		size_t half = n / 2;
+		if (entry(lo + half, 0) <= pc)
+			lo += half;
+		n -= half;
+	}
+	
+	const uintptr_t start = entry(lo, 0);
+	const uintptr_t fde = entry(lo, 1);
+	
+	try
+	{
+		BufReader reader(reinterpret_cast<const void*>(fde), uintptr_t(hdr) - fde);
+		uint64_t fdeLength = reader.read32();
+		uintptr_t idPos;
+		uint8_t encoding;
+		
+		if (fdeLength == 0xffffffff)
+			reader.read64();
+		
+		idPos = reader.pos();
+		reader.moveTo(idPos - reader.read32S());
+		
+		if (reader.read32() == 0xffffffff)
+			reader.read64();
+		reader.read32(); // CIE id
+		
+		encoding = fdePointerEncoding(reader);
+		if (encoding == 0xff)
+			return nullptr;
+		
+		// The range has the same size as the start address, but is never relative
+		reader.moveTo(idPos + sizeof(int32_t));
+		reader.readDwarfPointer(encoding);
+		
+		DwarfPointer range = reader.readDwarfPointer(encoding & 0x0f);
+		if (pc - start >= uintptr_t(range.getSigned()))
+			return nullptr; // a gap between functions
+	}
+	catch (const std::exception&)
+	{
+		return nullptr;
+	}
+	
+	*funcStart = start;
+	return reinterpret_cast<const void*>(fde);
 }
 
 void EHSection::storeCIE(BufWriter& writer, CIE* cie)
@@ -36,7 +36,12 @@ public:
 	
 	// Serializes a previously loaded __eh_frame, appends a terminating entry
 	// The returned memory must not be moved
-	void store(void** mem, uintptr_t* length);
+	// If searchTable is given, an .eh_frame_hdr style table sorted by function start is placed after the terminator,
+	// or nullptr is returned there when some FDE doesn't have an absolute (or pc relative) start address
+	void store(void** mem, uintptr_t* length, const void** searchTable = nullptr);
+	
+	// Binary search in a table created by store(), returns nullptr if no FDE covers pc
+	static const void* findFDE(const void* searchTable, uintptr_t pc, uintptr_t* funcStart);
 	
 	// Frees all the internal structures
 	void clear();
@@ -60,6 +65,10 @@ private:
 	void storeFDE(BufWriter& writer, FDE* fde, CIE* cie, uintptr_t cieStart);
 	
 	static void swapRegisterNumbers(std::vector<uint8_t>& where, const std::map<int, int>& swapList, uint8_t ptrEncoding);
+	
+	// Writes the search table for the given (function start, FDE address) pairs
+	static void storeSearchTable(BufWriter& writer, uintptr_t ehFrame, std::vector<std::pair<uintptr_t,uintptr_t> >& entries);
+	static uint8_t fdePointerEncoding(BufReader& reader);
 private:
 	// Needed for relative pointer adjustments
 	uintptr_t m_originalStart, m_originalEnd;
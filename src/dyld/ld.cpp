@@ -26,11 +26,19 @@ along with Darling.  If not, see <http://www.gnu.org/licenses/>.
 #include "mutex.h"
 #include "trace.h"
 #include "FileMap.h"
+#include "LaunchClosure.h"
+#include "LaunchTimeline.h"
+#include "ResolverStats.h"
+#include "NativeSymbolIndex.h"
+#include "SearchPathIndex.h"
+#include "TranslationCache.h"
+#include "namemap.h" // generated from libSystem's namemap.lst by genfuncmap
 #include "log.h"
 #include "IniConfig.h"
 #include "stlutils.h"
 #include <unistd.h>
 #include <map>
+#include <sstream>
 #include <string>
 #include <cstring>
 #include <sys/types.h>
@@ -44,7 +52,9 @@ along with Darling.  If not, see <http://www.gnu.org/licenses/>.
 #include <execinfo.h>
 #include "dyld.h"
 #include <glob.h>
+#include <atomic>
 
+// Serializes dlopen()/dlclose(), symbol lookups don't take it
 static Darling::Mutex g_ldMutex;
 static std::map<std::string, LoadedLibrary*> g_ldLibraries;
 static __thread char g_ldError[256] = "";
@@ -52,6 +62,7 @@ static regex_t g_reAutoMappable;
 static LoadedLibrary g_dummyLibrary;
 
 static std::list<std::string>g_searchPath;
+static SearchPathIndex g_searchIndex;
 
 /*
 static const char* g_rpathSearch[] = {
@@ -66,14 +77,29 @@ static const char* g_suffixes[] = { "$DARWIN_EXTSN", "$UNIX2003", "$NOCANCEL" };
 static IniConfig* g_iniConfig = 0;
 
 static void* attemptDlopen(const char* filename, int flag);
+static void* loadLibrary(const char* name, int flag);
+static void* searchAndDlopen(const char* filename, int flag, const std::vector<std::string>& rpaths, bool* notFoundError);
 static int translateFlags(int flags);
 //__attribute__((constructor)) static void initLD();
-static std::list<Darling::DlsymHookFunc> g_dlsymHooks;
+
+// Read without locking by __darwin_dlsym(), so these lists are replaced as a whole
+// when modified. Old versions are never freed, a reader may still be iterating them.
+typedef std::vector<Darling::DlsymHookFunc> DlsymHookList;
+typedef std::vector<void*> NativeHandleList;
+static std::atomic<DlsymHookList*> g_dlsymHooks(new DlsymHookList);
+static std::atomic<NativeHandleList*> g_nativeHandles(new NativeHandleList);
+static std::atomic<unsigned long> g_dlsymHooksGeneration(1); // bumped after g_dlsymHooks changes
+static Darling::Mutex g_dlsymHooksMutex;
+static TranslationCache g_translationCache;
+static NativeSymbolIndex g_nativeSymbolIndex;
 
 extern MachOLoader* g_loader;
 extern char g_darwin_executable_path[PATH_MAX];
 extern char g_sysroot[PATH_MAX];
 extern FileMap g_file_map;
+extern bool g_noSymbolIndex;
+
+LaunchClosure* g_launchClosure = nullptr;
 
 #define RET_IF(x) { if (void* p = x) return p; }
 
@@ -148,6 +174,50 @@ void initLD()
 	findSearchpathsWildcard(LD_SO_CONFIG);
 }
 
+void initLaunchClosure(const char* dir, const char* executable)
+{
+	std::stringstream config;
+	struct stat st;
+
+	// Everything the search results depend on, apart from the libraries themselves
+	for (const std::string& path : g_searchPath)
+		config << path << ':';
+	if (const char* ldp = getenv("DYLD_LIBRARY_PATH"))
+		config << "\nDYLD_LIBRARY_PATH=" << ldp;
+	config << "\n@executable_path=" << g_darwin_executable_path;
+	if (::stat(ETC_DARLING_PATH "/dylib.conf", &st) == 0)
+		config << "\ndylib.conf=" << st.st_ino << '.' << st.st_size << '.' << st.st_mtime;
+
+	g_launchClosure = new LaunchClosure(dir, executable, config.str());
+}
+
+// access() used while searching for a library
+static int probeAccess(const char* path, int mode)
+{
+	if (g_launchClosure)
+		g_launchClosure->countProbe();
+	return ::access(path, mode);
+}
+
+// Library search results also depend on the loader path and the rpaths
+static std::string searchContext(const char* filename, const std::vector<std::string>& rpaths)
+{
+	std::string context;
+
+	if (strncmp(filename, "@loader_path", 12) == 0)
+		context = g_loader->getCurrentLoader();
+	else if (strncmp(filename, "@rpath", 6) == 0)
+	{
+		for (const std::string& rpath : rpaths)
+		{
+			context += rpath;
+			context += ':';
+		}
+	}
+
+	return context;
+}
+
 static std::string replacePathPrefix(const char* prefix, const char* prefixed, const char* replacement)
 {
 	std::string path = replacement;
@@ -177,6 +247,40 @@ void* Darling::DlopenWithContext(const char* filename, int flag, const std::vect
 	TRACE2(filename, flag);
 	
 	Darling::MutexLock l(g_ldMutex);
+	bool useClosure = filename && g_launchClosure && g_launchClosure->active();
+	std::string context;
+	void* lib;
+
+	if (useClosure)
+	{
+		context = searchContext(filename, rpaths);
+
+		// The path has been resolved during a previous launch and it still points to the same file
+		if (const char* path = g_launchClosure->lookup(filename, context))
+		{
+			g_ldError[0] = 0;
+			if (notFoundError != nullptr)
+				*notFoundError = false;
+
+			lib = loadLibrary(path, translateFlags(flag));
+			if (lib)
+			{
+				g_launchClosure->recordLookup(filename, context, path);
+				return lib;
+			}
+		}
+	}
+
+	lib = searchAndDlopen(filename, flag, rpaths, notFoundError);
+
+	if (lib && useClosure)
+		g_launchClosure->recordLookup(filename, context, static_cast<LoadedLibrary*>(lib)->name.c_str());
+
+	return lib;
+}
+
+static void* searchAndDlopen(const char* filename, int flag, const std::vector<std::string>& rpaths, bool* notFoundError)
+{
 	std::string path;
 	
 	g_ldError[0] = 0;
@@ -196,13 +300,13 @@ void* Darling::DlopenWithContext(const char* filename, int flag, const std::vect
 	{
 		path = replacePathPrefix("@executable_path", filename, g_darwin_executable_path);
 		LOG << "Full path after replacing @executable_path: " << path << std::endl;
-		if (::access(path.c_str(), R_OK) == 0)
+		if (probeAccess(path.c_str(), R_OK) == 0)
 			RET_IF( attemptDlopen(path.c_str(), flag) );
 	}
 	else if (strncmp(filename, "@loader_path", 12) == 0)
 	{
 		path = replacePathPrefix("@loader_path", filename, g_loader->getCurrentLoader().c_str());
-		if (::access(path.c_str(), R_OK) == 0)
+		if (probeAccess(path.c_str(), R_OK) == 0)
 			RET_IF( attemptDlopen(path.c_str(), flag) );
 	}
 	else if (strncmp(filename, "@rpath", 6) == 0)
@@ -217,7 +321,7 @@ void* Darling::DlopenWithContext(const char* filename, int flag, const std::vect
 				std::string rpathSearchExtra = rpathSearch + extraSuffix;
 				path = replacePathPrefix("@rpath", filename, rpathSearchExtra.c_str());
 				
-				RET_IF( DlopenWithContext(path.c_str(), flag, rpaths, &recNotFoundError) );
+				RET_IF( searchAndDlopen(path.c_str(), flag, rpaths, &recNotFoundError) );
 
 				// Stop if there was an error, vs just not found
 				if (!recNotFoundError)
@@ -230,7 +334,7 @@ void* Darling::DlopenWithContext(const char* filename, int flag, const std::vect
 		if (const char* ldp = getenv("DYLD_LIBRARY_PATH"))
 		{
 			path = std::string(ldp) + "/" + filename;
-			if (::access(path.c_str(), R_OK) == 0)
+			if (probeAccess(path.c_str(), R_OK) == 0)
 				RET_IF( attemptDlopen(path.c_str(), flag) );
 		}
 
@@ -248,25 +352,39 @@ void* Darling::DlopenWithContext(const char* filename, int flag, const std::vect
 		if (strncmp(filename, "/usr/lib/", 9) == 0)
 			filename = filename + 9;
 		
-		std::list<std::string>::iterator it;
-		for (it=g_searchPath.begin(); it!=g_searchPath.end(); ++it)
+		// Only names present in the directory listings get probed
+		if (!g_searchIndex.isMissing(filename))
 		{
-			path = *it + "/" + filename;
-			LOG << "Trying " << path << std::endl;
-			if (::access(path.c_str(), R_OK) == 0){
-				RET_IF( attemptDlopen(path.c_str(), flag) );
-			}
-			else{
-				if (::access((path+".so").c_str(), R_OK) == 0)
-                                RET_IF( attemptDlopen(path.c_str(), flag) );
-			
+			bool found = false;
+
+			std::list<std::string>::iterator it;
+			for (it=g_searchPath.begin(); it!=g_searchPath.end(); ++it)
+			{
+				path = *it + "/" + filename;
+				LOG << "Trying " << path << std::endl;
+				// Directories that cannot be listed are probed, and don't prove the name missing
+				SearchPathIndex::Presence plain = g_searchIndex.find(path);
+				if (plain != SearchPathIndex::Absent)
+					found = true;
+
+				if (plain != SearchPathIndex::Absent && probeAccess(path.c_str(), R_OK) == 0){
+					RET_IF( attemptDlopen(path.c_str(), flag) );
+				}
+				else if (g_searchIndex.find(path+".so") != SearchPathIndex::Absent){
+					found = true;
+					if (probeAccess((path+".so").c_str(), R_OK) == 0)
+						RET_IF( attemptDlopen(path.c_str(), flag) );
+				}
 			}
+
+			if (!found)
+				g_searchIndex.addMissing(filename);
 		}
 		
 		// Unlike ld-linux, dyld seems to search in . too
 		if (!strchr(filename, '/'))
 		{
-			if (::access(filename, R_OK) == 0)
+			if (probeAccess(filename, R_OK) == 0)
 				RET_IF( attemptDlopen(filename, flag) );
 		}
 	}
@@ -317,8 +435,10 @@ void* attemptDlopen(const char* filename, int flag)
 	TRACE2(filename,flag);
 	
 	// We need to run access() here not to use realpath for "libncurses.so.5" for example
-	if (::access(filename, R_OK) == 0)
+	if (probeAccess(filename, R_OK) == 0)
 	{
+		if (g_launchClosure)
+			g_launchClosure->countProbe();
 		if (!realpath(filename, name))
 		{
 			strcpy(g_ldError, strerror(errno));
@@ -327,7 +447,13 @@ void* attemptDlopen(const char* filename, int flag)
 	}
 	else
 		strcpy(name, filename);
-	
+
+	return loadLibrary(name, flag);
+}
+
+// Loads a library whose path has already been resolved
+static void* loadLibrary(const char* name, int flag)
+{
 	if (strcmp(name, "/dev/null") == 0)
 	{
 		// We return a dummy
@@ -350,7 +476,7 @@ void* attemptDlopen(const char* filename, int flag)
 	else
 	{
 		// actually load the library
-		char* p = strstr(name, ".so");
+		const char* p = strstr(name, ".so");
 		// we followed a link, so we need to check for .so., too
 		if ((p && name+strlen(name)-p == 3) || strstr(name, ".so.")) // endsWith()
 		{
@@ -370,6 +496,12 @@ void* attemptDlopen(const char* filename, int flag)
 				//lib->slide = lib->base = 0;
 				
 				g_ldLibraries[name] = lib;
+
+				NativeHandleList* handles = new NativeHandleList(*g_nativeHandles.load());
+				handles->push_back(d);
+				g_nativeHandles.store(handles);
+				SymbolIndex::nativeLibrariesChanged();
+
 				return lib;
 			}
 			else
@@ -391,7 +523,12 @@ void* attemptDlopen(const char* filename, int flag)
 			// We're loading a Mach-O library
 			try
 			{
-				MachO* machO = MachO::readFile(name, ARCH_NAME);
+				MachO* machO;
+
+				{
+					LaunchTimeline::Span span(LaunchTimeline::PhaseParse, name);
+					machO = MachO::readFile(name, ARCH_NAME, false, false);
+				}
 				if (!machO)
 				{
 					snprintf(g_ldError, sizeof(g_ldError)-1, "Cannot parse Mach-O library: %s", name);
@@ -457,22 +594,34 @@ int __darwin_dlclose(void* handle)
 	lib->refCount--;
 	
 	if (lib->type == LoadedLibraryNative)
+	{
+		if (!lib->refCount)
+		{
+			// The handle becomes invalid, stop indexing and probing it
+			NativeHandleList* handles = new NativeHandleList(*g_nativeHandles.load());
+			handles->erase(std::remove(handles->begin(), handles->end(), lib->nativeRef), handles->end());
+			g_nativeHandles.store(handles);
+		}
+
 		::dlclose(lib->nativeRef);
+		SymbolIndex::nativeLibrariesChanged();
+	}
 	if (!lib->refCount)
 	{
 		if (lib->type == LoadedLibraryDylib)
 		{
 			// TODO: unmap in g_loader!
-			delete lib->exports;
-			
-			for (std::map<std::string,LoadedLibrary*>::iterator it = g_ldLibraries.begin(); it != g_ldLibraries.end(); it++)
+			// The loader keeps the exports allocated, lookups in other threads may be using them
+			g_loader->unloadExports(lib->exports);
+		}
+
+		for (std::map<std::string,LoadedLibrary*>::iterator it = g_ldLibraries.begin(); it != g_ldLibraries.end(); it++)
+		{
+			if (it->second == lib)
 			{
-				if (it->second == lib)
-				{
-					g_ldLibraries.erase(it);
-					delete lib;
-					break;
-				}
+				g_ldLibraries.erase(it);
+				delete lib;
+				break;
 			}
 		}
 	}
@@ -487,36 +636,46 @@ const char* __darwin_dlerror(void)
 	return g_ldError[0] ? g_ldError : 0;
 }
 
+// Returns a name that stays valid forever, translations are done only once per dlsym hook list
 static const char* translateSymbol(const char* symbol)
 {
+	unsigned long gen = g_dlsymHooksGeneration.load(std::memory_order_acquire);
+	const char* cached = g_translationCache.find(symbol, gen);
 	bool translated = false;
-	static char symbuffer[255];
+	std::string s;
+
+	if (cached)
+		return cached;
 
-	strcpy(symbuffer, symbol);
+	// Hooks may make the name longer
+	std::vector<char> symbuffer(strlen(symbol) + 256);
+	strcpy(&symbuffer[0], symbol);
 
-	for (auto f : g_dlsymHooks)
+	for (auto f : *g_dlsymHooks.load())
 	{
-		if (f(symbuffer))
+		if (f(&symbuffer[0]))
 		{
 			translated = true;
 			break;
 		}
 	}
-	
-	if (!translated)
+
+	if (translated)
+		s = &symbuffer[0];
+	else if (const char* target = nameMapFind(symbol))
+		s = target; // libSystem's map, also used before libSystem registers its hook
+	else
 	{
-		std::string s = symbol;
+		s = symbol;
 		for (int i = 0; i < sizeof(g_suffixes) / sizeof(g_suffixes[0]); i++)
 		{
 			size_t pos = s.find(g_suffixes[i]);
 			if (pos != std::string::npos)
 				s.erase(pos, strlen(g_suffixes[i]));
 		}
-	
-		strcpy(symbuffer, s.c_str());
 	}
 
-	return symbuffer;
+	return g_translationCache.insert(symbol, s.c_str(), gen);
 }
 
 NSSymbol NSLookupAndBindSymbol(const char* symbolName)
@@ -587,11 +746,121 @@ const char* NSLibraryNameForModule(NSModule m)
 	return NSNameOfModule(m);
 }
 
+static void* dlsymDarwinPrefixed(const char* symbol)
+{
+	char buf[512];
+
+	if (strlen(symbol) + 10 > sizeof(buf))
+		return nullptr;
+
+	strcpy(buf, "__darwin_");
+	strcat(buf, symbol);
+
+	return ::dlsym(RTLD_DEFAULT, buf);
+}
+
+// Returns the entry's native result for the current generation, looking up the __darwin_ prefixed symbol if needed
+static const SymbolIndex::NativeResult* nativeResultOf(SymbolIndex::Entry& e, unsigned long hooksGen, SymbolIndex::NativeResult* unpublished)
+{
+	const unsigned long gen = SymbolIndex::currentNativeGeneration();
+	const SymbolIndex::NativeResult* native = e.native.load(std::memory_order_acquire);
+
+	if (!native || native->nativeGeneration != gen)
+	{
+		SymbolIndex::NativeResult* fresh = new SymbolIndex::NativeResult { gen, hooksGen, dlsymDarwinPrefixed(e.name), SymbolIndex::Unresolved };
+		const SymbolIndex::NativeResult* expected = native;
+
+		if (e.native.compare_exchange_strong(expected, fresh, std::memory_order_acq_rel))
+			native = fresh;
+		else
+		{
+			// Another thread has replaced the result meanwhile, ours is still right for this lookup
+			*unpublished = *fresh;
+			delete fresh;
+			native = unpublished;
+		}
+	}
+
+	return native;
+}
+
+static void* dlsymNative(const char* symbol)
+{
+	ResolverStats::Timer timer(ResolverStats::DlsymNative);
+	const char* translated = translateSymbol(symbol);
+	const NativeHandleList* handles = g_nativeHandles.load();
+	void* sym;
+
+	LOG << "Trying " << translated << std::endl;
+
+	// One probe instead of a dlsym() per library
+	if (!g_noSymbolIndex && g_nativeSymbolIndex.lookup(translated, symbol, *handles, &sym))
+	{
+		if (sym)
+			return sym;
+
+		// Libraries native code has loaded since the index was built aren't in it
+		RET_IF(::dlsym(RTLD_DEFAULT, translated));
+		if (strcmp(translated, symbol) != 0)
+			RET_IF(::dlsym(RTLD_DEFAULT, symbol));
+		return nullptr;
+	}
+	
+	for (void* nativeRef : *handles)
+	{
+		RET_IF(::dlsym(nativeRef, translated));
+		if (strcmp(translated, symbol) != 0)
+			RET_IF(::dlsym(nativeRef, symbol));
+	}
+	
+	RET_IF(::dlsym(RTLD_DEFAULT, translated));
+	
+	if (strcmp(translated, symbol) != 0)
+		RET_IF(::dlsym(RTLD_DEFAULT, symbol));
+
+	return nullptr;
+}
+
+// Searches all loaded images one by one, used when DYLD_NO_SYMBOL_INDEX is set
+static void* dlsymSearchAll(void* handle, const char* symbol)
+{
+	Darling::MutexLock l(g_ldMutex);
+
+	// First try native with the __darwin prefix
+	RET_IF(dlsymDarwinPrefixed(symbol));
+	
+	// Now try Darwin libraries
+	const std::list<Exports*>& le = g_loader->getExports();
+	std::list<Exports*>::const_iterator it = le.begin();
+
+	while (it != le.end())
+	{
+		const Exports* e = *it;
+		const MachO::Export* exp = e->find(symbol);
+	
+		if (!exp)
+			exp = e->find((std::string("_") + symbol).c_str()); // TODO: WTF?
+	
+		if (exp)
+		{
+			if (handle != __DARLING_RTLD_STRONG || !(exp->flag & 4))
+				return reinterpret_cast<void*>(exp->addr);
+		}
+		it++;
+	}
+
+	// Now try without a prefix
+	RET_IF(dlsymNative(symbol));
+
+	// Now we fail
+	snprintf(g_ldError, sizeof(g_ldError)-1, "Cannot find symbol '%s'", symbol);
+	return nullptr;
+}
+
 void* __darwin_dlsym(void* handle, const char* symbol, void* extra)
 {
 	TRACE2(handle, symbol);
 	
-	Darling::MutexLock l(g_ldMutex);
 	g_ldError[0] = 0;
 	
 	if (!handle)
@@ -606,57 +875,96 @@ void* __darwin_dlsym(void* handle, const char* symbol, void* extra)
 //handling:
 	if (handle == DARWIN_RTLD_DEFAULT || handle == __DARLING_RTLD_STRONG)
 	{
-		// First try native with the __darwin prefix
+		ResolverStats::Timer timer(ResolverStats::Dlsym);
+
+		if (g_noSymbolIndex)
+			return dlsymSearchAll(handle, symbol);
+
+		SymbolIndex& index = g_loader->getSymbolIndex();
+		SymbolIndex::Entry* found = index.find(symbol);
+		const MachO::Export *exp, *strongExp;
 		void* sym;
-		char* buf = reinterpret_cast<char*>(malloc(strlen(symbol)+20));
-		strcpy(buf, "__darwin_");
-		strcat(buf, symbol);
-		
-		sym = ::dlsym(RTLD_DEFAULT, buf);
-		if (sym)
-			return sym;
-		
-		// Now try Darwin libraries
-		const std::list<Exports*>& le = g_loader->getExports();
-		std::list<Exports*>::const_iterator it = le.begin();
 
-		while (it != le.end())
+		// Names get an entry once they resolve. Misses get one too, up to a limit,
+		// so that probing for a missing symbol again doesn't walk every export trie.
+		if (!found)
 		{
-			const Exports* e = *it;
-			Exports::const_iterator itSym = e->find(symbol);
-		
-			if (itSym == e->end())
-				itSym = e->find(std::string("_") + symbol); // TODO: WTF?
-		
-			if (itSym != e->end())
+			const unsigned long nativeGen = SymbolIndex::currentNativeGeneration();
+			const unsigned long hooksGen = g_dlsymHooksGeneration.load(std::memory_order_acquire);
+			unsigned long exportGen = 0;
+			bool exported = false;
+
+			if ((sym = dlsymDarwinPrefixed(symbol)))
+				ResolverStats::count(ResolverStats::DlsymDarwinPrefixed);
+			else
+			{
+				exportGen = index.resolve(symbol, &exp, &strongExp);
+				exported = exp != nullptr;
+				if (handle == __DARLING_RTLD_STRONG)
+					exp = strongExp;
+				if (exp)
+				{
+					ResolverStats::count(ResolverStats::DlsymExport);
+					sym = reinterpret_cast<void*>(exp->addr);
+				}
+				else
+					sym = dlsymNative(symbol);
+			}
+
+			if (sym)
 			{
-				if (handle != __DARLING_RTLD_STRONG || !(itSym->second.flag & 4))
-					return reinterpret_cast<void*>(itSym->second.addr);
+				index.findOrInsert(symbol);
+				return sym;
 			}
-			it++;
+
+			// A weak definition is a miss only for __DARLING_RTLD_STRONG
+			if (!exported)
+				index.insertMiss(symbol, exportGen, nativeGen, hooksGen);
+			ResolverStats::count(ResolverStats::DlsymMiss);
+			snprintf(g_ldError, sizeof(g_ldError)-1, "Cannot find symbol '%s'", symbol);
+			return nullptr;
+		}
+
+		SymbolIndex::Entry& e = *found;
+		const unsigned long hooksGen = g_dlsymHooksGeneration.load(std::memory_order_acquire);
+		SymbolIndex::NativeResult unpublished;
+		const SymbolIndex::NativeResult* native = nativeResultOf(e, hooksGen, &unpublished);
+
+		// First try native with the __darwin prefix
+		if ((sym = native->native))
+		{
+			ResolverStats::count(ResolverStats::DlsymDarwinPrefixed);
+			return sym;
+		}
+
+		// Now try Darwin libraries
+		index.lookupExports(e, &exp, &strongExp);
+
+		if (handle == __DARLING_RTLD_STRONG)
+			exp = strongExp;
+		if (exp)
+		{
+			ResolverStats::count(ResolverStats::DlsymExport);
+			return reinterpret_cast<void*>(exp->addr);
 		}
 
 		// Now try without a prefix
-		const char* translated = translateSymbol(symbol);
-		LOG << "Trying " << translated << std::endl;
-		
-		for (auto& pair : g_ldLibraries)
+		sym = native->fallback;
+		if (sym == SymbolIndex::Unresolved || native->hooksGeneration != hooksGen)
 		{
-			if (pair.second->type == LoadedLibraryNative)
-			{
-				LOG << "Trying in " << pair.first << std::endl;
-				RET_IF(::dlsym(pair.second->nativeRef, translated));
-				if (strcmp(translated, symbol) != 0)
-					RET_IF(::dlsym(pair.second->nativeRef, symbol));
-			}
+			SymbolIndex::NativeResult* updated = new SymbolIndex::NativeResult { native->nativeGeneration, hooksGen, native->native, nullptr };
+
+			updated->fallback = sym = dlsymNative(symbol);
+
+			// Only succeeds if nobody has published a result for a newer generation in the meantime
+			if (!e.native.compare_exchange_strong(native, updated, std::memory_order_acq_rel))
+				delete updated;
 		}
-		
-		RET_IF(::dlsym(RTLD_DEFAULT, translated));
-		
-		if (strcmp(translated, symbol) != 0)
-			RET_IF(::dlsym(RTLD_DEFAULT, symbol));
+		if (sym)
+			return sym;
 
 		// Now we fail
+		ResolverStats::count(ResolverStats::DlsymMiss);
 		snprintf(g_ldError, sizeof(g_ldError)-1, "Cannot find symbol '%s'", symbol);
 		return nullptr;
 	}
@@ -673,35 +981,28 @@ void* __darwin_dlsym(void* handle, const char* symbol, void* extra)
 		else
 		{
 			void* retaddr;
-			const char* name;
+			const FileMap::ImageMap* map;
 
 			backtrace(&retaddr, 1);
 
-			name = g_file_map.fileNameForAddr(retaddr);
-			if (!name)
+			map = g_file_map.imageMapForAddr(retaddr);
+			if (!map)
 			{
 				strcpy(g_ldError, "Couldn't determine the current module");
 				return nullptr;
 			}
 
-			auto it = g_ldLibraries.find(name);
-			if (it == g_ldLibraries.end())
-			{
-				strcpy(g_ldError, "Couldn't determine the current module by path");
-				return nullptr;
-			}
-
-			exports = it->second->exports;
+			exports = map->exports;
 		}
 
-		Exports::iterator itSym = exports->find(symbol);
-		if (itSym == exports->end())
+		const MachO::Export* exp = exports->find(symbol);
+		if (!exp)
 		{
 			snprintf(g_ldError, sizeof(g_ldError)-1, "Cannot find symbol '%s'", symbol);
 			return 0;
 		}
 		else
-			return reinterpret_cast<void*>(itSym->second.addr);
+			return reinterpret_cast<void*>(exp->addr);
 	}
 	else
 	{
@@ -729,14 +1030,14 @@ void* __darwin_dlsym(void* handle, const char* symbol, void* extra)
 		//}
 		else
 		{
-			Exports::iterator itSym = lib->exports->find(symbol);
-			if (itSym == lib->exports->end())
+			const MachO::Export* exp = lib->exports->find(symbol);
+			if (!exp)
 			{
 				snprintf(g_ldError, sizeof(g_ldError)-1, "Cannot find symbol '%s'", symbol);
 				return 0;
 			}
 			else
-				return reinterpret_cast<void*>(itSym->second.addr);
+				return reinterpret_cast<void*>(exp->addr);
 		}
 	}
 }
@@ -745,7 +1046,6 @@ int __darwin_dladdr(void *addr, Dl_info *info)
 {
 	TRACE2(addr, info);
 	
-	Darling::MutexLock l(g_ldMutex);
 	g_ldError[0] = 0;
 	
 	if (!g_file_map.findSymbolInfo(addr, info))
@@ -762,9 +1062,29 @@ int __darwin_dladdr(void *addr, Dl_info *info)
 	return 0;
 }
 
+void* Darling::FindDarwinOverride(const char* symbol)
+{
+	if (g_noSymbolIndex)
+		return dlsymDarwinPrefixed(symbol);
+
+	// Callers have found a definition already, so the name is worth an entry
+	SymbolIndex::Entry& e = g_loader->getSymbolIndex().findOrInsert(symbol);
+	SymbolIndex::NativeResult unpublished;
+
+	return nativeResultOf(e, g_dlsymHooksGeneration.load(std::memory_order_acquire), &unpublished)->native;
+}
+
 void Darling::registerDlsymHook(Darling::DlsymHookFunc func)
 {
-	g_dlsymHooks.push_front(func);
+	Darling::MutexLock l(g_dlsymHooksMutex);
+	DlsymHookList* hooks = new DlsymHookList;
+
+	// Newer hooks take precedence
+	hooks->push_back(func);
+	hooks->insert(hooks->end(), g_dlsymHooks.load()->begin(), g_dlsymHooks.load()->end());
+
+	g_dlsymHooks.store(hooks);
+	g_dlsymHooksGeneration++;
 }
 
 void Darling::deregisterDlsymHook(Darling::DlsymHookFunc func)
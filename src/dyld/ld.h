@@ -21,6 +21,7 @@ along with Darling.  If not, see <http://www.gnu.org/licenses/>.
 #define DARWIN_LD_H
 #include <dlfcn.h>
 #include <unordered_map>
+#include "Exports.h"
 //#include "MachOLoader.h"
 
 #define DARWIN_RTLD_LAZY		0x1
@@ -48,6 +49,8 @@ typedef void* NSModule;
 extern "C"
 {
 void initLD();
+// Replays and records library search results of this launch (DYLD_CLOSURE_DIR)
+void initLaunchClosure(const char* dir, const char* executable);
 void* __darwin_dlopen(const char* filename, int flag);
 int __darwin_dlclose(void* handle);
 const char* __darwin_dlerror(void);
@@ -70,7 +73,6 @@ const char* NSLibraryNameForModule(NSModule m);
 
 enum LoadedLibraryType { LoadedLibraryDylib, LoadedLibraryNative, LoadedLibraryDummy };
 
-typedef std::unordered_map<std::string, MachO::Export> Exports;
 
 // TODO: this should be united with the list in FileMap
 struct LoadedLibrary
@@ -94,6 +96,8 @@ namespace Darling
 	void registerDlsymHook(DlsymHookFunc func);
 	void deregisterDlsymHook(DlsymHookFunc func);
 	void* DlopenWithContext(const char* filename, int flag, const std::vector<std::string>& rpaths, bool* notFoundError = nullptr);
+	// Native replacement (__darwin_ prefixed) of a Darwin symbol, it takes precedence over all Mach-O definitions
+	void* FindDarwinOverride(const char* symbol);
 };
 
 #endif
@@ -21,6 +21,7 @@ along with Darling.  If not, see <http://www.gnu.org/licenses/>.
 #include "public.h"
 #include "MachOLoader.h"
 #include "FileMap.h"
+#include "ResolverStats.h"
 #include "trace.h"
 #include <cstring>
 #include <cstdlib>
@@ -297,3 +298,7 @@ bool _dyld_find_unwind_sections(void* addr, struct dyld_unwind_sections* info)
 	}
 }
 
+int _dyld_get_statistics(struct dyld_statistics_counter* counters, uint32_t* count)
+{
+	return ResolverStats::get(counters, count);
+}
@@ -34,6 +34,16 @@ struct dyld_unwind_sections
 	uintptr_t compact_unwind_section_length;
 };
 
+#define DYLD_STATISTICS_BUCKETS 32
+
+struct dyld_statistics_counter
+{
+	const char* name;
+	uint64_t count;
+	uint64_t total_ns; // 0 for counters that are not timed
+	uint64_t histogram[DYLD_STATISTICS_BUCKETS]; // samples below 2^i ns, the last bucket holds the rest
+};
+
 typedef void (LoaderHookFunc)(const struct mach_header* mh, intptr_t vmaddr_slide);
 
 uint32_t _dyld_image_count(void);
@@ -55,6 +65,10 @@ int _NSGetExecutablePath(char* buf, uint32_t* bufsize);
 const char* dyld_image_path_containing_address(const void* addr);
 bool _dyld_find_unwind_sections(void* addr, struct dyld_unwind_sections* info);
 
+// Fills in up to *count counters and sets *count to the number of counters available.
+// Returns -1 if there were more counters than requested.
+int _dyld_get_statistics(struct dyld_statistics_counter* counters, uint32_t* count);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,9 +1,5 @@
 #include <cstring>
-#include <map>
-#include <string>
-#include <sstream>
-#include <iostream>
-#include "../util/stlutils.h"
+#include "namemap.h" // generated from namemap.lst by genfuncmap
 
 namespace Darling
 {
@@ -12,51 +8,11 @@ namespace Darling
     void deregisterDlsymHook(DlsymHookFunc func);
 };
 
-static const char* g_directmap =
-#include "namemap.lst"
-;
-
-static std::map<std::string,std::string> g_nameMap;
-
 static bool NameTranslator(char* symName);
 
 __attribute__((constructor))
 	static void initTranslation()
 {
-	std::istringstream istr(g_directmap);
-	std::string line;
-
-	while (std::getline(istr, line))
-	{
-		if (line.empty() || line[0] == '#')
-			continue;
-		
-		std::vector<std::string> segs = string_explode(line, ';');
-		if (segs.size() < 2)
-			continue;
-
-		if (segs[0].compare(0, 3, "32!") == 0)
-		{
-#ifdef __x86_64__
-			continue;
-#else
-			segs[0] = segs[0].substr(3);
-#endif
-		}
-
-		if (segs[0].compare(0, 3, "64!") == 0)
-		{
-#ifdef __i386__
-			continue;
-#else
-			segs[0] = segs[0].substr(3);
-#endif
-		}
-
-		// std::cout << segs[0] << " -> " << segs[1] << std::endl;
-		g_nameMap[segs[0]] = segs[1];
-	}
-
 	Darling::registerDlsymHook(NameTranslator);
 }
 
@@ -68,10 +24,10 @@ __attribute__((destructor))
 
 bool NameTranslator(char* symName)
 {
-	auto it = g_nameMap.find(symName);
-	if (it != g_nameMap.end())
+	const char* target = nameMapFind(symName);
+	if (target)
 	{
-		strcpy(symName, it->second.c_str());
+		strcpy(symName, target);
 		return true;
 	}
 	return false;
@@ -37,8 +37,8 @@
 typedef long long ll;
 typedef unsigned long long ull;
 
-BindState::BindState(MachOImpl* mach0, bool is_weak0, bool is_lazy0)
-	: mach(mach0), ordinal(0), sym_name(NULL), type(BIND_TYPE_POINTER),
+BindState::BindState(const MachOImpl* mach0, bool is_weak0, bool is_lazy0, MachO::BindCallback cb0, void* ctx0)
+	: mach(mach0), cb(cb0), ctx(ctx0), ordinal(0), sym_name(NULL), type(BIND_TYPE_POINTER),
 	addend(0), seg_index(0), seg_offset(0), is_weak(is_weak0), is_lazy(is_lazy0),
 	last_start(nullptr)
 {
@@ -75,7 +75,7 @@ void BindState::readBindOp(const uint8_t* bindsStart, const uint8_t*& p)
 		if (imm == 0)
 			ordinal = 0;
 		else
-			ordinal = BIND_OPCODE_MASK | imm;
+			ordinal = int8_t(BIND_OPCODE_MASK | imm);
 		
 		break;
 
@@ -138,7 +138,7 @@ void BindState::readBindOp(const uint8_t* bindsStart, const uint8_t*& p)
 
 void BindState::addBind(uintptr_t offset)
 {
-	MachO::Bind* bind = new MachO::Bind();
+	MachO::Bind bind = MachO::Bind();
 	uint64_t vmaddr;
 	if (mach->m_is64)
 		vmaddr = mach->m_segments64[seg_index]->vmaddr;
@@ -149,24 +149,96 @@ void BindState::addBind(uintptr_t offset)
 			"type=%d ordinal=%d addend=%lld vmaddr=%p is_weak=%d\n",
 			sym_name, seg_index, (ull)seg_offset,
 			type, ordinal, (ll)addend, (void*)(vmaddr + seg_offset), is_weak);
-	bind->name = sym_name;
-	bind->vmaddr = vmaddr + seg_offset;
-	bind->addend = addend;
-	bind->type = type;
-	bind->ordinal = ordinal;
-	bind->is_weak = is_weak;
-	bind->is_lazy = is_lazy;
+	bind.name = sym_name;
+	bind.vmaddr = vmaddr + seg_offset;
+	bind.addend = addend;
+	bind.type = type;
+	bind.ordinal = ordinal;
+	bind.is_weak = is_weak;
+	bind.is_lazy = is_lazy;
 	
 	if (!mach->m_is64)
 	{
-		bind->vmaddr &= 0xffffffff;
-		bind->addend &= 0xffffffff;
+		bind.vmaddr &= 0xffffffff;
+		bind.addend &= 0xffffffff;
 	}
 	
 	if (is_lazy)
-		bind->offset = offset;
+		bind.offset = offset;
 	
-	mach->m_binds.push_back(bind);
+	cb(bind, ctx);
 
 	seg_offset += mach->m_ptrsize;
 }
+
+bool MachO::readLazyBind(const uint8_t* p, const uint8_t* end, LazyBind* bind)
+{
+	bind->seg_index = -1;
+	bind->seg_offset = 0;
+	bind->name = nullptr;
+	bind->addend = 0;
+	bind->type = BIND_TYPE_POINTER;
+	bind->ordinal = 0;
+
+	// Every lazy bind record is terminated by its own DONE opcode,
+	// so we only need to decode the opcodes up to the first DO_BIND
+	while (p < end)
+	{
+		uint8_t op = *p & BIND_OPCODE_MASK;
+		uint8_t imm = *p & BIND_IMMEDIATE_MASK;
+
+		p++;
+
+		switch (op)
+		{
+		case BIND_OPCODE_DONE:
+			return false;
+
+		case BIND_OPCODE_SET_DYLIB_ORDINAL_IMM:
+			bind->ordinal = imm;
+			break;
+
+		case BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB:
+			bind->ordinal = uleb128(p);
+			break;
+
+		case BIND_OPCODE_SET_DYLIB_SPECIAL_IMM:
+			if (imm == 0)
+				bind->ordinal = 0;
+			else
+				bind->ordinal = int8_t(BIND_OPCODE_MASK | imm);
+			break;
+
+		case BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM:
+			bind->name = reinterpret_cast<const char*>(p);
+			p += strlen(bind->name) + 1;
+			break;
+
+		case BIND_OPCODE_SET_TYPE_IMM:
+			bind->type = imm;
+			break;
+
+		case BIND_OPCODE_SET_ADDEND_SLEB:
+			bind->addend = sleb128(p);
+			break;
+
+		case BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB:
+			bind->seg_index = imm;
+			bind->seg_offset = uleb128(p);
+			break;
+
+		case BIND_OPCODE_ADD_ADDR_ULEB:
+			bind->seg_offset += uleb128(p);
+			break;
+
+		case BIND_OPCODE_DO_BIND:
+			return bind->name != nullptr && bind->seg_index >= 0;
+
+		default:
+			fprintf(stderr, "unexpected lazy bind op: %x\n", op);
+			return false;
+		}
+	}
+
+	return false;
+}
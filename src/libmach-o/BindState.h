@@ -32,14 +32,16 @@
 
 struct BindState
 {
-	BindState(MachOImpl* mach0, bool is_weak0, bool is_lazy0);
+	BindState(const MachOImpl* mach0, bool is_weak0, bool is_lazy0, MachO::BindCallback cb0, void* ctx0);
 
 	void readBindOp(const uint8_t* bindsStart, const uint8_t*& p);
 
 	void addBind(uintptr_t offset);
 
-	MachOImpl* mach;
-	uint8_t ordinal;
+	const MachOImpl* mach;
+	MachO::BindCallback cb;
+	void* ctx;
+	int ordinal;
 	const char* sym_name;
 	uint8_t type;
 	int64_t addend;
@@ -21,6 +21,7 @@ along with Darling.  If not, see <http://www.gnu.org/licenses/>.
 #include "MachO.h"
 #include "FatMachO.h"
 #include "MachOImpl.h"
+#include "leb.h"
 #include <cstdio>
 #include <unistd.h>
 #include <errno.h>
@@ -32,7 +33,7 @@ along with Darling.  If not, see <http://www.gnu.org/licenses/>.
 #include <cstring>
 #include <map>
 
-MachO* MachO::readFile(std::string path, const char* arch, bool need_exports)
+MachO* MachO::readFile(std::string path, const char* arch, bool need_exports, bool need_fixups)
 {
 	int fd = ::open(path.c_str(), O_RDONLY);
 	if (fd < 0)
@@ -60,7 +61,7 @@ MachO* MachO::readFile(std::string path, const char* arch, bool need_exports)
 		// LOGF("fat offset=%lu, len=%lu\n", (unsigned long)offset, (unsigned long)len);
 	}
 
-	return new MachOImpl(path.c_str(), fd, offset, len, need_exports);
+	return new MachOImpl(path.c_str(), fd, offset, len, need_exports, need_fixups);
 }
 
 bool MachO::isMachO(const char* path)
@@ -79,3 +80,77 @@ bool MachO::isMachO(const char* path)
 	}
 	return is_macho;
 }
+
+bool MachO::findExport(const uint8_t* trie, const uint8_t* end, const char* name, Export* exp)
+{
+	const uint8_t* p = trie;
+
+	// Follow the edges matching the name, each node is visited at most once
+	while (p < end)
+	{
+		uint64_t term_size = uleb128(p);
+		const uint8_t* children;
+		uint8_t num_children;
+		uint64_t next = 0;
+
+		if (!*name)
+		{
+			if (!term_size)
+				return false;
+
+			exp->flag = uleb128(p);
+
+			// TODO: flag == 8 (EXPORT_SYMBOL_FLAGS_REEXPORT)
+			if (exp->flag & 8)
+				return false;
+
+			exp->addr = uleb128(p);
+			return true;
+		}
+
+		children = p + term_size;
+		if (children >= end)
+			return false;
+
+		num_children = *children++;
+		p = children;
+
+		for (uint8_t i = 0; i < num_children; i++)
+		{
+			const char* edge = reinterpret_cast<const char*>(p);
+			size_t len = strlen(edge);
+
+			p += len + 1;
+			uint64_t off = uleb128(p);
+
+			if (strncmp(edge, name, len) == 0)
+			{
+				name += len;
+				next = off;
+				break;
+			}
+		}
+
+		if (!next)
+			return false;
+
+		p = trie + next;
+	}
+
+	return false;
+}
+
+uint64_t MachO::vmaddrForFileOffset(uint64_t offset) const
+{
+	for (const segment_command_64* seg : m_segments64)
+	{
+		if (offset >= seg->fileoff && offset < seg->fileoff + seg->filesize)
+			return seg->vmaddr + offset - seg->fileoff;
+	}
+	for (const segment_command* seg : m_segments)
+	{
+		if (offset >= seg->fileoff && offset < seg->fileoff + seg->filesize)
+			return seg->vmaddr + offset - seg->fileoff;
+	}
+	return 0;
+}
@@ -29,15 +29,33 @@ along with Darling.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <mach/vm_types.h>
 #include <mach-o/loader.h>
+#include <mach-o/fixup-chains.h>
 
 class MachO
 {
 public:
 	__attribute__ ((visibility ("default")))
-	static MachO* readFile(std::string path, const char* arch, bool need_exports = true);
+	// need_exports fills exports() and symbols(), dyld looks both up in the loaded __LINKEDIT instead.
+	// need_fixups fills rebases() and binds() with the rebases and binds from LC_DYLD_INFO.
+	// Without it, they are decoded on every forEachRebase()/forEachBind() call instead.
+	static MachO* readFile(std::string path, const char* arch, bool need_exports = true, bool need_fixups = true);
 	__attribute__ ((visibility ("default")))
 	static bool isMachO(const char* path);
 
+	struct LazyBind
+	{
+		int seg_index;
+		uint64_t seg_offset;
+		const char* name;
+		int64_t addend;
+		uint8_t type;
+		int ordinal;
+	};
+
+	// Decodes the single lazy bind record starting at p (lazy binding info + lazyOffset)
+	__attribute__ ((visibility ("default")))
+	static bool readLazyBind(const uint8_t* p, const uint8_t* end, LazyBind* bind);
+
 	virtual ~MachO() {}
 	virtual void close() = 0;
 
@@ -52,28 +70,33 @@ public:
 	struct Bind
 	{
 		uint64_t vmaddr;
-		std::string name;
+		const char* name; // points into the mapped file
 		union
 		{
 			int64_t addend;
 			uint64_t value;
 		};
 		uint8_t type;
-		uint8_t ordinal;
+		int ordinal; // special ordinals (BIND_SPECIAL_DYLIB_*) are negative
 		bool is_weak, is_lazy, is_classic;
 		uintptr_t offset; // Needed to find the right bind when doing lazy binding
 	};
 
 	struct Export
 	{
-		std::string name;
+		const char* name; // interned in StringPool
 		uint64_t addr;
 		uint32_t flag;
 	};
 
+	// Looks up a single symbol in an export trie without reading the rest of it.
+	// The address is relative to the image base, the name is not filled in.
+	__attribute__ ((visibility ("default")))
+	static bool findExport(const uint8_t* trie, const uint8_t* end, const char* name, Export* exp);
+
 	struct Symbol
 	{
-		std::string name;
+		const char* name; // points into the mapped file
 		uint64_t addr;
 	};
 	
@@ -83,10 +106,18 @@ public:
 		uintptr_t addr, size;
 	};
 
+	struct ChainedImport
+	{
+		const char* name; // points into the mapped file
+		int64_t addend;
+		int ordinal; // special ordinals (BIND_SPECIAL_DYLIB_*) are negative
+		bool weak_import;
+	};
+
 	struct Relocation
 	{
 		uint64_t addr;
-		std::string name; // symbol name
+		const char* name; // symbol name, points into the mapped file
 		bool pcrel; // i386
 	};
 
@@ -94,7 +125,10 @@ public:
 
 	const std::vector<segment_command*>& segments() const { return m_segments; }
 
+	// All dependencies in the order used by bind ordinals
 	const std::vector<const char*>& dylibs() const { return m_dylibs; }
+	// LC_LOAD_WEAK_DYLIB, the dependency may be missing
+	bool is_weak_dylib(size_t index) const { return m_weak_dylibs[index]; }
 
 	const std::vector<const char*>& rpaths() const { return m_rpaths; }
 
@@ -102,11 +136,26 @@ public:
 
 	const std::vector<Bind*>& binds() const { return m_binds; }
 
+	typedef void (*RebaseCallback)(const Rebase& rebase, void* ctx);
+	typedef void (*BindCallback)(const Bind& bind, void* ctx);
+
+	// Visit all rebases/binds in the order in which they were stored in the file.
+	// Unless need_fixups was set, nothing is allocated - the opcodes are interpreted as they are read.
+	virtual void forEachRebase(RebaseCallback cb, void* ctx) const = 0;
+	virtual void forEachBind(BindCallback cb, void* ctx) const = 0;
+
 	const std::vector<Export*>& exports() const { return m_exports; }
 
 	const std::vector<Symbol>& symbols() const { return m_symbols; }
 	const std::vector<Relocation*>& relocations() const { return m_relocations; }
 
+	// LC_DYLD_CHAINED_FIXUPS, the fixups themselves are chained through the segment contents
+	bool has_chained_fixups() const { return m_has_chained_fixups; }
+	// Imported symbols, referenced by the bind ordinal in the chains
+	const std::vector<ChainedImport>& chained_imports() const { return m_chained_imports; }
+	// Chain starts for every segment (by segment index), null for segments without fixups. Points into the mapped file.
+	const std::vector<const dyld_chained_starts_in_segment*>& chained_starts() const { return m_chained_starts; }
+
 	uintptr_t base() const { return m_base; }
 
 	uint64_t entry() const { return m_entry; }
@@ -117,6 +166,24 @@ public:
 	
 	std::pair<uint64_t,uint64_t> get_eh_frame() const { return m_eh_frame; }
 	std::pair<uint64_t,uint64_t> get_unwind_info() const { return m_unwind_info; }
+	// File offset and size of the lazy binding info
+	std::pair<uint32_t,uint32_t> get_lazy_bind_info() const { return m_lazy_bind_info; }
+	// File offset and size of the export trie (LC_DYLD_INFO or LC_DYLD_EXPORTS_TRIE)
+	std::pair<uint32_t,uint32_t> get_export_trie_info() const { return m_export_trie_info; }
+	// File offset and size of the ULEB128 encoded function start addresses (LC_FUNCTION_STARTS)
+	std::pair<uint32_t,uint32_t> get_function_starts() const { return m_function_starts; }
+
+	// LC_SYMTAB as in the file, all zero if there is none
+	struct SymtabInfo
+	{
+		uint32_t symoff, nsyms;
+		uint32_t stroff, strsize;
+	};
+	const SymtabInfo& get_symtab_info() const { return m_symtab_info; }
+
+	// Unslid address at which the given file offset gets mapped, 0 if it isn't part of any segment
+	__attribute__ ((visibility ("default")))
+	uint64_t vmaddrForFileOffset(uint64_t offset) const;
 
 	uint64_t dyld_data() const { return m_dyld_data; }
 
@@ -136,12 +203,16 @@ public:
 	std::vector<segment_command_64*> m_segments64;
 	std::vector<segment_command*> m_segments;
 	std::vector<const char*> m_dylibs;
+	std::vector<bool> m_weak_dylibs;
 	std::vector<const char*> m_rpaths;
 	std::vector<Rebase*> m_rebases;
 	std::vector<Bind*> m_binds;
 	std::vector<Export*> m_exports;
 	std::vector<Symbol> m_symbols;
 	std::vector<Relocation*> m_relocations;
+	bool m_has_chained_fixups;
+	std::vector<ChainedImport> m_chained_imports;
+	std::vector<const dyld_chained_starts_in_segment*> m_chained_starts;
 	uintptr_t m_base;
 	uint64_t m_entry, m_main;
 	std::vector<uint64_t> m_init_funcs;
@@ -149,6 +220,10 @@ public:
 	uint64_t m_dyld_data;
 	std::pair<uint64_t,uint64_t> m_eh_frame;
 	std::pair<uint64_t,uint64_t> m_unwind_info;
+	std::pair<uint32_t,uint32_t> m_lazy_bind_info;
+	std::pair<uint32_t,uint32_t> m_export_trie_info;
+	std::pair<uint32_t,uint32_t> m_function_starts;
+	SymtabInfo m_symtab_info;
 	bool m_is64;
 	int m_ptrsize;
 	int m_fd;
@@ -22,6 +22,7 @@ along with Darling.  If not, see <http://www.gnu.org/licenses/>.
 #include "log.h"
 #include "RebaseState.h"
 #include "BindState.h"
+#include "StringPool.h"
 #include "leb.h"
 
 #include <mach-o/loader.h>
@@ -31,11 +32,25 @@ along with Darling.  If not, see <http://www.gnu.org/licenses/>.
 #include <cstdlib>
 #include <cstring>
 #include <stdexcept>
+#include <sstream>
 
 #define N_WEAK_DEF			0x0080
 #define FLAGS_READ_SYMTAB	1
 #define FLAGS_READ_DYSYMTAB	1
 
+// GET_LIBRARY_ORDINAL() from <mach-o/nlist.h>, with the special values translated to BIND_SPECIAL_DYLIB_*
+static int libraryOrdinal(uint16_t n_desc)
+{
+	int ordinal = (n_desc >> 8) & 0xff;
+
+	if (ordinal == 0xfe) // DYNAMIC_LOOKUP_ORDINAL
+		return BIND_SPECIAL_DYLIB_FLAT_LOOKUP;
+	else if (ordinal == 0xff) // EXECUTABLE_ORDINAL
+		return BIND_SPECIAL_DYLIB_MAIN_EXECUTABLE;
+	else
+		return ordinal; // including SELF_LIBRARY_ORDINAL
+}
+
 template <class section>
 void MachOImpl::readClassicBind(const section& sec, uint32_t* dysyms, uint32_t* symtab, const char* symstrtab)
 {
@@ -53,7 +68,7 @@ void MachOImpl::readClassicBind(const section& sec, uint32_t* dysyms, uint32_t*
 		bind->vmaddr = sec.addr + i * m_ptrsize;
 		bind->value = sym->n_value;
 		bind->type = BIND_TYPE_POINTER;
-		bind->ordinal = 1;
+		bind->ordinal = libraryOrdinal(sym->n_desc);
 		bind->is_weak = ((sym->n_desc & N_WEAK_DEF) != 0);
 		bind->is_classic = true;
 
@@ -93,7 +108,7 @@ void MachOImpl::readStubBind(const section& sec,  uint32_t* dysyms, uint32_t* sy
 		bind->vmaddr = sec.addr + i * element_size;
 		bind->value = sym->n_value;
 		bind->type = BIND_TYPE_STUB;
-		bind->ordinal = 1;
+		bind->ordinal = libraryOrdinal(sym->n_desc);
 		bind->is_weak = ((sym->n_desc & N_WEAK_DEF) != 0);
 		bind->is_classic = true;
 
@@ -105,7 +120,7 @@ void MachOImpl::readStubBind(const section& sec,  uint32_t* dysyms, uint32_t* sy
 
 		m_binds.push_back(bind);
 
-		LOG << "add stub bind: " << bind->name.c_str() << " vmaddr=" << (void*) bind->vmaddr << std::endl;
+		LOG << "add stub bind: " << bind->name << " vmaddr=" << (void*) bind->vmaddr << std::endl;
 	}
 }
 
@@ -211,9 +226,9 @@ void MachOImpl::readSegment(char* cmds_ptr, std::vector<segment_command*>* segme
 	}
 }
 
-void MachOImpl::readRebase(const uint8_t* p, const uint8_t* end)
+void MachOImpl::readRebase(const uint8_t* p, const uint8_t* end, RebaseCallback cb, void* ctx) const
 {
-	RebaseState state(this);
+	RebaseState state(this, cb, ctx);
 	while (p < end)
 	{
 		if (!state.readRebaseOp(p))
@@ -222,9 +237,9 @@ void MachOImpl::readRebase(const uint8_t* p, const uint8_t* end)
 }
 
 
-void MachOImpl::readBind(const uint8_t* start, const uint8_t* end, bool is_weak, bool is_lazy)
+void MachOImpl::readBind(const uint8_t* start, const uint8_t* end, bool is_weak, bool is_lazy, BindCallback cb, void* ctx) const
 {
-	BindState state(this, is_weak, is_lazy);
+	BindState state(this, is_weak, is_lazy, cb, ctx);
 	const uint8_t* p = start;
 	while (p < end)
 	{
@@ -232,6 +247,69 @@ void MachOImpl::readBind(const uint8_t* start, const uint8_t* end, bool is_weak,
 	}
 }
 
+void MachOImpl::readDyldInfoBinds(BindCallback cb, void* ctx) const
+{
+	{
+		const uint8_t* p = reinterpret_cast<uint8_t*>(
+			m_base + m_dyinfo->bind_off);
+		const uint8_t* end = p + m_dyinfo->bind_size;
+		readBind(p, end, false, false, cb, ctx);
+	}
+
+	{
+		const uint8_t* p = reinterpret_cast<uint8_t*>(
+			m_base + m_dyinfo->lazy_bind_off);
+		const uint8_t* end = p + m_dyinfo->lazy_bind_size;
+		LOG << "Lazy bindings start at " << (void*)p << std::endl;
+		readBind(p, end, false, true, cb, ctx);
+	}
+
+	{
+		const uint8_t* p = reinterpret_cast<uint8_t*>(
+			m_base + m_dyinfo->weak_bind_off);
+		const uint8_t* end = p + m_dyinfo->weak_bind_size;
+		readBind(p, end, true, false, cb, ctx);
+	}
+}
+
+void MachOImpl::storeRebase(const Rebase& rebase, void* ctx)
+{
+	static_cast<MachOImpl*>(ctx)->m_rebases.push_back(new Rebase(rebase));
+}
+
+void MachOImpl::storeBind(const Bind& bind, void* ctx)
+{
+	static_cast<MachOImpl*>(ctx)->m_binds.push_back(new Bind(bind));
+}
+
+void MachOImpl::forEachRebase(RebaseCallback cb, void* ctx) const
+{
+	assert(m_mapped);
+
+	if (m_dyinfo && !m_need_fixups && m_dyinfo->rebase_off && m_dyinfo->rebase_size)
+	{
+		const uint8_t* p = reinterpret_cast<uint8_t*>(
+			m_base + m_dyinfo->rebase_off);
+		readRebase(p, p + m_dyinfo->rebase_size, cb, ctx);
+	}
+
+	// Either all rebases or only those coming from classic relocations
+	for (const Rebase* rebase : m_rebases)
+		cb(*rebase, ctx);
+}
+
+void MachOImpl::forEachBind(BindCallback cb, void* ctx) const
+{
+	assert(m_mapped);
+
+	if (m_dyinfo && !m_need_fixups)
+		readDyldInfoBinds(cb, ctx);
+
+	// Either all binds or only classic binds
+	for (const Bind* bind : m_binds)
+		cb(*bind, ctx);
+}
+
 void MachOImpl::readExport(const uint8_t* start, const uint8_t* p, const uint8_t* end, std::string* name_buf)
 {
 	if (p >= end)
@@ -242,7 +320,7 @@ void MachOImpl::readExport(const uint8_t* start, const uint8_t* p, const uint8_t
 		const uint8_t* expected_term_end = p + term_size;
 		Export* exp = new Export;
 		
-		exp->name = *name_buf;
+		exp->name = StringPool::intern(name_buf->c_str());
 		exp->flag = uleb128(p);
 		
 		// TODO: flag == 8 (EXPORT_SYMBOL_FLAGS_REEXPORT)
@@ -276,12 +354,89 @@ void MachOImpl::readExport(const uint8_t* start, const uint8_t* p, const uint8_t
 	}
 }
 
-MachOImpl::MachOImpl(const char* filename, int fd, size_t offset, size_t len, bool need_exports)
-	: m_mapped(0), m_mapped_size(len)
+void MachOImpl::readChainedFixups(const uint8_t* p, const uint8_t* end)
+{
+	const dyld_chained_fixups_header* header = reinterpret_cast<const dyld_chained_fixups_header*>(p);
+	const dyld_chained_starts_in_image* starts;
+	const char* symbols;
+
+	if (p + sizeof(*header) > end || header->fixups_version != 0)
+		throw std::runtime_error("Unsupported chained fixups version");
+	if (header->symbols_format != 0)
+		throw std::runtime_error("Compressed chained fixups symbols are not supported");
+
+	m_has_chained_fixups = true;
+
+	starts = reinterpret_cast<const dyld_chained_starts_in_image*>(p + header->starts_offset);
+	for (uint32_t i = 0; i < starts->seg_count; i++)
+	{
+		const dyld_chained_starts_in_segment* seg = nullptr;
+
+		if (starts->seg_info_offset[i])
+			seg = reinterpret_cast<const dyld_chained_starts_in_segment*>(
+				reinterpret_cast<const uint8_t*>(starts) + starts->seg_info_offset[i]);
+		m_chained_starts.push_back(seg);
+	}
+
+	symbols = reinterpret_cast<const char*>(p + header->symbols_offset);
+	m_chained_imports.reserve(header->imports_count);
+
+	for (uint32_t i = 0; i < header->imports_count; i++)
+	{
+		ChainedImport imp;
+
+		// Ordinals above 0xf0 are the negative BIND_SPECIAL_DYLIB_* values
+		switch (header->imports_format)
+		{
+			case DYLD_CHAINED_IMPORT:
+			{
+				const dyld_chained_import* e = reinterpret_cast<const dyld_chained_import*>(p + header->imports_offset) + i;
+				imp.name = symbols + e->name_offset;
+				imp.ordinal = (e->lib_ordinal > 0xf0) ? int8_t(e->lib_ordinal) : e->lib_ordinal;
+				imp.weak_import = e->weak_import;
+				imp.addend = 0;
+				break;
+			}
+			case DYLD_CHAINED_IMPORT_ADDEND:
+			{
+				const dyld_chained_import_addend* e = reinterpret_cast<const dyld_chained_import_addend*>(p + header->imports_offset) + i;
+				imp.name = symbols + e->name_offset;
+				imp.ordinal = (e->lib_ordinal > 0xf0) ? int8_t(e->lib_ordinal) : e->lib_ordinal;
+				imp.weak_import = e->weak_import;
+				imp.addend = e->addend;
+				break;
+			}
+			case DYLD_CHAINED_IMPORT_ADDEND64:
+			{
+				const dyld_chained_import_addend64* e = reinterpret_cast<const dyld_chained_import_addend64*>(p + header->imports_offset) + i;
+				imp.name = symbols + e->name_offset;
+				imp.ordinal = (e->lib_ordinal > 0xfff0) ? int16_t(e->lib_ordinal) : e->lib_ordinal;
+				imp.weak_import = e->weak_import;
+				imp.addend = e->addend;
+				break;
+			}
+			default:
+			{
+				std::stringstream ss;
+				ss << "Unknown chained import format: " << header->imports_format;
+				throw std::runtime_error(ss.str());
+			}
+		}
+
+		LOG << "chained import: " << imp.name << " ordinal=" << imp.ordinal << " addend=" << imp.addend << std::endl;
+		m_chained_imports.push_back(imp);
+	}
+}
+
+MachOImpl::MachOImpl(const char* filename, int fd, size_t offset, size_t len, bool need_exports, bool need_fixups)
+	: m_mapped(0), m_mapped_size(len), m_dyinfo(0)
 {
 	m_filename = filename;
 	m_need_exports = need_exports;
+	m_need_fixups = need_fixups;
 	m_dyld_data = 0;
+	m_has_chained_fixups = false;
+	memset(&m_symtab_info, 0, sizeof(m_symtab_info));
 	
 	assert(fd > 0);
 
@@ -380,34 +535,19 @@ void MachOImpl::processLoaderCommands(const mach_header* header)
 				dyinfo->lazy_bind_off, dyinfo->lazy_bind_size,
 				dyinfo->export_off, dyinfo->export_size);
 
+			m_dyinfo = dyinfo;
+			m_lazy_bind_info = std::make_pair(dyinfo->lazy_bind_off, dyinfo->lazy_bind_size);
+			m_export_trie_info = std::make_pair(dyinfo->export_off, dyinfo->export_size);
+
+			if (m_need_fixups)
 			{
 				const uint8_t* p = reinterpret_cast<uint8_t*>(
 					m_base + dyinfo->rebase_off);
 				const uint8_t* end = p + dyinfo->rebase_size;
 				if (dyinfo->rebase_off && dyinfo->rebase_size)
-					readRebase(p, end);
-			}
+					readRebase(p, end, storeRebase, this);
 
-			{
-				const uint8_t* p = reinterpret_cast<uint8_t*>(
-					m_base + dyinfo->bind_off);
-				const uint8_t* end = p + dyinfo->bind_size;
-				readBind(p, end, false);
-			}
-
-			{
-				const uint8_t* p = reinterpret_cast<uint8_t*>(
-					m_base + dyinfo->lazy_bind_off);
-				const uint8_t* end = p + dyinfo->lazy_bind_size;
-				LOG << "Lazy bindings start at " << (void*)p << std::endl;
-				readBind(p, end, false, true);
-			}
-
-			{
-				const uint8_t* p = reinterpret_cast<uint8_t*>(
-					m_base + dyinfo->weak_bind_off);
-				const uint8_t* end = p + dyinfo->weak_bind_size;
-				readBind(p, end, true);
+				readDyldInfoBinds(storeBind, this);
 			}
 
 			if (m_need_exports)
@@ -436,7 +576,12 @@ void MachOImpl::processLoaderCommands(const mach_header* header)
 			uint32_t* symtab_top = symtab = reinterpret_cast<uint32_t*>(m_base + symtab_cmd->symoff);
 			symstrtab = (const char*) m_base + symtab_cmd->stroff;
 
-			if (FLAGS_READ_SYMTAB)
+			m_symtab_info.symoff = symtab_cmd->symoff;
+			m_symtab_info.nsyms = symtab_cmd->nsyms;
+			m_symtab_info.stroff = symtab_cmd->stroff;
+			m_symtab_info.strsize = symtab_cmd->strsize;
+
+			if (FLAGS_READ_SYMTAB && m_need_exports)
 			{
 				for (uint32_t i = 0; i < symtab_cmd->nsyms; i++)
 				{
@@ -455,7 +600,7 @@ void MachOImpl::processLoaderCommands(const mach_header* header)
 					}
 
 					LOGF("%d %s(%d) %p\n",
-						i, sym.name.c_str(), nl->n_strx, (void*)sym.addr);
+						i, sym.name, nl->n_strx, (void*)sym.addr);
 					m_symbols.push_back(sym);
 				}
 			}
@@ -564,11 +709,17 @@ void MachOImpl::processLoaderCommands(const mach_header* header)
 		}
 
 		case LC_LOAD_DYLIB:
+		case LC_LOAD_WEAK_DYLIB:
+		case LC_REEXPORT_DYLIB:
+		case LC_LAZY_LOAD_DYLIB:
+		case LC_LOAD_UPWARD_DYLIB:
 		{
+			// All of them count when resolving bind ordinals
 			dylib* lib = &reinterpret_cast<dylib_command*>(cmds_ptr)->dylib;
 			const char* name = (char*)cmds_ptr + lib->name.offset;
 			LOG << "dylib: '" << name << "'\n";
 			m_dylibs.push_back(name);
+			m_weak_dylibs.push_back(cmds_ptr->cmd == LC_LOAD_WEAK_DYLIB);
 			break;
 		}
 
@@ -581,6 +732,41 @@ void MachOImpl::processLoaderCommands(const mach_header* header)
 			break;
 		}
 
+		case LC_DYLD_EXPORTS_TRIE:
+		{
+			linkedit_data_command* cmd = reinterpret_cast<linkedit_data_command*>(cmds_ptr);
+			LOGF("exports trie: dataoff=%u datasize=%u\n", cmd->dataoff, cmd->datasize);
+			m_export_trie_info = std::make_pair(cmd->dataoff, cmd->datasize);
+
+			if (m_need_exports && cmd->dataoff && cmd->datasize)
+			{
+				const uint8_t* p = reinterpret_cast<uint8_t*>(m_base + cmd->dataoff);
+				std::string buf;
+				readExport(p, p, p + cmd->datasize, &buf);
+			}
+			break;
+		}
+
+		case LC_FUNCTION_STARTS:
+		{
+			linkedit_data_command* cmd = reinterpret_cast<linkedit_data_command*>(cmds_ptr);
+			m_function_starts = std::make_pair(cmd->dataoff, cmd->datasize);
+			break;
+		}
+
+		case LC_DYLD_CHAINED_FIXUPS:
+		{
+			linkedit_data_command* cmd = reinterpret_cast<linkedit_data_command*>(cmds_ptr);
+			LOGF("chained fixups: dataoff=%u datasize=%u\n", cmd->dataoff, cmd->datasize);
+
+			if (cmd->dataoff && cmd->datasize)
+			{
+				const uint8_t* p = reinterpret_cast<uint8_t*>(m_base + cmd->dataoff);
+				readChainedFixups(p, p + cmd->datasize);
+			}
+			break;
+		}
+
 	}
 
 	cmds_ptr = reinterpret_cast<load_command*>(
@@ -774,11 +960,16 @@ void MachOImpl::close()
 		delete r;
 	m_relocations.clear();
 
+	// Both point into the mapped file
+	m_chained_imports.clear();
+	m_chained_starts.clear();
+
 	if (m_mapped)
 	{
 		::munmap(m_mapped, m_mapped_size);
 		::close(m_fd);
 		m_mapped = 0;
+		m_dyinfo = 0;
 		m_fd = -1;
 	}
 }
@@ -37,10 +37,13 @@ class MachOImpl : public MachO
 public:
 	// Takes ownership of fd.
 	// If len is 0, the size of file will be used as len.
-	MachOImpl(const char* filename, int fd, size_t offset, size_t len, bool need_exports);
+	MachOImpl(const char* filename, int fd, size_t offset, size_t len, bool need_exports, bool need_fixups);
 	
 	virtual ~MachOImpl();
 	virtual void close();
+
+	virtual void forEachRebase(RebaseCallback cb, void* ctx) const;
+	virtual void forEachBind(BindCallback cb, void* ctx) const;
 	
 	typedef long long ll;
 	typedef unsigned long long ull;
@@ -54,9 +57,15 @@ private:
 	template <class segment_command, class section>
 		void readSegment(char* cmds_ptr, std::vector<segment_command*>* segments, std::vector<section*>* bind_sections);
 		
-	void readRebase(const uint8_t* p, const uint8_t* end);
-	void readBind(const uint8_t* p, const uint8_t* end, bool is_weak, bool is_lazy = false);
+	void readRebase(const uint8_t* p, const uint8_t* end, RebaseCallback cb, void* ctx) const;
+	void readBind(const uint8_t* p, const uint8_t* end, bool is_weak, bool is_lazy, BindCallback cb, void* ctx) const;
+	void readDyldInfoBinds(BindCallback cb, void* ctx) const;
+
+	// Used to fill m_rebases and m_binds
+	static void storeRebase(const Rebase& rebase, void* ctx);
+	static void storeBind(const Bind& bind, void* ctx);
 	void readExport(const uint8_t* start, const uint8_t* p, const uint8_t* end, std::string* name_buf);
+	void readChainedFixups(const uint8_t* p, const uint8_t* end);
 
 	template <class section>
 		void readClassicBind(const section& sec, uint32_t* dysyms, uint32_t* symtab, const char* symstrtab);
@@ -69,7 +78,8 @@ private:
 
 	char* m_mapped;
 	size_t m_mapped_size;
-	bool m_need_exports;
+	bool m_need_exports, m_need_fixups;
+	const dyld_info_command* m_dyinfo; // points into m_mapped
 	intptr_t m_text_offset;
 	
 	struct sym
@@ -33,8 +33,8 @@
 
 typedef unsigned long long ull;
 
-RebaseState::RebaseState(MachOImpl* mach0)
-	: mach(mach0), type(0), seg_index(0), seg_offset(0)
+RebaseState::RebaseState(const MachOImpl* mach0, MachO::RebaseCallback cb0, void* ctx0)
+	: mach(mach0), cb(cb0), ctx(ctx0), type(0), seg_index(0), seg_offset(0)
 {
 }
 
@@ -105,7 +105,7 @@ bool RebaseState::readRebaseOp(const uint8_t*& p)
 
 void RebaseState::addRebase()
 {
-	MachO::Rebase* rebase = new MachO::Rebase();
+	MachO::Rebase rebase;
 	uint64_t vmaddr;
 	if (mach->m_is64)
 		vmaddr = mach->m_segments64[seg_index]->vmaddr;
@@ -114,9 +114,9 @@ void RebaseState::addRebase()
 
 	LOGF("add rebase! seg_index=%d seg_offset=%llu type=%d vmaddr=%p\n",
 			seg_index, (ull)seg_offset, type, (void*)vmaddr);
-	rebase->vmaddr = vmaddr + seg_offset;
-	rebase->type = type;
-	mach->m_rebases.push_back(rebase);
+	rebase.vmaddr = vmaddr + seg_offset;
+	rebase.type = type;
+	cb(rebase, ctx);
 
 	seg_offset += mach->m_ptrsize;
 }
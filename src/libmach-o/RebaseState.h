@@ -33,11 +33,13 @@
 
 struct RebaseState
 {
-	explicit RebaseState(MachOImpl* mach0);
+	RebaseState(const MachOImpl* mach0, MachO::RebaseCallback cb0, void* ctx0);
 	bool readRebaseOp(const uint8_t*& p);
 	void addRebase();
 
-	MachOImpl* mach;
+	const MachOImpl* mach;
+	MachO::RebaseCallback cb;
+	void* ctx;
 	uint8_t type;
 	int seg_index;
 	uint64_t seg_offset;
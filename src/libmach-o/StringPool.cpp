@@ -0,0 +1,128 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "StringPool.h"
+#include "mutex.h"
+#include "AtomicHashSet.h"
+#include "fnv.h"
+#include <cstring>
+#include <atomic>
+
+#define BLOCK_SIZE 65536
+
+namespace
+{
+	struct Pool
+	{
+		Pool();
+
+		const char* find(const char* str, size_t hash) const;
+		const char* insert(const char* str, bool copy);
+		const char* copy(const char* str, size_t len);
+
+		Darling::AtomicHashSet<const char> strings;
+		char* block;
+		size_t blockFree;
+		std::atomic<size_t> heapUsage;
+		Darling::Mutex writeMutex;
+	};
+}
+
+// Constructed on first use, images may be read before static initializers of dyld run.
+// Never destroyed, atexit handlers may still look up symbols.
+static Pool& pool()
+{
+	static Pool* p = new Pool;
+	return *p;
+}
+
+Pool::Pool()
+	: strings(4096), block(nullptr), blockFree(0), heapUsage(0)
+{
+}
+
+const char* Pool::find(const char* str, size_t hash) const
+{
+	return strings.find(hash, [str](const char* s) { return strcmp(s, str) == 0; });
+}
+
+const char* Pool::copy(const char* str, size_t len)
+{
+	char* p;
+
+	// Long names get their own allocation instead of wasting the rest of a block
+	if (len > BLOCK_SIZE / 16)
+		p = new char[len];
+	else
+	{
+		if (len > blockFree)
+		{
+			block = new char[BLOCK_SIZE];
+			blockFree = BLOCK_SIZE;
+		}
+
+		p = block;
+		block += len;
+		blockFree -= len;
+	}
+
+	memcpy(p, str, len);
+	heapUsage.fetch_add(len, std::memory_order_relaxed);
+
+	return p;
+}
+
+const char* Pool::insert(const char* str, bool copyString)
+{
+	size_t hash = Darling::fnv1a32(str);
+
+	if (const char* s = find(str, hash))
+		return s;
+
+	Darling::MutexLock l(writeMutex);
+
+	if (const char* s = find(str, hash))
+		return s; // someone else was faster
+
+	if (copyString)
+		str = copy(str, strlen(str) + 1);
+
+	strings.insert(hash, str);
+	return str;
+}
+
+const char* StringPool::intern(const char* str)
+{
+	return pool().insert(str, true);
+}
+
+const char* StringPool::internStable(const char* str)
+{
+	return pool().insert(str, false);
+}
+
+const char* StringPool::find(const char* str)
+{
+	return pool().find(str, Darling::fnv1a32(str));
+}
+
+size_t StringPool::heapUsage()
+{
+	return pool().heapUsage.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,57 @@
+/*
+This file is part of Darling.
+
+Copyright (C) 2013 Lubos Dolezel
+
+Darling is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Darling is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STRINGPOOL_H
+#define STRINGPOOL_H
+#include <stddef.h>
+#include <stdint.h>
+
+// Process-wide table of interned symbol names.
+//
+// Every distinct name is stored once, so two interned names are equal exactly when their pointers are.
+// Names are copied into large blocks, unless internStable() is given memory that is never unmapped
+// (e.g. the string table in a loaded __LINKEDIT), which is then referenced in place.
+// Nothing is ever removed. Lookups take no locks, insertions are serialized.
+class StringPool
+{
+public:
+	__attribute__ ((visibility ("default")))
+	static const char* intern(const char* str);
+
+	// str must stay valid for the lifetime of the process
+	__attribute__ ((visibility ("default")))
+	static const char* internStable(const char* str);
+
+	// Returns nullptr if str has never been interned
+	__attribute__ ((visibility ("default")))
+	static const char* find(const char* str);
+
+	// Hash of an interned name, cheaper than hashing its characters
+	static size_t hashInterned(const char* interned)
+	{
+		uintptr_t v = reinterpret_cast<uintptr_t>(interned);
+		return size_t(v ^ (v >> 7) ^ (v >> 17));
+	}
+
+	// Bytes of copied names
+	__attribute__ ((visibility ("default")))
+	static size_t heapUsage();
+};
+
+#endif
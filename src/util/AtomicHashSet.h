@@ -0,0 +1,167 @@
+#ifndef DARLING_ATOMICHASHSET_H
+#define DARLING_ATOMICHASHSET_H
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+#include <cassert>
+
+namespace Darling
+{
+
+// Open addressing hash set of pointers, for lookups that must not take any locks.
+//
+// Insertions have to be serialized by the caller and values are never removed.
+// The table is replaced as a whole when it grows. Readers may still be probing the old one,
+// so it is kept until freeRetired() says it's safe, or until the set is destroyed.
+template <typename T>
+class AtomicHashSet
+{
+public:
+	explicit AtomicHashSet(size_t size = 16)
+		: m_table(allocTable(size))
+	{
+	}
+
+	~AtomicHashSet()
+	{
+		freeRetired();
+		freeTable(m_table.load());
+	}
+
+	// matches(const T*) compares the actual keys of values whose hash is equal
+	template <typename Match>
+	T* find(size_t hash, Match matches) const
+	{
+		const Table* table = m_table.load(std::memory_order_acquire);
+
+		for (size_t i = hash & table->mask; ; i = (i + 1) & table->mask)
+		{
+			T* value = table->slots[i].value.load(std::memory_order_acquire);
+
+			if (!value)
+				return nullptr;
+			if (table->slots[i].hash == hash && matches(value))
+				return value;
+		}
+	}
+
+	// The value is visible to readers once this returns, so it has to be fully initialized
+	void insert(size_t hash, T* value)
+	{
+		Table* table = m_table.load(std::memory_order_relaxed);
+
+		// Keep the load factor under 3/4
+		if ((table->count + 1) * 4 > (table->mask + 1) * 3)
+		{
+			Table* bigger = allocTable((table->mask + 1) * 2);
+
+			for (size_t i = 0; i <= table->mask; i++)
+			{
+				if (T* old = table->slots[i].value.load(std::memory_order_relaxed))
+					place(bigger, table->slots[i].hash, old);
+			}
+
+			m_table.store(bigger, std::memory_order_release);
+			m_retired.push_back(table);
+			table = bigger;
+		}
+
+		place(table, hash, value);
+	}
+
+	// Puts a value in place of another one with the same hash, serialized with insert().
+	// Readers see either of them, so the old one has to stay valid for as long as they may.
+	void replace(size_t hash, T* old, T* value)
+	{
+		Table* table = m_table.load(std::memory_order_relaxed);
+
+		for (size_t i = hash & table->mask; ; i = (i + 1) & table->mask)
+		{
+			T* current = table->slots[i].value.load(std::memory_order_relaxed);
+
+			assert(current != nullptr);
+			if (current == old)
+			{
+				table->slots[i].value.store(value, std::memory_order_release);
+				return;
+			}
+		}
+	}
+
+	// Calls f(T*) for every value, serialized with insert()
+	template <typename Func>
+	void forEach(Func f) const
+	{
+		const Table* table = m_table.load(std::memory_order_relaxed);
+
+		for (size_t i = 0; i <= table->mask; i++)
+		{
+			if (T* value = table->slots[i].value.load(std::memory_order_relaxed))
+				f(value);
+		}
+	}
+
+	// Only once no reader can be probing a replaced table anymore
+	void freeRetired()
+	{
+		for (Table* table : m_retired)
+			freeTable(table);
+		m_retired.clear();
+	}
+
+	AtomicHashSet(const AtomicHashSet&) = delete;
+	AtomicHashSet& operator=(const AtomicHashSet&) = delete;
+private:
+	struct Slot
+	{
+		size_t hash; // written before the value is published
+		std::atomic<T*> value;
+	};
+
+	struct Table
+	{
+		size_t mask, count;
+		Slot* slots;
+	};
+
+	static Table* allocTable(size_t size)
+	{
+		Table* table = new Table;
+
+		assert((size & (size-1)) == 0);
+
+		table->mask = size - 1;
+		table->count = 0;
+		table->slots = new Slot[size];
+
+		for (size_t i = 0; i < size; i++)
+			table->slots[i].value.store(nullptr, std::memory_order_relaxed);
+
+		return table;
+	}
+
+	static void freeTable(Table* table)
+	{
+		delete [] table->slots;
+		delete table;
+	}
+
+	static void place(Table* table, size_t hash, T* value)
+	{
+		size_t i = hash & table->mask;
+
+		while (table->slots[i].value.load(std::memory_order_relaxed))
+			i = (i + 1) & table->mask;
+
+		table->slots[i].hash = hash;
+		table->slots[i].value.store(value, std::memory_order_release);
+		table->count++;
+	}
+
+	std::atomic<Table*> m_table;
+	std::vector<Table*> m_retired;
+};
+
+}
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef DARLING_FNV_H
+#define DARLING_FNV_H
+#include <stdint.h>
+#include <stddef.h>
+
+namespace Darling
+{
+
+// FNV-1a. The 64-bit hash names files on disk (prebind caches, launch closures, lazy bind profiles)
+// and the 32-bit one is baked into the generated namemap.h, so neither may change.
+const uint32_t FNV32_BASIS = 2166136261u;
+const uint64_t FNV64_BASIS = 14695981039346656037ull;
+
+inline uint32_t fnv1a32(const char* str, uint32_t h = FNV32_BASIS)
+{
+	while (*str)
+	{
+		h ^= uint8_t(*str++);
+		h *= 16777619u;
+	}
+	return h;
+}
+
+inline uint64_t fnv1a64(const void* data, size_t len, uint64_t h = FNV64_BASIS)
+{
+	const uint8_t* p = static_cast<const uint8_t*>(data);
+
+	for (size_t i = 0; i < len; i++)
+	{
+		h ^= p[i];
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+}
+
+#endif
@@ -1,13 +1,30 @@
 #include <iostream>
 #include <algorithm>
 #include <vector>
+#include <map>
 #include <fstream>
+#include <stdint.h>
+#include "fnv.h"
 
 std::vector<std::string> split(std::string str, char c);
+static int genHashTable(std::ifstream& ifs, std::ofstream& ofs);
 
 int main(int argc, char** argv)
 {
 	std::string line;
+
+	if (argc == 4 && std::string(argv[1]) == "--table")
+	{
+		std::ifstream ifs(argv[2]);
+		std::ofstream ofs(argv[3]);
+		return genHashTable(ifs, ofs);
+	}
+	else if (argc != 3)
+	{
+		std::cerr << "Usage: " << argv[0] << " [--table] <list> <output>\n";
+		return 1;
+	}
+
 	std::ifstream ifs(argv[1]);
 	std::ofstream ofs(argv[2]);
 
@@ -84,6 +101,158 @@ int main(int argc, char** argv)
 	return 0;
 }
 
+// Must match nameMapHash() in the generated header
+static uint32_t hashName(const std::string& name, uint32_t seed)
+{
+	return Darling::fnv1a32(name.c_str(), Darling::FNV32_BASIS ^ seed);
+}
+
+// Hash and displace: keys are split into buckets by their seed 0 hash,
+// then every bucket (largest first) gets the first seed that puts all its keys into free slots.
+static void buildPerfectHash(const std::map<std::string,std::string>& map,
+		std::vector<uint32_t>& seeds, std::vector<const std::pair<const std::string,std::string>*>& slots)
+{
+	size_t nbuckets = map.size() / 4 + 1;
+	size_t nslots = 1;
+	std::vector<std::vector<const std::pair<const std::string,std::string>*> > buckets(nbuckets);
+	std::vector<size_t> order;
+
+	while (nslots < map.size() + map.size() / 4 + 1)
+		nslots *= 2;
+
+	seeds.assign(nbuckets, 0);
+	slots.assign(nslots, nullptr);
+
+	for (const auto& entry : map)
+		buckets[hashName(entry.first, 0) % nbuckets].push_back(&entry);
+
+	for (size_t i = 0; i < nbuckets; i++)
+		order.push_back(i);
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return buckets[a].size() > buckets[b].size(); });
+
+	for (size_t b : order)
+	{
+		if (buckets[b].empty())
+			break;
+
+		for (uint32_t seed = 1; ; seed++)
+		{
+			std::vector<size_t> taken;
+			bool ok = true;
+
+			for (const auto* entry : buckets[b])
+			{
+				size_t pos = hashName(entry->first, seed) & (nslots - 1);
+
+				if (slots[pos] || std::find(taken.begin(), taken.end(), pos) != taken.end())
+				{
+					ok = false;
+					break;
+				}
+				taken.push_back(pos);
+			}
+
+			if (!ok)
+				continue;
+
+			for (size_t i = 0; i < taken.size(); i++)
+				slots[taken[i]] = buckets[b][i];
+			seeds[b] = seed;
+			break;
+		}
+	}
+}
+
+static void writeTable(std::ofstream& ofs, const std::map<std::string,std::string>& map)
+{
+	std::vector<uint32_t> seeds;
+	std::vector<const std::pair<const std::string,std::string>*> slots;
+
+	buildPerfectHash(map, seeds, slots);
+
+	ofs << "static const uint32_t g_nameMapSeeds[" << seeds.size() << "] = {";
+	for (size_t i = 0; i < seeds.size(); i++)
+		ofs << (i % 16 ? " " : "\n\t") << seeds[i] << ',';
+	ofs << "\n};\n";
+
+	ofs << "static const NameMapEntry g_nameMapEntries[" << slots.size() << "] = {\n";
+	for (const auto* slot : slots)
+	{
+		if (slot)
+			ofs << "\t{ \"" << slot->first << "\", \"" << slot->second << "\" },\n";
+		else
+			ofs << "\t{ nullptr, nullptr },\n";
+	}
+	ofs << "};\n";
+}
+
+// Emits a C++ header with a static perfect hash table of the mappings.
+// Entries prefixed with 32! or 64! only go into the table for that word size.
+static int genHashTable(std::ifstream& ifs, std::ofstream& ofs)
+{
+	std::map<std::string,std::string> map32, map64;
+	std::string line;
+
+	if (!ifs.is_open() || !ofs.is_open())
+	{
+		std::cerr << "Cannot open the input or output file\n";
+		return 1;
+	}
+
+	while (std::getline(ifs, line))
+	{
+		if (line.empty() || line[0] == '#')
+			continue;
+
+		std::vector<std::string> tok = split(line, ';');
+
+		if (tok.size() != 2)
+		{
+			std::cerr << "Invalid line: " << line << std::endl;
+			continue;
+		}
+
+		// Later lines win, like they used to when the list was parsed at runtime
+		if (tok[0].compare(0, 3, "32!") == 0)
+			map32[tok[0].substr(3)] = tok[1];
+		else if (tok[0].compare(0, 3, "64!") == 0)
+			map64[tok[0].substr(3)] = tok[1];
+		else
+			map32[tok[0]] = map64[tok[0]] = tok[1];
+	}
+
+	ofs << "// Generated by genfuncmap, do not edit\n"
+		"#include <stdint.h>\n"
+		"#include <string.h>\n"
+		"#include \"fnv.h\"\n\n"
+		"struct NameMapEntry\n{\n\tconst char* name;\n\tconst char* target;\n};\n\n";
+
+	ofs << "#ifdef __i386__\n";
+	writeTable(ofs, map32);
+	ofs << "#else\n";
+	writeTable(ofs, map64);
+	ofs << "#endif\n\n";
+
+	ofs << "static inline uint32_t nameMapHash(const char* s, uint32_t seed)\n"
+		"{\n"
+		"\treturn Darling::fnv1a32(s, Darling::FNV32_BASIS ^ seed);\n"
+		"}\n\n";
+
+	ofs << "// Returns the target of a mapped name or nullptr\n"
+		"static inline const char* nameMapFind(const char* name)\n"
+		"{\n"
+		"\tconst size_t nbuckets = sizeof(g_nameMapSeeds) / sizeof(g_nameMapSeeds[0]);\n"
+		"\tconst size_t nslots = sizeof(g_nameMapEntries) / sizeof(g_nameMapEntries[0]);\n"
+		"\tuint32_t seed = g_nameMapSeeds[nameMapHash(name, 0) % nbuckets];\n"
+		"\tconst NameMapEntry& e = g_nameMapEntries[nameMapHash(name, seed) & (nslots - 1)];\n\n"
+		"\tif (!seed || !e.name || strcmp(e.name, name) != 0)\n"
+		"\t\treturn nullptr;\n"
+		"\treturn e.target;\n"
+		"}\n";
+
+	return ofs.good() ? 0 : 1;
+}
+
 std::vector<std::string> split(std::string str, char c)
 {
 	std::vector<std::string> rv;
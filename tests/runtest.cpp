@@ -25,6 +25,7 @@ void bits(const char* progname);
 void runTest(const char* path);
 std::string uniqueName(const std::string& path);
 std::string cflags(const char* path);
+std::string dylib(const char* path);
 const char* compiler(const char* path);
 std::string stripext(std::string file);
 
@@ -191,6 +192,7 @@ void runTest(const char* path)
 	std::string binary;
 	std::string out, err;
 	std::string dirname, filename = "/tmp/darlingtest-";
+	std::string library;
 	int rv;
 
 	filename += getenv("USER");
@@ -201,6 +203,11 @@ void runTest(const char* path)
 	mkdir(dirname.c_str(), 0700);
 
 	binary = stripext(filename);
+
+	// The library is downloaded to the same path, where its install name points to
+	library = dylib(path);
+	if (!library.empty())
+		library = dirname + uniqueName(library);
 	
 	termcolor::set(termcolor::WHITE, termcolor::BLACK, termcolor::DIM);
 
@@ -216,7 +223,17 @@ void runTest(const char* path)
 	{
 		std::cout << "Compiling...\n";
 		// compile the code remotely
-		cmd << compiler(path) << ' ' << cflags(path) << filename << " -o " << binary;
+		if (!library.empty())
+		{
+			cmd << compiler(path) << ' ' << cflags(path) << "-dynamiclib -DDYLIB " << filename << " -o " << library;
+			rv = g_ssh->runCommand(cmd.str(), out, err);
+
+			if (rv)
+				throw compile_error(err);
+			cmd.str("");
+		}
+
+		cmd << compiler(path) << ' ' << cflags(path) << filename << ' ' << library << " -o " << binary;
 		rv = g_ssh->runCommand(cmd.str(), out, err);
 
 		if (rv)
@@ -232,6 +249,8 @@ void runTest(const char* path)
 		std::cout << "Downloading...\n";
 		// download the Mach-O executable
 		g_sftp->download(binary, binary);
+		if (!library.empty())
+			g_sftp->download(library, library);
 
 		std::cout << "Running locally...\n";
 		// run the executable via dyld
@@ -250,12 +269,16 @@ void runTest(const char* path)
 
 		// clean up locally
 		unlink(binary.c_str());
+		if (!library.empty())
+			unlink(library.c_str());
 
 		try
 		{
 			// clean up remotely
 			g_sftp->unlink(binary);
 			g_sftp->unlink(filename);
+			if (!library.empty())
+				g_sftp->unlink(library);
 		}
 		catch (...) {}
 
@@ -264,12 +287,16 @@ void runTest(const char* path)
 	{
 		// clean up locally
 		unlink(binary.c_str());
+		if (!library.empty())
+			unlink(library.c_str());
 
 		try
 		{
 			// clean up remotely
 			g_sftp->unlink(binary);
 			g_sftp->unlink(filename);
+			if (!library.empty())
+				g_sftp->unlink(library);
 		}
 		catch (...) {}
 
@@ -303,6 +330,22 @@ std::string cflags(const char* path)
 	return cflags;
 }
 
+// The shared library the test needs, built from the same source with DYLIB defined
+std::string dylib(const char* path)
+{
+	std::ifstream f(path);
+	std::string line;
+
+	// Only the leading comments are looked at
+	while (std::getline(f, line) && line.compare(0, 2, "//") == 0)
+	{
+		if (line.compare(0, 10, "// DYLIB: ") == 0)
+			return line.substr(10);
+	}
+
+	return std::string();
+}
+
 const char* compiler(const char* path)
 {
 	const char* suffix = strrchr(path, '.');
@@ -0,0 +1,76 @@
+// CFLAGS: -Wl,-fixup_chains
+// Every pointer in __DATA is a link of a fixup chain: rebases, binds, binds with an addend, vtables.
+#include <cstdio>
+#include <cstring>
+
+struct Shape
+{
+	virtual ~Shape() {}
+	virtual const char* name() const = 0;
+	virtual int corners() const = 0;
+};
+
+struct Triangle : Shape
+{
+	const char* name() const { return "triangle"; }
+	int corners() const { return 3; }
+};
+
+struct Square : Shape
+{
+	const char* name() const { return "square"; }
+	int corners() const { return 4; }
+};
+
+static const char greeting[] = "hello chained fixups";
+
+// Rebases, one of them with an addend
+static const char* strings[] = { greeting, greeting + 6, "literal" };
+
+static int counter = 7;
+static int* counterPtr = &counter;
+
+// Binds to libSystem, and one with an addend
+static size_t (*strlenPtr)(const char*) = strlen;
+static int (*printfPtr)(const char*, ...) = printf;
+static const char* strlenPlusOne = reinterpret_cast<const char*>(strlen) + 1;
+
+// Long enough to need several pages, and so several chain starts
+static int values[2048];
+static int* bigTable[] = {
+#define P(n) &values[n], &values[n + 1], &values[n + 2], &values[n + 3], &values[n + 4], &values[n + 5], &values[n + 6], &values[n + 7]
+#define P64(n) P(n), P(n + 8), P(n + 16), P(n + 24), P(n + 32), P(n + 40), P(n + 48), P(n + 56)
+	P64(0), P64(64), P64(128), P64(192), P64(256), P64(320), P64(384), P64(448),
+	P64(512), P64(576), P64(640), P64(704), P64(768), P64(832), P64(896), P64(960),
+	P64(1024), P64(1088), P64(1152), P64(1216), P64(1280), P64(1344), P64(1408), P64(1472),
+	P64(1536), P64(1600), P64(1664), P64(1728), P64(1792), P64(1856), P64(1920), P64(1984),
+};
+static int** bigTableEnd = &bigTable[2047];
+
+int main()
+{
+	Shape* shapes[] = { new Triangle, new Square };
+	int ok = 1;
+
+	for (const char* s : strings)
+		printf("%s\n", s);
+	printf("counter: %d\n", *counterPtr);
+
+	printfPtr("strlen: %d\n", int(strlenPtr(greeting)));
+	printf("bind addend: %s\n", strlenPlusOne - 1 == reinterpret_cast<const char*>(strlen) ? "ok" : "wrong");
+
+	for (int i = 0; i < int(sizeof(bigTable) / sizeof(bigTable[0])); i++)
+	{
+		if (bigTable[i] != &values[i])
+			ok = 0;
+	}
+	printf("table: %s\n", ok && *bigTableEnd == &values[2047] ? "ok" : "wrong");
+
+	for (Shape* shape : shapes)
+	{
+		printf("%s has %d corners\n", shape->name(), shape->corners());
+		delete shape;
+	}
+
+	return 0;
+}
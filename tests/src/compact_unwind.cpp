@@ -0,0 +1,104 @@
+// CFLAGS: -O2 -fomit-frame-pointer -Wl,-no_keep_dwarf_unwind
+// Throws through functions that only __unwind_info describes: their __eh_frame entries are dropped by the linker.
+#include <iostream>
+#include <cstring>
+#include <stdexcept>
+
+#define NOINLINE __attribute__((noinline))
+
+static volatile int g_depth = 3;
+
+NOINLINE void thrower(int value)
+{
+	if (value >= 0)
+		throw std::runtime_error("thrown");
+	std::cout << "not thrown\n";
+}
+
+// Frameless, the values live across the call are kept in callee-saved registers
+NOINLINE int frameless(int x)
+{
+	int a = x * 3, b = x * 5, c = x * 7, d = x * 11, e = x * 13;
+
+	thrower(x);
+	return a ^ b ^ c ^ d ^ e;
+}
+
+// Frameless with a stack too big for the immediate encoding, the size is read from the sub instruction
+NOINLINE int stackIndirect(int x)
+{
+	volatile char buf[8192];
+	int a = x + 1, b = x + 2;
+
+	memset((char*) buf, x, sizeof(buf));
+	a += frameless(buf[100]);
+	return a + b + buf[4000];
+}
+
+// The variable length array forces a frame pointer
+NOINLINE int rbpFrame(int x)
+{
+	volatile char vla[g_depth * 100 + x];
+
+	vla[0] = x;
+	return stackIndirect(vla[0]) + vla[1];
+}
+
+struct Guard
+{
+	const char* name;
+	Guard(const char* name) : name(name) {}
+	~Guard() { std::cout << "cleanup in " << name << std::endl; }
+};
+
+// Needs the personality and the LSDA: a cleanup, and a handler that rethrows
+NOINLINE int withLSDA(int x)
+{
+	Guard g("withLSDA");
+	int saved = x * 17;
+
+	try
+	{
+		return rbpFrame(x);
+	}
+	catch (const std::logic_error&)
+	{
+		std::cout << "wrong handler\n";
+	}
+	catch (const std::runtime_error& e)
+	{
+		std::cout << "caught " << e.what() << " in withLSDA, saved = " << saved << std::endl;
+		throw;
+	}
+	return 0;
+}
+
+int main()
+{
+	// Callee-saved registers have to be restored when the exception lands here
+	int a = g_depth * 2, b = g_depth * 3, c = g_depth * 4;
+
+	for (int i = 0; i < 3; i++)
+	{
+		try
+		{
+			withLSDA(i);
+			std::cout << "no exception\n";
+		}
+		catch (const std::exception& e)
+		{
+			std::cout << "caught " << e.what() << " in main, " << a << ' ' << b << ' ' << c << std::endl;
+		}
+	}
+
+	try
+	{
+		frameless(1);
+	}
+	catch (const std::exception& e)
+	{
+		std::cout << "caught " << e.what() << " straight from frameless\n";
+	}
+
+	return 0;
+}
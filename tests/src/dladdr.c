@@ -0,0 +1,49 @@
+// CFLAGS: -rdynamic
+#define _GNU_SOURCE // Dl_info on Linux
+#include <stdio.h>
+#include <string.h>
+#include <dlfcn.h>
+
+int exported_data = 42;
+
+int exported_function(int a)
+{
+	if (a > 100)
+		return a / 3;
+	return a * 3 + 1;
+}
+
+int another_function(int a)
+{
+	return exported_function(a) - 1;
+}
+
+static void lookup(const char* what, const void* p, const char* self)
+{
+	Dl_info info;
+
+	if (!dladdr(p, &info))
+	{
+		printf("%s: not found\n", what);
+		return;
+	}
+
+	printf("%s: %s+%ld, in this image: %s, above its base: %s\n", what,
+		info.dli_sname ? info.dli_sname : "(none)",
+		(long) ((const char*) p - (const char*) info.dli_saddr),
+		strstr(info.dli_fname, self) ? "yes" : "no",
+		(const char*) info.dli_fbase <= (const char*) p ? "yes" : "no");
+}
+
+int main(int argc, char** argv)
+{
+	const char* self = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+
+	lookup("exported_function", (const void*) exported_function, self);
+	lookup("exported_function+4", (const char*) exported_function + 4, self);
+	lookup("another_function", (const void*) another_function, self);
+	lookup("exported_data", &exported_data, self);
+	lookup("main", (const void*) main, self);
+
+	return another_function(1) != 3;
+}
@@ -0,0 +1,40 @@
+// DYLIB: libweak_coalescing.dylib
+// The library and the program both define the same weak symbols, they must end up using a single copy of each.
+#include <cstdio>
+
+inline int& sharedCounter()
+{
+	static int counter;
+	return counter;
+}
+
+template <typename T> struct Registry
+{
+	static int value;
+};
+template <typename T> int Registry<T>::value = 5;
+
+#ifdef DYLIB
+
+extern "C" int* libraryCounter() { return &sharedCounter(); }
+extern "C" int* libraryValue() { return &Registry<int>::value; }
+extern "C" void* libraryFunction() { return (void*) &sharedCounter; }
+
+#else
+
+extern "C" int* libraryCounter();
+extern "C" int* libraryValue();
+extern "C" void* libraryFunction();
+
+int main()
+{
+	printf("inline function static: %s\n", libraryCounter() == &sharedCounter() ? "same" : "different");
+	printf("template static member: %s\n", libraryValue() == &Registry<int>::value ? "same" : "different");
+	printf("inline function: %s\n", libraryFunction() == (void*) &sharedCounter ? "same" : "different");
+
+	sharedCounter() = 42;
+	printf("counter seen by the library: %d\n", *libraryCounter());
+	return 0;
+}
+
+#endif